@@ -36,7 +36,7 @@ NOINLINE void* PodArrayBase::_resize(GC& gc, tsize n, tsize elementSize)
 // ------------------------
 
 DArray::DArray(Type t)
-    : sz(0), cap(0), t(t), elementSize(GetPrimTypeStorageSize(t))
+    : sz(0), cap(0), t(t), elementSize(GetPrimTypeStorageSize(t)), parent(NULL), offset(0), stride(1)
 {
     storage.p = NULL;
 }
@@ -70,6 +70,50 @@ DArray* DArray::GCNew(GC& gc, tsize prealloc, Type t)
     return a;
 }
 
+DArray* DArray::GCNewView(GC& gc, DArray *a, tsize offset, tsize len, tsize stride)
+{
+    if(!stride)
+        return NULL;
+
+    // Out of range for the array we're making a view of?
+    if(len && (offset >= a->sz || (a->sz - 1 - offset) / stride < len - 1))
+        return NULL;
+
+    // Collapse view of a view
+    if(DArray *p = a->parent)
+    {
+        offset = a->offset + offset * a->stride;
+        stride *= a->stride;
+        a = p;
+    }
+
+    void *pa = gc_new(gc, sizeof(DArray), PRIMTYPE_ARRAY);
+    if(!pa)
+        return NULL;
+
+    DArray *v = GA_PLACEMENT_NEW(pa) DArray(a->t);
+    v->sz = len;
+    v->parent = a;
+    v->offset = offset;
+    v->stride = stride;
+    return v;
+}
+
+void *DArray::contiguousData() const
+{
+    if(!parent)
+        return storage.p;
+
+    // Empty views are always fine, the pointer just isn't used
+    if(!sz)
+        return parent->storage.p;
+
+    if(stride != 1 || offset + sz > parent->sz)
+        return NULL;
+
+    return parent->storage.b + size_t(offset) * elementSize;
+}
+
 void DArray::dealloc(GC& gc)
 {
     if(cap)
@@ -81,11 +125,13 @@ void DArray::dealloc(GC& gc)
 
 void* DArray::ensure(GC& gc, tsize n)
 {
+    assert(!parent && "Can't resize a view");
     return n <= cap ? storage.p : _resize(gc, n);
 }
 
 void* DArray::enlarge(GC& gc, tsize minsize)
 {
+    assert(!parent && "Can't resize a view");
     if(minsize <= cap)
         return storage.p;
 
@@ -117,6 +163,9 @@ Val DArray::dynamicLookup(tsize idx) const
     if(idx >= sz)
         return _Nil();
 
+    if(parent)
+        return parent->dynamicLookup(offset + idx * stride);
+
     if(t >= PRIMTYPE_ANY)
         return storage.vals[idx];
 
@@ -149,6 +198,12 @@ void DArray::dynamicAppend(GC& gc, ValU v)
 Val DArray::dynamicSet(tsize idx, ValU v)
 {
     assert(idx < sz); // TODO: error
+    if(parent)
+    {
+        const tsize pidx = offset + idx * stride;
+        return pidx < parent->sz ? parent->dynamicSet(pidx, v) : _Nil();
+    }
+
     ValU ret;
     if(t >= PRIMTYPE_ANY)
     {
@@ -169,6 +224,7 @@ Val DArray::dynamicSet(tsize idx, ValU v)
 Val DArray::removeAtAndMoveLast_Unsafe(tsize idx)
 {
     assert(idx < sz);
+    assert(!parent && "Views are fixed-size");
 
     ValU v;
     const size_t lastidx = --sz;
@@ -195,6 +251,6 @@ Val DArray::popValue()
 
     const tsize idx = sz - 1;
     Val v = dynamicLookup(idx);
-    sz = idx;
+    sz = idx; // For views, this just makes the view shorter
     return v;
 }
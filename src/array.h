@@ -76,6 +76,8 @@ public:
         if(newsz > cap)
         {
             size_t newcap = cap * 2 + sz; // alloc some more to amortize re-allocations
+            if(newcap < newsz)
+                newcap = newsz;
             a = this->_chsize(gc, newcap);
             if(!a)
                 return NULL;
@@ -105,7 +107,12 @@ private:
 };
 
 
-// Dynamically typed array with external allocator
+// Dynamically typed array with external allocator.
+// Can also be a view into another array: Then parent is set, the view owns no storage,
+// and element i maps to parent element (offset + i * stride).
+// Views never nest; a view of a view refers to the original array directly.
+// Views are fixed-size and can't be appended to. Accessing an element that is in range for the view
+// but no longer exists in the parent (because the parent shrunk) gives nil.
 class DArray : public GCobj
 {
 public:
@@ -116,7 +123,7 @@ public:
         sint *si;
         unsigned char *b;
         real *f;
-        sref *s;
+        _AnyValU *s; // Ref or inline string, see strings.h
         void *p;
         Type *ts;
         GCobj *objs;
@@ -125,12 +132,19 @@ public:
     tsize cap; // capacity in elements
     const Type t; // element type
     const tsize elementSize;
+    DArray *parent; // NULL if this is a regular array; otherwise keeps the parent alive
+    tsize offset; // views only: first element in parent
+    tsize stride; // views only: step between elements in parent, >= 1
 
     void *ensure(GC& gc, tsize n);
     void *enlarge(GC& gc, tsize minsize);
     void *_resize(GC& gc, tsize n);
 
     static DArray *GCNew(GC& gc, tsize prealloc, Type t);
+    static DArray *GCNewView(GC& gc, DArray *a, tsize offset, tsize len, tsize stride); // O(1), doesn't copy
+
+    FORCEINLINE bool isView() const { return !!parent; }
+    void *contiguousData() const; // Pointer to first element, or NULL if the elements aren't contiguous
 
     FORCEINLINE usize size() const { return sz; }
     Val dynamicLookup(tsize idx) const;
@@ -0,0 +1,227 @@
+#include "compilecache.h"
+#include "mlir.h"
+#include "symstore.h"
+#include "strings.h"
+#include "valstore.h"
+#include "hashfunc.h"
+#include "serialio.h"
+#include "io_libc.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Cache entry format. All numbers are vu128-encoded.
+   MAGIC_FILE_VARIANT('C')  -- 8 bytes. The version bytes must match exactly.
+   names                    -- ValStore::serialize(). Names of all symbols below.
+   #externals, then per external: name idx, signature at the time of compiling
+   #exports, then per export: name idx, type
+   module                   -- MLIR::dump()
+   The file name is the key.
+*/
+
+enum
+{
+    // Bump this whenever the compiler output changes without a file format change, to invalidate all entries.
+    COMPILER_REVISION = 2
+};
+
+static bool writevu(BufSink *sk, unsigned x)
+{
+    unsigned char buf[5];
+    return !sk->Write(sk, buf, vu128enc(buf, x));
+}
+
+CompileCache::CompileCache(const char *dir)
+    : _dir(dir), _extsigf(NULL), _extsigud(NULL)
+{
+}
+
+void CompileCache::setExtSig(ExtSigFunc f, void *ud)
+{
+    _extsigf = f;
+    _extsigud = ud;
+}
+
+CompileCache::Key CompileCache::key(const void *src, size_t len)
+{
+    static const byte magic[] = MAGIC_FILE_VARIANT('C');
+    const uhash v = memhash(COMPILER_REVISION, magic, sizeof(magic)) ^ uhash(len);
+
+    // Two independently seeded hashes make a 64 bit key
+    Key k;
+    k.h[0] = memhash(v, src, len);
+    k.h[1] = memhash(rotl(v, 16) ^ 0x9e3779b9u, src, len);
+    return k;
+}
+
+uhash CompileCache::_extsig(const char *name, size_t len) const
+{
+    return _extsigf ? _extsigf(_extsigud, name, len) : 0;
+}
+
+bool CompileCache::_path(char *buf, size_t bufsize, const Key& k, const char *ext) const
+{
+    const int n = snprintf(buf, bufsize, "%s/%08x%08x%s", _dir, k.h[0], k.h[1], ext);
+    return n > 0 && size_t(n) < bufsize;
+}
+
+// Everything up to and including the name table
+static bool readnames(BufStream *sm, ValStore& names, StringPool& sp)
+{
+    static const byte magic[] = MAGIC_FILE_VARIANT('C');
+    byte hdr[sizeof(magic)];
+    return !sm_read(sm, hdr, sizeof(hdr)) && !memcmp(hdr, magic, sizeof(magic))
+        && names.deserialize(sm, sp);
+}
+
+static bool readname(BufStream *sm, const ValStore& names, unsigned *name)
+{
+    return !sm_readvu(sm, name) && *name < names.vals.size() && names.vals[*name].type == PRIMTYPE_STRING;
+}
+
+static bool readexports(BufStream *sm, const ValStore& names, StringPool& sp, GC& gc, PodArray<CompileCache::Sym> *exports)
+{
+    unsigned n = 0;
+    bool ok = !sm_readvu(sm, &n);
+    for(unsigned i = 0; ok && i < n; ++i)
+    {
+        unsigned name, type;
+        ok = readname(sm, names, &name) && !sm_readvu(sm, &type);
+        if(ok && exports)
+        {
+            const CompileCache::Sym e = { sp.internval(names.vals[name].u), type };
+            ok = e.name && exports->push_back(gc, e);
+        }
+    }
+    return ok;
+}
+
+bool CompileCache::load(const Key& k, MLIR& ml, StringPool& sp, PodArray<Sym> *exports) const
+{
+    char fn[1024];
+    BufStream sm;
+    if(!_path(fn, sizeof(fn), k, ".gac") || sm_openFile(&sm, fn))
+        return false;
+
+    ValStore names(ml.gc);
+    const tsize nexp0 = exports ? exports->size() : 0;
+    bool ok = readnames(&sm, names, sp);
+
+    // Stale if any external looks different now
+    unsigned n = 0;
+    ok = ok && !sm_readvu(&sm, &n);
+    for(unsigned i = 0; ok && i < n; ++i)
+    {
+        unsigned name, sig;
+        ok = readname(&sm, names, &name) && !sm_readvu(&sm, &sig);
+        if(ok)
+        {
+            StrTmp tmp;
+            const Strp s = sp.lookupval(names.vals[name].u, tmp);
+            ok = _extsig(s.s, s.len) == sig;
+        }
+    }
+
+    ok = ok && readexports(&sm, names, sp, ml.gc, exports);
+    ok = ok && ml.load(&sm, sp) == MLIR::LOAD_OK;
+    sm.Close(&sm);
+    if(!ok)
+    {
+        ml.nodes.clear(); // A partial load may have left something behind
+        ml.infos.clear();
+        ml.vars.clear();
+        if(exports)
+            exports->sz = nexp0;
+    }
+    return ok;
+}
+
+bool CompileCache::exports(const Key& k, StringPool& sp, GC& gc, PodArray<Sym>& exports) const
+{
+    char fn[1024];
+    BufStream sm;
+    if(!_path(fn, sizeof(fn), k, ".gac") || sm_openFile(&sm, fn))
+        return false;
+
+    ValStore names(gc);
+    const tsize nexp0 = exports.size();
+    bool ok = readnames(&sm, names, sp);
+
+    // Skip the externals, whatever they look like
+    unsigned n = 0, name, sig;
+    ok = ok && !sm_readvu(&sm, &n);
+    for(unsigned i = 0; ok && i < n; ++i)
+        ok = readname(&sm, names, &name) && !sm_readvu(&sm, &sig);
+
+    ok = ok && readexports(&sm, names, sp, gc, &exports);
+    sm.Close(&sm);
+    if(!ok)
+        exports.sz = nexp0;
+    return ok;
+}
+
+bool CompileCache::store(const Key& k, const MLIR& ml, const Symstore& syms, const StringPool& sp) const
+{
+    // Write to a temp file first and then move it in place, so that nobody ever sees a partial entry.
+    // The temp name only needs to be unique among threads writing the same entry right now.
+    char fn[1024], tmpfn[1024], ext[32];
+    snprintf(ext, sizeof(ext), ".%p.tmp", (const void*)&ml);
+    if(!_path(fn, sizeof(fn), k, ".gac") || !_path(tmpfn, sizeof(tmpfn), k, ext))
+        return false;
+
+    ValStore names(sp.gc);
+    const size_t nmissing = syms.missing.size();
+    const size_t N = syms.numsyms();
+    size_t nexports = 0;
+    for(size_t i = 0; i < N; ++i)
+        nexports += !!(syms.getsym(unsigned(i))->referencedHow & SYMREF_EXPORTED);
+
+    BufSink sk;
+    if(sink_openFile(&sk, tmpfn, 0))
+        return false;
+
+    static const byte magic[] = MAGIC_FILE_VARIANT('C');
+    bool ok = !sk.Write(&sk, magic, sizeof(magic));
+
+    // All names must be known before the name table can be written, so collect them up front
+    for(size_t i = 0; i < nmissing; ++i)
+        names.put(Val(_Str(syms.getsym(syms.missing[i])->nameStrId)));
+    for(size_t i = 0; i < N; ++i)
+    {
+        const Symstore::Sym *s = syms.getsym(unsigned(i));
+        if(s->referencedHow & SYMREF_EXPORTED)
+            names.put(Val(_Str(s->nameStrId)));
+    }
+    ok = ok && names.serialize(&sk, sp);
+
+    ok = ok && writevu(&sk, unsigned(nmissing));
+    for(size_t i = 0; ok && i < nmissing; ++i)
+    {
+        const sref name = syms.getsym(syms.missing[i])->nameStrId;
+        const Strp s = sp.lookup(name);
+        ok = writevu(&sk, names.put(Val(_Str(name)))) && writevu(&sk, _extsig(s.s, s.len));
+    }
+
+    ok = ok && writevu(&sk, unsigned(nexports));
+    for(size_t i = 0; ok && i < N; ++i)
+    {
+        const Symstore::Sym *s = syms.getsym(unsigned(i));
+        if(s->referencedHow & SYMREF_EXPORTED)
+            ok = writevu(&sk, names.put(Val(_Str(s->nameStrId)))) && writevu(&sk, s->valtype());
+    }
+
+    ok = ok && ml.dump(&sk, sp, MLIR::Options(0));
+    ok = ok && !sk.Flush(&sk);
+    sk.Close(&sk);
+    ok = ok && !sk.err;
+
+    if(ok)
+    {
+#ifdef _WIN32
+        remove(fn); // rename() doesn't replace existing files there
+#endif
+        ok = !rename(tmpfn, fn);
+    }
+    if(!ok)
+        remove(tmpfn);
+    return ok;
+}
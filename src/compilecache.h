@@ -0,0 +1,61 @@
+#pragma once
+
+#include "array.h"
+
+class MLIR;
+class StringPool;
+class Symstore;
+
+// Content-addressed cache of compiled modules on disk, so that unchanged files don't need to be parsed again.
+// Entries are keyed by a hash of the source bytes and the compiler version. Each entry also remembers
+// the module's externals (Symstore::missing) and exports (symbols flagged SYMREF_EXPORTED).
+// An entry is stale when any of its externals now has a different signature than when the module was compiled,
+// ie. when whatever provides that symbol has changed in a way that matters.
+// load() and store() can be called from multiple threads, as long as the ExtSigFunc is thread-safe.
+class CompileCache
+{
+public:
+    // Signature of an external symbol as the compiler would see it right now,
+    // eg. a hash of its type as exported by another module. 0 if nothing is known about it.
+    typedef uhash (*ExtSigFunc)(void *ud, const char *name, size_t len);
+
+    struct Key
+    {
+        uhash h[2];
+    };
+
+    struct Sym
+    {
+        sref name; // In the StringPool the module was loaded into
+        Type type;
+    };
+
+    // dir must exist and stay valid
+    CompileCache(const char *dir);
+
+    void setExtSig(ExtSigFunc f, void *ud);
+
+    static Key key(const void *src, size_t len);
+
+    // Replaces the contents of ml with the cached module, and puts its strings into sp.
+    // If exports is not NULL, the module's exports are appended. Temporary memory comes from ml.gc.
+    // Returns false if there is no usable entry; ml is empty then.
+    bool load(const Key& k, MLIR& ml, StringPool& sp, PodArray<Sym> *exports) const;
+
+    // Appends the exports of a cached module without loading it or checking its externals,
+    // for finding out what the externals of other modules look like before loading those.
+    // Returns false if there is no usable entry; exports is unchanged then.
+    bool exports(const Key& k, StringPool& sp, GC& gc, PodArray<Sym>& exports) const;
+
+    // Stores a freshly compiled module, replacing any existing entry. syms is what the parser left behind.
+    // Returns false if the entry couldn't be written. Not having a cache entry is never an error.
+    bool store(const Key& k, const MLIR& ml, const Symstore& syms, const StringPool& sp) const;
+
+private:
+    uhash _extsig(const char *name, size_t len) const;
+    bool _path(char *buf, size_t bufsize, const Key& k, const char *ext) const;
+
+    const char *_dir;
+    ExtSigFunc _extsigf;
+    void *_extsigud;
+};
@@ -0,0 +1,440 @@
+#include "compiledriver.h"
+#include "runtime.h"
+#include "lex.h"
+#include "parser.h"
+#include "hlir.h"
+#include "mlir.h"
+#include "serialio.h"
+#include "io_libc.h"
+#include "compilecache.h"
+#include "hashfunc.h"
+#include <string.h>
+
+#ifdef _WIN32
+#  define WIN32_LEAN_AND_MEAN
+#  define NOMINMAX
+#  include <Windows.h>
+#else
+#  include <pthread.h>
+#  include <unistd.h>
+#endif
+
+// Minimal threads; this is the only place that needs them.
+namespace {
+
+typedef void (*ThreadFunc)(void *ud);
+
+struct Thread
+{
+    ThreadFunc f;
+    void *ud;
+#ifdef _WIN32
+    HANDLE h;
+#else
+    pthread_t h;
+#endif
+};
+
+#ifdef _WIN32
+static DWORD WINAPI threadEntry(LPVOID p)
+{
+    Thread *th = (Thread*)p;
+    th->f(th->ud);
+    return 0;
+}
+static bool threadStart(Thread *th)
+{
+    th->h = CreateThread(NULL, 0, threadEntry, th, 0, NULL);
+    return !!th->h;
+}
+static void threadJoin(Thread *th)
+{
+    WaitForSingleObject(th->h, INFINITE);
+    CloseHandle(th->h);
+}
+static unsigned numCPUs()
+{
+    SYSTEM_INFO si;
+    GetSystemInfo(&si);
+    return si.dwNumberOfProcessors;
+}
+#else
+static void *threadEntry(void *p)
+{
+    Thread *th = (Thread*)p;
+    th->f(th->ud);
+    return NULL;
+}
+static bool threadStart(Thread *th)
+{
+    return !pthread_create(&th->h, NULL, threadEntry, th);
+}
+static void threadJoin(Thread *th)
+{
+    pthread_join(th->h, NULL);
+}
+static unsigned numCPUs()
+{
+    const long n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? unsigned(n) : 1;
+}
+#endif
+
+} // end anon namespace
+
+
+// Everything one file needs while it's compiled. Nothing in here is touched by more than one thread.
+// Uses the runtime's allocator and hash seed, so that importing the strings later is cheap.
+// If the runtime's pool has a shared pool, new strings go there instead, and importing them is free.
+static void initgc(GC& gc, const GC& parent)
+{
+    gc.alloc = parent.alloc;
+    gc.gcud = parent.gcud;
+    gc.hashseed = parent.hashseed;
+}
+
+struct CompileDriver::Work
+{
+    Work(const Runtime& rt)
+        : gc(), sp(gc), ml(gc), key(), hasEntry(false)
+    {
+        initgc(gc, rt.gc);
+        gc.strings = &sp;
+        sp.attachBase(rt.sp.base()); // Strings from there need no importing either
+        if(SharedStringPool *shared = rt.sp.shared())
+            sp.attachShared(shared, true);
+    }
+    ~Work()
+    {
+        src.dealloc(gc);
+        exports.dealloc(gc);
+        syms.dealloc(gc);
+        sp.dealloc();
+    }
+
+    GC gc;
+    StringPool sp;
+    MLIR ml; // Result
+
+    // Only with a cache, between the two passes
+    PodArray<char> src;
+    CompileCache::Key key;
+    PodArray<CompileCache::Sym> exports;
+    Symstore syms;  // Of a file that was compiled and still needs to be stored
+    bool hasEntry;  // Exports came from the cache; the module is loaded in the second pass
+};
+
+CompileDriver::CompileDriver(Runtime& rt)
+    : _next(0), _pass(0), _cache(NULL), rt(rt)
+{
+    _lock.v = 0;
+}
+
+CompileDriver::~CompileDriver()
+{
+    for(size_t i = 0; i < _units.size(); ++i)
+    {
+        Unit& u = _units[i];
+        assert(!u.w);
+        if(u.ml)
+        {
+            u.ml->~MLIR();
+            gc_free_unmanaged_T(rt.gc, u.ml);
+        }
+    }
+    _units.dealloc(rt.gc);
+    _sigs.dealloc(rt.gc);
+    _sigindex.dealloc(rt.gc);
+    _signames.dealloc(rt.gc);
+}
+
+bool CompileDriver::add(const char* fn)
+{
+    Unit u = { fn, NULL, NULL, false };
+    return !!_units.push_back(rt.gc, u);
+}
+
+size_t CompileDriver::run(unsigned nthreads)
+{
+    // Allocate everything up front, so that workers don't need to touch shared state except the job counter
+    const size_t first = _next;
+    const size_t N = _units.size();
+    for(size_t i = first; i < N; ++i)
+    {
+        Unit& u = _units[i];
+        if(void *mem = gc_new_unmanaged_T<Work>(rt.gc))
+            u.w = GA_PLACEMENT_NEW(mem) Work(rt);
+    }
+
+    _pass = 0;
+    _runWorkers(nthreads, first);
+
+    // Now that all exports are known, entries can be checked, and what was compiled can be stored
+    if(_cache)
+    {
+        bool ok = true;
+        for(size_t i = first; i < N; ++i)
+            if(const Work *w = _units[i].w)
+                ok = _addExports(*w) && ok;
+        ok = _indexExports() && ok;
+        _cache->setExtSig(_extsig, this);
+        _pass = ok ? 1 : 2; // Without all signatures, entries can't be trusted; compile everything then
+        _runWorkers(nthreads, first);
+        _cache->setExtSig(NULL, NULL);
+    }
+
+    size_t fail = 0;
+    for(size_t i = first; i < N; ++i)
+    {
+        Unit& u = _units[i];
+        _merge(u);
+        fail += !u.ml;
+    }
+    return fail;
+}
+
+void CompileDriver::_runWorkers(unsigned nthreads, size_t first)
+{
+    const size_t N = _units.size();
+    _next = first;
+    if(!nthreads)
+        nthreads = numCPUs();
+    size_t nextra = N - first;
+    if(nextra > nthreads)
+        nextra = nthreads;
+    if(nextra)
+        --nextra; // This thread works too
+
+    PodArray<Thread> th;
+    if(nextra && !th.resize(rt.gc, nextra))
+        nextra = 0;
+    size_t started = 0;
+    for( ; started < nextra; ++started)
+    {
+        th[started].f = _worker;
+        th[started].ud = this;
+        if(!threadStart(&th[started]))
+            break; // Make do with fewer threads
+    }
+
+    _worker(this);
+
+    for(size_t i = 0; i < started; ++i)
+        threadJoin(&th[i]);
+    th.dealloc(rt.gc);
+}
+
+void CompileDriver::_worker(void *self)
+{
+    CompileDriver *cd = (CompileDriver*)self;
+
+    // Parse trees of all files this thread compiles recycle the same memory
+    GC gc = GC();
+    initgc(gc, cd->rt.gc);
+    BlockListAllocator::Pool pool(gc);
+
+    for(;;)
+    {
+        cd->_lock.lock();
+        const size_t i = cd->_next;
+        const bool more = i < cd->_units.size();
+        cd->_next += more;
+        cd->_lock.unlock();
+        if(!more)
+            break;
+        if(!cd->_pass)
+            cd->_compile(cd->_units[i], pool);
+        else
+            cd->_finish(cd->_units[i], pool);
+    }
+}
+
+// With keepsyms, the parser's symbols are kept in w.syms for storing the module later, and its exports are collected
+static void compile(CompileDriver::Work& w, BufStream *sm, const char *fn, BlockListAllocator::Pool& pool, bool keepsyms)
+{
+    Lexer lex(sm, w.gc);
+    Parser pp(&lex, fn, w.gc, w.sp);
+    HLIRBuilder hb(w.gc, &pool);
+    pp.hlir = &hb;
+    if(const HLNode *root = pp.parse())
+    {
+        w.ml.construct(root, w.sp, MLIR::Options(0));
+        if(keepsyms)
+        {
+            w.syms = pp.syms;
+            const size_t N = pp.syms.numsyms();
+            for(size_t i = 0; i < N; ++i)
+            {
+                const Symstore::Sym *s = pp.syms.getsym(unsigned(i));
+                const CompileCache::Sym e = { s->nameStrId, s->valtype() };
+                if((s->referencedHow & SYMREF_EXPORTED) && !w.exports.push_back(w.gc, e))
+                {
+                    w.ml.nodes.clear(); // Without all exports, other files can't be checked against this one
+                    break;
+                }
+            }
+        }
+    }
+    pp.syms.dealloc(w.gc);
+}
+
+static void compileMem(CompileDriver::Work& w, const char *fn, BlockListAllocator::Pool& pool, bool keepsyms)
+{
+    BufStream sm;
+    sm_initMem(&sm, w.src.data(), w.src.size());
+    compile(w, &sm, fn, pool, keepsyms);
+    sm.Close(&sm);
+}
+
+// The cache key needs all of the source, so read the rest of the stream into memory
+static bool readall(GC& gc, BufStream *sm, PodArray<char>& buf)
+{
+    for(;;)
+    {
+        if(const size_t n = sm->end - sm->cursor)
+        {
+            char *dst = buf.alloc_n(gc, tsize(n));
+            if(!dst)
+                return false;
+            memcpy(dst, sm->cursor, n);
+            sm->cursor = sm->end;
+        }
+        if(sm_refill(sm))
+            return sm->err == SM_EOF;
+    }
+}
+
+void CompileDriver::_compile(Unit& u, BlockListAllocator::Pool& pool)
+{
+    Work *w = u.w;
+    if(!w || !w->sp.init())
+        return;
+
+    BufStream sm;
+    if(sm_openFile(&sm, u.fn))
+        return; // Empty MLIR means failed
+
+    if(!_cache)
+        compile(*w, &sm, u.fn, pool, false);
+    else if(readall(w->gc, &sm, w->src))
+    {
+        // Cached modules are only loaded in the second pass, but their exports are needed now
+        w->key = CompileCache::key(w->src.data(), w->src.size());
+        w->hasEntry = _cache->exports(w->key, w->sp, w->gc, w->exports);
+        if(!w->hasEntry)
+            compileMem(*w, u.fn, pool, true);
+    }
+
+    sm.Close(&sm);
+}
+
+// Second pass, only with a cache
+void CompileDriver::_finish(Unit& u, BlockListAllocator::Pool& pool)
+{
+    Work *w = u.w;
+    if(!w)
+        return;
+
+    const bool usecache = _pass == 1;
+    if(w->hasEntry)
+    {
+        u.cached = usecache && _cache->load(w->key, w->ml, w->sp, NULL);
+        if(u.cached)
+            return;
+        compileMem(*w, u.fn, pool, true); // Stale; whatever it exports now is the same as before
+    }
+
+    if(usecache && w->ml.nodes.size())
+        _cache->store(w->key, w->ml, w->syms, w->sp);
+}
+
+// Main thread only, between the passes
+bool CompileDriver::_addExports(const Work& w)
+{
+    for(tsize i = 0; i < w.exports.size(); ++i)
+    {
+        const CompileCache::Sym& e = w.exports[i];
+        const Strp s = w.sp.lookup(e.name);
+        char *name = _signames.alloc_n(rt.gc, tsize(s.len));
+        if(!name)
+            return false;
+        memcpy(name, s.s, s.len);
+
+        // Stable across runs, since it's stored with the entries of the files that use it. Never 0, that means unknown.
+        // Without a known type, anything in the exporting file may matter, so that file's key stands in.
+        const uhash h = e.type != PRIMTYPE_AUTO ? memhash(0, &e.type, sizeof(e.type)) : memhash(1, &w.key, sizeof(w.key));
+        const ExtSig sig = { memhash(0, s.s, s.len), h | 1, tsize(name - _signames.data()), tsize(s.len) };
+        if(!_sigs.push_back(rt.gc, sig))
+            return false;
+    }
+    return true;
+}
+
+bool CompileDriver::_indexExports()
+{
+    tsize cap = 8;
+    while(cap < 2 * _sigs.size())
+        cap *= 2;
+    tsize *idx = _sigindex.resize(rt.gc, cap);
+    if(!idx)
+        return false;
+    memset(idx, 0, cap * sizeof(*idx));
+
+    const tsize mask = cap - 1;
+    for(tsize i = 0; i < _sigs.size(); ++i)
+    {
+        tsize k = _sigs[i].namehash & mask;
+        while(idx[k])
+            k = (k + 1) & mask;
+        idx[k] = i + 1;
+    }
+    return true;
+}
+
+// CompileCache::ExtSigFunc. Called by workers in the second pass; everything it touches is read-only then.
+uhash CompileDriver::_extsig(void *self, const char *name, size_t len)
+{
+    const CompileDriver *cd = (const CompileDriver*)self;
+    const tsize cap = cd->_sigindex.size();
+    if(!cap || cd->_sigs.empty())
+        return 0;
+
+    // When several files export the same name, it looks different when any of them changes
+    const uhash h = memhash(0, name, len);
+    const tsize mask = cap - 1;
+    uhash sig = 0;
+    for(tsize k = h & mask; const tsize i = cd->_sigindex[k]; k = (k + 1) & mask)
+    {
+        const ExtSig& e = cd->_sigs[i - 1];
+        if(e.namehash == h && e.len == len && !memcmp(cd->_signames.data() + e.name, name, len))
+            sig = rotl(sig, 5) ^ e.sig;
+    }
+    return sig;
+}
+
+// Called on the main thread only, after all workers are done
+void CompileDriver::_merge(Unit& u)
+{
+    Work *w = u.w;
+    if(!w)
+        return;
+    u.w = NULL;
+
+    if(w->ml.nodes.size())
+    {
+        if(void *mem = gc_new_unmanaged_T<MLIR>(rt.gc))
+        {
+            MLIR *ml = GA_PLACEMENT_NEW(mem) MLIR(rt.gc);
+            if(ml->importFrom(w->ml, w->sp, rt.sp))
+                u.ml = ml;
+            else
+            {
+                ml->~MLIR();
+                gc_free_unmanaged_T(rt.gc, ml);
+            }
+        }
+    }
+
+    w->~Work();
+    gc_free_unmanaged_T(rt.gc, w);
+}
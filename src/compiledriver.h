@@ -0,0 +1,79 @@
+#pragma once
+
+#include "array.h"
+#include "util.h"
+#include "gaalloc.h"
+
+struct Runtime;
+class MLIR;
+class CompileCache;
+
+// Compiles many source files to MLIR at once, on multiple threads.
+// Each file is compiled from start to end by one worker, with its own GC, StringPool and HLIRBuilder,
+// so workers share nothing while compiling. Afterwards, the calling thread merges the results
+// into the runtime: each MLIR is copied over and its strings are imported into the runtime's pool.
+// If the runtime's pool has a SharedStringPool attached, that is the one thing workers share:
+// their new strings go there, and merging doesn't need to copy them.
+// The runtime's allocator must be thread-safe.
+class CompileDriver
+{
+public:
+    CompileDriver(Runtime& rt);
+    ~CompileDriver();
+
+    // fn must stay valid until run() is done
+    bool add(const char *fn);
+
+    // Optional. Files that have a valid cache entry are loaded from there instead of being compiled,
+    // and everything that does get compiled is stored. An entry is only valid while the symbols it uses
+    // from other files are exported the same way as when it was stored, so run() makes the cache check
+    // externals against the exports of all files the driver has seen (see CompileCache::setExtSig()).
+    FORCEINLINE void setCache(CompileCache *cache) { _cache = cache; }
+
+    // Compiles and merges everything that was added so far. nthreads == 0 uses one thread per CPU.
+    // Returns the number of files that failed to compile.
+    size_t run(unsigned nthreads);
+
+    FORCEINLINE size_t size() const { return _units.size(); }
+    FORCEINLINE const char *filename(size_t i) const { return _units[i].fn; }
+    FORCEINLINE MLIR *module(size_t i) const { return _units[i].ml; } // NULL if compiling failed. Owned by the driver.
+    FORCEINLINE bool cached(size_t i) const { return _units[i].cached; } // Loaded from the cache instead of compiled
+
+    struct Work;
+
+private:
+    struct Unit
+    {
+        const char *fn;
+        Work *w;  // Only during run()
+        MLIR *ml; // Final result, in the runtime
+        bool cached;
+    };
+
+    // What an exported symbol looks like to other files
+    struct ExtSig
+    {
+        uhash namehash;
+        uhash sig;
+        tsize name, len; // Name is in _signames
+    };
+
+    static void _worker(void *self);
+    void _runWorkers(unsigned nthreads, size_t first);
+    void _compile(Unit& u, BlockListAllocator::Pool& pool);
+    void _finish(Unit& u, BlockListAllocator::Pool& pool);
+    void _merge(Unit& u);
+    bool _addExports(const Work& w);
+    bool _indexExports();
+    static uhash _extsig(void *self, const char *name, size_t len);
+
+    PodArray<Unit> _units;
+    size_t _next; // Next unit to compile
+    unsigned _pass; // 0: compile, or with a cache: collect exports. 1: load from or store to the cache. 2: compile the rest
+    CompileCache *_cache;
+    PodArray<ExtSig> _sigs;    // Exports of all files so far
+    PodArray<tsize> _sigindex; // Hash index into _sigs, 0 is empty, otherwise index + 1. Size is a power of 2.
+    PodArray<char> _signames;
+    SpinLock _lock;
+    Runtime& rt;
+};
@@ -19,8 +19,8 @@
 
 
 // The hashes in these are unused dummy values
-static const Dedup::HBlock NullBlock = { {NULL, 0}, 0, {0}, Dedup::LONG_BIT };
-static const Dedup::HBlock EmptyBlock = { {(const char*)&NullBlock, 0}, 0, {0}, Dedup::LONG_BIT };
+static const Dedup::HBlock NullBlock = { {NULL, 0}, 0, {0}, 0, Dedup::LONG_BIT };
+static const Dedup::HBlock EmptyBlock = { {(const char*)&NullBlock, 0}, 0, {0}, 0, Dedup::LONG_BIT };
 
 enum { INITIAL_ELEMS = 32 };
 
@@ -32,9 +32,10 @@ static uhash keyhash(uhash h, const void *buf, size_t size)
 
 
 
-Dedup::Dedup(GC & gc, bool extrabyte, tsize skipAtStart)
-    : keys(NULL), mask(-1), _extrabyte(extrabyte), _skipAtStart(skipAtStart), _hashseed(0), _nextfree(0)
-    , _sweeppos(2), _inuse(0), gc(gc)
+Dedup::Dedup(GC & gc, bool extrabyte, tsize skipAtStart, bool inlineShort)
+    : keys(NULL), mask(-1), _extrabyte(extrabyte), _skipAtStart(skipAtStart), _maxShortLen(inlineShort ? MAX_SHORT_LEN : 0)
+    , _hashseed(0), _nextfree(0)
+    , _sweeppos(2), _inuse(0), _stale(0), gc(gc)
 {
 }
 
@@ -50,11 +51,7 @@ bool Dedup::init()
      && arr.push_back(gc, NullBlock)
      && arr.push_back(gc, EmptyBlock))
     {
-#ifdef _DEBUG
-        _hashseed = 0; // For reproducibility across debug runs
-#else
-        _hashseed = uhash((uintptr_t(arr.data()) >> 3u) ^ (uintptr_t(this) << 4u));
-#endif
+        _hashseed = gc.hashseed;
         return true;
     }
 
@@ -69,19 +66,41 @@ void Dedup::dealloc()
 
 
 
+uhash Dedup::hash(const void* mem, size_t bytes) const
+{
+    assert(_skipAtStart <= bytes);
+    return keyhash(_hashseed, (const char*)mem + _skipAtStart, bytes - _skipAtStart);
+}
+
+void Dedup::hashbegin(MemHashState& st) const
+{
+    assert(!_skipAtStart);
+    memhash_begin(st, _hashseed);
+}
+
+uhash Dedup::hashend(MemHashState& st, const void *tail, size_t n, size_t bytes) const
+{
+    return memhash_end(st, tail, n, bytes) ^ rotr(uhash(bytes), 12); // Same as keyhash()
+}
+
 sref Dedup::putCopy(const void* mem, size_t bytes)
+{
+    return bytes ? putCopy(mem, bytes, hash(mem, bytes)) : !!mem;
+}
+
+sref Dedup::putCopy(const void* mem, size_t bytes, uhash h)
 {
     assert(arr.size() >= 2 && "Dedup: If this fails, you forgot to call init()");
 
     if(!bytes)
         return !!mem; // 0: NULL, 1: empty
 
-    HKey * const k = _prepkey(mem, bytes);
+    HKey * const k = _prepkey(mem, bytes, h);
     if(!k)
         return -1;
 
     if(k->ref >= 2)
-        return k->ref;
+        return _found(k->ref);
 
     HBlock * const hb = _prepblock();
     if(!hb)
@@ -107,14 +126,14 @@ sref Dedup::putTakeOver(void* mem, size_t bytes, size_t actualsize)
         return !!mem; // 0: NULL, 1: empty
     }
 
-    HKey * const k = _prepkey(mem, bytes);
+    HKey * const k = _prepkey(mem, bytes, hash(mem, bytes));
     if(!k)
         return -1;
 
     if(k->ref >= 2)
     {
         _afree(mem, actualsize);
-        return k->ref;
+        return _found(k->ref);
     }
 
     HBlock * const hb = _prepblock();
@@ -125,6 +144,76 @@ sref Dedup::putTakeOver(void* mem, size_t bytes, size_t actualsize)
     return _finishset(*hb, *k);
 }
 
+sref Dedup::importFrom(const Dedup& other, sref ref)
+{
+    if(ref < 2 || &other == this)
+        return ref;
+
+    const HBlock& b = other.arr[ref];
+    const MemBlock mb = other.get(ref);
+    const uhash h = (b.x & LONG_BIT) && _samehash(other)
+        ? b.h // Long blocks store the hash, no need to look at the memory before it's copied
+        : hash(mb.p, mb.n);
+    return putCopy(mb.p, mb.n, h);
+}
+
+bool Dedup::importMany(const Dedup& other, const sref* src, sref* dst, size_t n)
+{
+    if(&other == this)
+    {
+        memmove(dst, src, n * sizeof(*src));
+        return true;
+    }
+
+    // Make sure nothing is resized midway so that the prefetching below makes sense
+    if(!_reserve((tsize)n))
+        return false;
+
+    // Fetch source blocks well ahead, then the memory they point to and where their key goes in this Dedup
+    enum { PF = 8 };
+    const bool samehash = _samehash(other);
+    const HBlock * const ob = other.arr.data();
+    bool ok = true;
+    for(size_t i = 0; i < n; ++i)
+    {
+        if(i + PF < n)
+            PREFETCH(&ob[src[i + PF]]);
+        if(i + PF/2 < n)
+        {
+            const HBlock& b = ob[src[i + PF/2]];
+            if(b.x & LONG_BIT)
+            {
+                PREFETCH(b.mb.p);
+                if(samehash)
+                    PREFETCH(&keys[b.h & mask]);
+            }
+        }
+
+        sref ref = importFrom(other, src[i]);
+        if(ref == sref(-1))
+        {
+            ref = 0;
+            ok = false;
+        }
+        dst[i] = ref;
+    }
+    return ok;
+}
+
+bool Dedup::_reserve(tsize extra)
+{
+    const tsize N = arr.size() + extra;
+    if(!arr.reserve(gc, N))
+        return false;
+
+    // Same growth rule as in _prepkey()
+    const tsize oldsize = keys ? mask + 1 : 0;
+    tsize newsize = keys ? oldsize : INITIAL_ELEMS;
+    while(N + (N / 4u) >= newsize - 1)
+        newsize *= 2;
+    return newsize == oldsize || _kresize(newsize);
+}
+
 tsize Dedup::_indexof(const HBlock& hb) const
 {
     const size_t offs = &hb - arr.data();
@@ -155,6 +244,11 @@ MemBlock Dedup::get(sref ref) const
 }
 
 sref Dedup::find(const void* mem, size_t bytes) const
+{
+    return bytes > _skipAtStart ? find(mem, bytes, hash(mem, bytes)) : !!mem;
+}
+
+sref Dedup::find(const void* mem, size_t bytes, uhash h) const
 {
     assert(_skipAtStart <= bytes);
     mem = (const char*)mem + _skipAtStart;
@@ -166,8 +260,6 @@ sref Dedup::find(const void* mem, size_t bytes) const
     if(!keys)
         return 0;
 
-    const uhash h = keyhash(_hashseed, mem, bytes);
-
     HKey * const k = keys;
     usize i = h;
     for(;;)
@@ -180,16 +272,17 @@ sref Dedup::find(const void* mem, size_t bytes) const
             const sref ref = k[i].ref;
             const HBlock& b = arr[ref];
             const unsigned char x = b.x;
+            const tsize skip = _skipAtStart;
             if(x & LONG_BIT)
             {
-                assert(b.h == h);
-                if(b.mb.n == bytes && !memcmp(mem, b.mb.p, bytes))
+                // The key may be stale and point to a block that was swept and then reused for something else
+                if(b.h == h && b.mb.n == bytes + skip && !memcmp(mem, b.mb.p + skip, bytes))
                     return ref;
             }
             else // the size check naturally fails when x==0 (ie. unused block) since we never end up here with bytes==0
             {
                 tsize n = x & SHRT_SIZE_MASK;
-                if(n == bytes && !memcmp(mem, &b, n))
+                if(n == bytes + skip && !memcmp(mem, (const char*)&b + skip, bytes))
                     return ref;
             }
         }
@@ -197,7 +290,7 @@ sref Dedup::find(const void* mem, size_t bytes) const
     }
 }
 
-Dedup::HKey *Dedup::_prepkey(const void* mem, size_t bytes)
+Dedup::HKey *Dedup::_prepkey(const void* mem, size_t bytes, uhash h)
 {
     const tsize skip = _skipAtStart;
     assert(skip < bytes);
@@ -207,11 +300,10 @@ Dedup::HKey *Dedup::_prepkey(const void* mem, size_t bytes)
     HKey *k = keys;
     if(!k)
         k = _kresize(INITIAL_ELEMS);
-    else if(arr.size() + (arr.size() / 4u) >= mask)
+    else if(arr.size() + _stale + (arr.size() / 4u) >= mask) // Stale keys take up space too
         k = _kresize((mask + 1) * 2);
     if(!k)
         return NULL;
-    const uhash h = keyhash(_hashseed, mem, bytes);
 
     usize i = h;
     for(;;)
@@ -227,7 +319,8 @@ Dedup::HKey *Dedup::_prepkey(const void* mem, size_t bytes)
             tsize n;
             if(x & LONG_BIT)
             {
-                assert(b.h == h);
+                if(b.h != h) // Stale key, see find()
+                    goto next;
                 n = b.mb.n;
                 m = b.mb.p;
             }
@@ -240,6 +333,7 @@ Dedup::HKey *Dedup::_prepkey(const void* mem, size_t bytes)
             if(n == bytes + skip && !memcmp(mem, m + skip, n - skip))
                 goto done;
         }
+next:
         ++i;
     }
 
@@ -271,6 +365,8 @@ void Dedup::_regenkeys(HKey *ks, tsize newmask)
     for(tsize j = 2; j < N; ++j) // skip sentinel values
     {
         unsigned char x = arr[j].x;
+        if(!x) // Unused block, needs no key
+            continue;
         const uhash h = x & LONG_BIT
             ? arr[j].h // Long blocks store the hash because recopmuting it may take a while
             : keyhash(seed, &arr[j], x & SHRT_SIZE_MASK); // Hashes of short blocks must be recomputed
@@ -289,27 +385,25 @@ void Dedup::_regenkeys(HKey *ks, tsize newmask)
     }
 }
 
-void Dedup::_compact()
+// Drop unused blocks at the end and rebuild the freelist from what's left.
+// Used blocks can't be moved since that would change their refs.
+void Dedup::_trimtail()
 {
-    HBlock *w = arr.data() + 2; // skip sentinel values
-    const HBlock *rd = w;
-    const HBlock * const end = rd + arr.size() - 2;
-
-    for( ; rd < end; ++rd)
-    {
-        if(!rd->x)
-            continue;
-
-        *w = *rd;
-        ++w;
-    }
-    const tsize inuse = w - arr.data();
-    assert(inuse >= 2);
-    if(inuse < arr.size())
-        (void)arr.resize(gc, inuse); // this can fail but without consequences
-
-    // Invariant: The freelist is gone after compacting, since no unused blocks are left
-    _nextfree = 0;
+    tsize n = arr.size();
+    while(n > 2 && !arr[n - 1].x)
+        --n;
+    if(n < arr.size())
+        (void)arr.resize(gc, n); // this can fail but without consequences
+
+    // Walk backwards so that the lowest free index ends up at the head of the freelist
+    tsize nu = 0;
+    for(tsize i = n; i-- > 2; )
+        if(!arr[i].x)
+        {
+            arr[i].mb.n = nu;
+            nu = i;
+        }
+    _nextfree = nu;
 }
 
 // fallback for allocated blocks but that ended up not being used
@@ -337,16 +431,12 @@ Dedup::HKey* Dedup::_kresize(tsize newsize)
         gc_alloc_unmanaged_T(gc, keys, oldsize, 0);
 
         if(newsize)
-        {
-            // These don't use this->keys or this->mask
-            if(newsize < oldsize) // When shrinking, compact valid entries
-                _compact();
-            _regenkeys(newks, newmask); // Always regenerate keys
-        }
+            _regenkeys(newks, newmask); // Always regenerate keys. This doesn't use this->keys or this->mask
     }
 
     keys = newks;
     mask = newmask;
+    _stale = 0; // regenerated keys only point to used blocks
 
     return newks;
 }
@@ -355,7 +445,7 @@ bool Dedup::_acopy(HBlock& hb, const void* mem, size_t bytes)
 {
     size_t total = bytes + _extrabyte;
     char *p;
-    if(total <= MAX_SHORT_LEN)
+    if(total <= _maxShortLen)
     {
         p = (char*)&hb;
         hb.x = (unsigned char)bytes | MARK_BIT;
@@ -379,12 +469,12 @@ void Dedup::_atakeover(HBlock& hb, void* mem, size_t bytes, size_t actualsize)
 {
     size_t total = bytes + _extrabyte;
     assert(total <= actualsize);
-    if(total <= MAX_SHORT_LEN)
+    if(total <= _maxShortLen)
     {
         hb.x = (unsigned char)bytes | MARK_BIT;
         char *p = (char*)&hb;
-        assert(!_extrabyte || p[total - 1]); // strings should be 0-terminated when taking over
-        memcpy(p, mem, bytes);
+        assert(!_extrabyte || !((char*)mem)[bytes]); // strings should be 0-terminated when taking over
+        memcpy(p, mem, total);
         _afree(mem, actualsize); // Don't need the allocation anymore if it fit into a short block
     }
     else
@@ -403,10 +493,22 @@ void Dedup::_afree(void* mem, size_t bytes)
     gc_alloc_unmanaged(gc, mem, bytes, 0);
 }
 
-void Dedup::mark(sref ref)
+// Whoever got ref may store it somewhere the GC has already looked at, so it must survive a sweep
+// that may be running, like a new block
+sref Dedup::_found(sref ref)
 {
-    assert(arr[ref].x); // block was already sweeped
     arr[ref].x |= MARK_BIT;
+    return ref;
+}
+
+bool Dedup::mark(sref ref)
+{
+    if(ref < 2)
+        return false; // Sentinels are always there
+    const unsigned char x = arr[ref].x;
+    assert(x); // block was already sweeped
+    arr[ref].x = x | MARK_BIT;
+    return !(x & MARK_BIT);
 }
 
 tsize Dedup::sweepstep(tsize step)
@@ -416,11 +518,16 @@ tsize Dedup::sweepstep(tsize step)
     HBlock * const bs = arr.data();
     tsize i = _sweeppos;
     tsize c = 0;
+    tsize freed = 0;
     tsize nu = _nextfree;
-    for( ; i < N; ++i) // _sweeppos is always >= 2 -> skip sentinel values
+    size_t budget = step ? step : size_t(-1); // Looking at a block costs one step, freeing external memory another one
+    for( ; i < N && budget; ++i) // _sweeppos is always >= 2 -> skip sentinel values
     {
+        --budget;
         HBlock& b = bs[i];
         const unsigned x = b.x;
+        if(!x) // Already unused and in the freelist
+            continue;
         if(x & MARK_BIT) // Block is in use?
         {
             b.x = x & ~MARK_BIT; // Won't collect it this time.
@@ -430,41 +537,55 @@ tsize Dedup::sweepstep(tsize step)
         {
             // Block is unused; mark it as such and free external mem if present.
             // Note that this keeps a HKey pointing at this block and we have no cheap way of getting rid of it.
-            // The idea is that we're in the middle of a collection that will eventually finish.
             // In case new blocks are requested before the collection finishes, this block may be re-used,
             // and it gets another, fresh HKey pointing at it.
             // Meanwhile, following a stale HKey to this block must correctly detect this as
-            // "this is not the block you're looking for" and continue searching -- see _prepkey().
-            // Once the collection finishes and the compaction step takes place, residual HKey entries are removed.
+            // "this is not the block you're looking for" and continue searching -- see find() and _prepkey().
+            // Stale keys are counted and removed in sweepfinish() once there are too many.
             const MemBlock mb = b.mb; // make a copy before overwriting it
             b.x = 0; // mark as unused
             b.mb.p = NULL; // prevent dangling pointer just in case
             b.mb.n = nu; // chain block into freelist
             nu = i;
+            ++freed;
             if(x & LONG_BIT)
             {
                 _afree((void*)mb.p, mb.n + b.extraBytesToFree);
-                if(!--step) // one free costs one step; steps=0 underflows and causes a full sweep
-                    break;
+                if(budget)
+                    --budget;
             }
         }
     }
     _sweeppos = i;
     _inuse += c;
+    _stale += freed;
     _nextfree = nu;
-    return step; // steps > 0? full cycle finished
+    if(i < N)
+        return 0;
+    return step && budget ? tsize(budget) : 1;
 }
 
 void Dedup::sweepfinish(bool compact)
 {
-    if(compact)
+    // Rebuilding the keys is O(n), so only do it when enough stale keys have piled up.
+    // If compacting is allowed, also do it when much of the block array is unused,
+    // to give back memory at the end of the array and shrink the keys.
+    const tsize N = arr.size() - 2;
+    const tsize unused = N > _inuse ? N - _inuse : 0;
+    const bool fragmented = compact && unused > N / 2u;
+    if(keys && (fragmented || _stale > (mask + 1) / 8u))
     {
-        const size_t sz = size_t(mask + 1); // possibly overflow, then cast
-        size_t target = roundUpToPowerOfTwo(size_t(_inuse) * 2);
+        if(fragmented)
+            _trimtail();
+
+        // Keep the same rule as _prepkey()
+        const tsize sz = arr.size();
+        size_t target = roundUpToPowerOfTwo(size_t(sz) + sz / 4u + 2);
         if(target < INITIAL_ELEMS)
             target = INITIAL_ELEMS;
-        if(target < sz)
-            _kresize(target);
+        if(!compact && target < size_t(mask) + 1)
+            target = size_t(mask) + 1;
+        _kresize(tsize(target));
     }
     _sweeppos = 2;
     _inuse = 0;
@@ -4,6 +4,7 @@
 #include "array.h"
 
 struct GC;
+struct MemHashState;
 
 enum
 {
@@ -17,7 +18,9 @@ enum
 class Dedup
 {
 public:
-    Dedup(GC& gc, bool extrabyte, tsize skipAtStart);
+    // If inlineShort is false, memory blocks are never stored inline, and the pointer returned by get()
+    // stays valid for as long as the block exists.
+    Dedup(GC& gc, bool extrabyte, tsize skipAtStart, bool inlineShort = true);
     ~Dedup();
     bool init();
     void dealloc();
@@ -30,12 +33,30 @@ public:
 
     MemBlock get(sref ref) const;
 
+    // To iterate over all blocks: Refs in [2, endref()) are valid if used(ref).
+    FORCEINLINE tsize endref() const { return arr.size(); }
+    FORCEINLINE bool used(sref ref) const { return !!arr[ref].x; }
+
     sref find(const void *mem, size_t bytes) const;
 
+    // Same hash as used internally. Pass it to the overloads below to avoid hashing twice.
+    uhash hash(const void *mem, size_t bytes) const;
+    // hash() in pieces, see memhash_begin(). Not for Dedups that skip bytes at the start.
+    void hashbegin(MemHashState& st) const;
+    uhash hashend(MemHashState& st, const void *tail, size_t n, size_t bytes) const;
+    sref putCopy(const void *mem, size_t bytes, uhash h);
+    sref find(const void *mem, size_t bytes, uhash h) const;
+
+    // Copy a block from another Dedup. Reuses the stored hash of long blocks if both hash the same way.
+    // Returns the ref in this Dedup, or (sref)-1 on OOM.
+    sref importFrom(const Dedup& other, sref ref);
+    // Same for many refs at once; dst[i] is the imported src[i]. Returns false if any import failed (dst[i] is 0 then).
+    bool importMany(const Dedup& other, const sref *src, sref *dst, size_t n);
+
     // for the GC
-    void mark(sref ref);
-    tsize sweepstep(tsize step); // if true, one sweep is completed. call sweepfinish() afterward. pass 0 for a complete collection, >0 for this many deletions
-    void sweepfinish(bool compact); // resets GC back to the start. Compacting uses some more time and is not necessary for a quick collection
+    bool mark(sref ref); // returns true if the block wasn't marked before
+    tsize sweepstep(tsize step); // returns 0 if not done, otherwise the unused steps (>= 1); call sweepfinish() afterward. Pass 0 to sweep everything at once.
+    void sweepfinish(bool compact); // resets GC back to the start. Compacting (only done when many blocks are unused) gives memory back but takes more time. Refs stay valid.
 
     struct HBlock
     {
@@ -43,7 +64,7 @@ public:
         uhash h;                         // |-- All of this (sizeof(HBlock)-1) is used to store a short block
         unsigned char pad[2];            // |
         unsigned char extraBytesToFree;  // v
-        unsigned char x;      // extra bits, 0 if ready to be kicked during _compact()
+        unsigned char x;      // extra bits, 0 if unused (block is in the freelist)
     };
 
     enum
@@ -62,28 +83,33 @@ private:
         tsize ref; // if 0, it's a free slot. Never 1. Indexes into arr[].
     };
 
-    HKey *_prepkey(const void *mem, size_t bytes);
+    HKey *_prepkey(const void *mem, size_t bytes, uhash h);
     HBlock *_prepblock();
     bool _acopy(HBlock& dst, const void *mem, size_t bytes); // allocs 1 byte more to make sure it always ends with a 0 byte
     void _atakeover(HBlock& dst, void *mem, size_t bytes, size_t actualsize);
     void _afree(void *mem, size_t bytes);
     HKey *_kresize(tsize newsize);
+    bool _reserve(tsize extra);
+    FORCEINLINE bool _samehash(const Dedup& other) const { return _hashseed == other._hashseed && _skipAtStart == other._skipAtStart; }
     void _regenkeys(HKey *ks, tsize newmask);
-    void _compact();
+    void _trimtail();
     void _recycle(HBlock& hb);
     tsize _indexof(const HBlock& hb) const;
     sref _finishset(HBlock& hb, HKey& k);
+    sref _found(sref ref); // Existing block that put() handed out again
     HKey *keys;
     tsize mask; // capacity of keys[] = mask + 1
     PodArray<HBlock> arr; // arr[0], arr[1] are sentinels and store an empty and a zero-sized MemBlock, respectively
 
     const tsize _extrabyte;
     const tsize _skipAtStart; // When deduplicating, skip this many bytes at the start (eg. to allow a pointer to mismatch but still consider things equal)
+    const tsize _maxShortLen; // MAX_SHORT_LEN, or 0 if short blocks are disabled
     uhash _hashseed;
     tsize _nextfree; // no unused freelist element if this is < 2 (it's either 0 or >= 2)
     // for the GC
     tsize _sweeppos;
     tsize _inuse;
+    tsize _stale; // Number of keys that may point to unused or reused blocks
 public:
     GC& gc;
 };
@@ -6,6 +6,7 @@
 #include <string.h>
 
 #include "symtable.h"
+#include "strings.h"
 #include "gaobj.h"
 #include "gacoro.h"
 
@@ -57,7 +58,7 @@ static const byte TypeElementSizes[] =
     /* PRIMTYPE_UINT   */ sizeof(uint),
     /* PRIMTYPE_SINT   */ sizeof(sint),
     /* PRIMTYPE_FLOAT  */ sizeof(real),
-    /* PRIMTYPE_STRING */ sizeof(sref),
+    /* PRIMTYPE_STRING */ sizeof(_AnyValU), // ref or inline string
     /* PRIMTYPE_TYPE   */ sizeof(Type),
     /* PRIMTYPE_FUNC   */ sizeof(DFunc*), // TODO
     /* PRIMTYPE_CORO   */ sizeof(DCoro*), // TODO
@@ -133,6 +134,7 @@ void ValU::_init(PrimType tyid)
 
 bool ValU::operator==(const ValU& o) const
 {
+    assert(type != PRIMTYPE_STRING || (!IsPendingStr(u) && !IsPendingStr(o.u))); // Must be flattened first
     return type == o.type && u.opaque == o.u.opaque;
 }
 
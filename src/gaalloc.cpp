@@ -3,8 +3,8 @@
 #include <string.h>
 
 
-BlockListAllocator::BlockListAllocator(GC & gc)
-    : gc(gc), b(NULL)
+BlockListAllocator::BlockListAllocator(GC & gc, Pool *pool)
+    : gc(pool ? pool->gc : gc), b(NULL), pool(pool)
 {
 }
 
@@ -20,7 +20,7 @@ void* BlockListAllocator::alloc(size_t bytes)
     {
         if(b)
             if(void *p = b->alloc(bytes))
-                return memset(p, 0, bytes);
+                return p;
 
         const size_t s1 = b ? b->cap * 2 : 0;
         const size_t s2 = 16 * bytes;
@@ -40,25 +40,66 @@ void BlockListAllocator::clear()
     while(b)
     {
         Block * const prev = b->prev;
-        gc_alloc_unmanaged(gc, b, b->cap, 0);
+        freeBlock(b);
         b = prev;
     }
     this->b = NULL;
 }
 
+void BlockListAllocator::reset()
+{
+    Block *b = this->b;
+    if(!b)
+        return;
+
+    // Blocks double in size, so the newest one is the biggest. If there are others,
+    // replace everything with one block that fits all of it, so that next time a single block is enough.
+    if(b->prev)
+    {
+        size_t total = 0;
+        for(Block *p = b; p; p = p->prev)
+            total += p->cap - sizeof(Block);
+        clear();
+        b = allocBlock(total);
+        if(b)
+            b->prev = NULL;
+        this->b = b;
+    }
+    else
+        b->used = sizeof(Block);
+}
+
+void BlockListAllocator::forEachUsed(UsedFunc f, void *ud) const
+{
+    for(Block *p = b; p; p = p->prev)
+        if(const size_t n = p->used - sizeof(Block))
+            f(ud, (char*)p + sizeof(Block), n);
+}
+
 BlockListAllocator::Block* BlockListAllocator::allocBlock(size_t sz)
 {
     sz += sizeof(Block);
-    Block *newb = gc_alloc_unmanaged_T<Block>(gc, NULL, 0, sz);
-    if(newb)
+    Block *newb = pool ? pool->take(sz) : NULL;
+    if(!newb)
     {
-        newb->prev = NULL;
-        newb->used = sizeof(Block); // don't touch the header
+        newb = (Block*)gc_alloc_unmanaged(gc, NULL, 0, sz);
+        if(!newb)
+            return NULL;
         newb->cap = sz;
     }
+    newb->prev = NULL;
+    newb->used = sizeof(Block); // don't touch the header
     return newb;
 }
 
+void BlockListAllocator::freeBlock(Block *b)
+{
+    if(pool)
+        pool->give(b);
+    else
+        gc_alloc_unmanaged(gc, b, b->cap, 0);
+}
+
 void* BlockListAllocator::Block::alloc(size_t bytes)
 {
     size_t avail = cap - used;
@@ -68,3 +109,45 @@ void* BlockListAllocator::Block::alloc(size_t bytes)
     used += bytes;
     return p;
 }
+
+BlockListAllocator::Pool::Pool(GC& gc)
+    : gc(gc), spare(NULL)
+{
+}
+
+BlockListAllocator::Pool::~Pool()
+{
+    clear();
+}
+
+void BlockListAllocator::Pool::clear()
+{
+    Block *b = spare;
+    while(b)
+    {
+        Block * const prev = b->prev;
+        gc_alloc_unmanaged(gc, b, b->cap, 0);
+        b = prev;
+    }
+    spare = NULL;
+}
+
+BlockListAllocator::Block* BlockListAllocator::Pool::take(size_t minsize)
+{
+    Block **best = NULL;
+    for(Block **pp = &spare; *pp; pp = &(*pp)->prev)
+        if((*pp)->cap >= minsize && (!best || (*pp)->cap < (*best)->cap))
+            best = pp;
+
+    if(!best)
+        return NULL;
+    Block *b = *best;
+    *best = b->prev;
+    return b;
+}
+
+void BlockListAllocator::Pool::give(Block *b)
+{
+    b->prev = spare;
+    spare = b;
+}
@@ -6,12 +6,38 @@ class GC;
 
 class BlockListAllocator
 {
+	struct Block;
+
 public:
-    BlockListAllocator(GC& gc);
+    // Spare blocks, so that allocators that come and go (eg. one per compilation) don't have to go to the GC.
+    // Block sizes follow the same doubling sequence every time, so after a few rounds everything is recycled.
+    // Blocks are allocated from and freed to the pool's GC. Not thread-safe; use one per thread.
+    class Pool
+    {
+    public:
+        Pool(GC& gc);
+        ~Pool();
+        void clear(); // Free all spare blocks
+
+        GC& gc;
+
+    private:
+        friend class BlockListAllocator;
+        Block *take(size_t minsize); // Smallest spare block that has at least minsize bytes, or NULL
+        void give(Block *b);
+        Block *spare;
+    };
+
+    BlockListAllocator(GC& gc, Pool *pool = NULL);
     ~BlockListAllocator();
 
-    void *alloc(size_t bytes);
-    void clear();
+    void *alloc(size_t bytes); // Memory is not initialized
+    void clear(); // Free all blocks, or give them back to the pool
+    void reset(); // Drop all allocations but keep one block that can hold as much as was used so far
+
+    // Calls f for the used part of each block. Allocations within a block are back to back.
+    typedef void (*UsedFunc)(void *ud, void *mem, size_t bytes);
+    void forEachUsed(UsedFunc f, void *ud) const;
 
     GC& gc;
 
@@ -29,5 +55,7 @@ private:
     };
 
     Block *allocBlock(size_t sz);
+    void freeBlock(Block *b);
     Block *b;
+    Pool *pool;
 };
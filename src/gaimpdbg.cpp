@@ -205,7 +205,7 @@ static bool dump(const Runtime& rt, const HLNode *n, unsigned level)
                 case PRIMTYPE_SINT: printf("%zi", v.u.si); break;
                 case PRIMTYPE_BOOL: printf("%s", v.u.ui ? "true" : "false"); break;
                 case PRIMTYPE_FLOAT: printf("%f", v.u.f); break;
-                case PRIMTYPE_STRING: printf("\"%s\"", rt.sp.lookup(v.u.str).s); break;
+                case PRIMTYPE_STRING: { StrTmp tmp; printf("\"%s\"", rt.sp.lookupval(v.u, tmp).s); break; }
                 case PRIMTYPE_FUNC:
                 {
                     const DFunc *df = v.asFunc();
@@ -3,6 +3,7 @@
 ga_RT::ga_RT()
     : sp(this->gc), tr(this->gc)
 {
+    gc.strings = &sp;
 }
 
 ga_RT::~ga_RT()
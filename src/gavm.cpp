@@ -838,6 +838,50 @@ VMFUNC_IMM(iternext, Imm_3xu32)
     CHAIN(rer);
 }
 
+// Iterate over a table. Pushes an index iterator; use with iternext_kv, not iternext.
+VMFUNC_IMM(iter_table, Imm_u32)
+{
+    const Val *t = LOCAL(imm->a);
+    assert(t->type == PRIMTYPE_TABLE);
+    VmIter *it = newiter(vm);
+    it->next = NULL; // not used, iternext_kv knows what to do
+    it->u.index.i = 0;
+    it->u.index.obj = t->u.obj;
+    NEXT();
+}
+
+// Table iterator on top of the iterstack writes key to local a, value to local a+1.
+// Walks the table's value array by index; no hashing.
+VMFUNC_IMM(iternext_kv, Imm_2xu32)
+{
+    VmIter& it = vm->iterstack.back();
+    const Table *t = static_cast<const Table*>(it.u.index.obj);
+    TableCursor c { it.u.index.i };
+    KV e;
+    if(!t->iterate(c, e))
+        NEXT();
+
+    it.u.index.i = c.next;
+    *LOCAL(imm->a) = e.k;
+    *LOCAL(imm->a + 1) = e.v;
+
+    // Jump back
+    ins -= imm->b;
+    CHAIN(rer);
+}
+
+// Remove the entry last produced by iternext_kv from the table. Iteration continues
+// with the next entry as if nothing happened.
+VMFUNC(iterdelcur)
+{
+    VmIter& it = vm->iterstack.back();
+    Table *t = static_cast<Table*>(it.u.index.obj);
+    TableCursor c { it.u.index.i };
+    t->removeCurrent(c);
+    it.u.index.i = c.next;
+    NEXT();
+}
+
 /* Iteration protocol:
 for(int x = 1..5; Thing t = ...) {}
 
@@ -1086,7 +1130,7 @@ VmStackAlloc VM::stack_ensure(Val *sp, size_t n)
         return ret;
     }
 
-    memset(nextbase + oldcap, 0, oldcap * sizeof(Val)); // TODO: this is probably not needed when we knows the used parts of the stack
+    memset(nextbase + oldcap, 0, (newcap - oldcap) * sizeof(Val)); // The GC looks at all of it, see vm_markroot()
 
     // Fixup pointers in the call stack
     const ptrdiff_t d = nextbase - _stkbase;
@@ -1130,6 +1174,14 @@ const Val* VM::getReturns()
     return state >= 0 ? cur.sbase : NULL;
 }
 
+void vm_markroot(Runtime& rt, const void *p)
+{
+    // Slots above the top of the stack may still hold old values. They're kept alive until they're overwritten.
+    const VM *vm = static_cast<const VM*>(p);
+    for(const Val *v = vm->_stkbase; v < vm->_stkend; ++v)
+        gc_markval(rt, *v);
+}
+
 u32 LocalTracker::allocSlot()
 {
     u32 x = _h.size() ? _h.pop() : _max + 1;
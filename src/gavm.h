@@ -2,6 +2,7 @@
 
 #include "defs.h"
 #include "typing.h"
+#include "gc.h"
 #include <vector>
 
 struct VmIter;
@@ -75,6 +76,7 @@ enum RTError
     RTE_NOT_ENOUGH_PARAMS  = RTE_FIRST_ERROR - 6,
     RTE_TOO_MANY_PARAMS    = RTE_FIRST_ERROR - 7,
     RTE_NOT_YIELDABLE      = RTE_FIRST_ERROR - 8,
+    RTE_SIZE_MISMATCH      = RTE_FIRST_ERROR - 9, // Array sizes passed to a builtin don't match
 };
 
 static FORCEINLINE bool RTIsError(int e)
@@ -130,6 +132,9 @@ struct VM
 
 };
 
+// GCmarkroot for a VM's stack. Register it for VMs that aren't part of a GC object.
+void vm_markroot(Runtime& rt, const void *vm);
+
 struct Imm_None
 {
 };
@@ -1,9 +1,10 @@
 #include "gc.h"
-#include "gainternal.h"
+#include "runtime.h"
 #include <string.h>
 #include "array.h"
 #include "table.h"
 #include "gaobj.h"
+#include "symtable.h"
 
 enum _GCflagsPriv // upper 16 bits
 {
@@ -18,6 +19,13 @@ enum
     GC_PHASE_PREMARK, // GC early mark phase (start setting up greylist)
     GC_PHASE_MARK,    // GC object traversal phase (until greylist empty)
     GC_PHASE_SPLICE,  // Separate reachable and unreachable (ie. dead) objects
+    GC_PHASE_SWEEP_DEDUP, // Free unmarked strings and types
+};
+
+enum
+{
+    GC_SWEEP_STRINGS,
+    GC_SWEEP_TYPES,
 };
 
 enum Costs
@@ -47,26 +55,28 @@ struct GCprefix
     inline GCobj *obj() { return reinterpret_cast<GCobj*>(((char*)this) + HDR_SIZE); }
 };
 
-static GCprefix *prefixof(GCobj *obj)
-{
-    assert(obj->gcTypeAndFlags & _GCF_GC_ALLOCATED);
-    return reinterpret_cast<GCprefix*>(((char*)obj) - GCprefix::HDR_SIZE);
-}
-
+// Grey objects go on a separate stack. Their gcnext stays as it is; it links them into the list that's being marked.
 static void makegrey(GC& gc, GCobj *o)
 {
     u32 f = o->gcTypeAndFlags;
+    assert(f & _GCF_GC_ALLOCATED);
     if(f & _GCF_GREY)
         return;
 
-    o->gcTypeAndFlags = f | _GCF_GREY;
+    if(gc.ngrey == gc.greycap)
+    {
+        const size_t newcap = gc.greycap ? gc.greycap * 2 : 64;
+        GCobj **g = gc_alloc_unmanaged_T(gc, gc.grey, gc.greycap, newcap);
+        assert(g); // TODO: handle OOM
+        gc.grey = g;
+        gc.greycap = newcap;
+    }
 
-    GCprefix *p = prefixof(o);
-    p->hdr.gcnext = gc.grey;
-    gc.grey = p;
+    o->gcTypeAndFlags = f | _GCF_GREY;
+    gc.grey[gc.ngrey++] = o;
 }
 
-static int markval(ga_RT& rt, ValU v, int steps)
+static int markval(Runtime& rt, ValU v, int steps)
 {
     assert(v.type < PRIMTYPE_ANY);
 
@@ -76,14 +86,16 @@ static int markval(ga_RT& rt, ValU v, int steps)
     }
     else switch(v.type)
     {
-        case PRIMTYPE_ERROR:
-            assert(false); // ??? FIXME
-        case PRIMTYPE_STRING:
+        case PRIMTYPE_ERROR: // Same as in arrays
             rt.sp.mark(v.u.str);
             break;
 
-        case PRIMTYPE_TYPE:
-            //rt.tr.mark(v.u.t);
+        case PRIMTYPE_STRING:
+            rt.sp.markval(v.u);
+            break;
+
+        case PRIMTYPE_TYPE: // A DType; traversing it marks the type in the registry
+            makegrey(rt.gc, v.u.obj);
             break;
 
         default:
@@ -94,20 +106,27 @@ static int markval(ga_RT& rt, ValU v, int steps)
     return steps - 1;
 }
 
-/*static void weakobj(ga_RT& rt, const GCobj *obj)
+/*static void weakobj(Runtime& rt, const GCobj *obj)
 {
     // TODO: rememeber for later, must remove old elems before sweep
 }*/
 
-static int traverse_valarray_any(ga_RT& rt, const ValU *va, size_t N, int steps)
+static int traverse_valarray_any(Runtime& rt, const ValU *va, size_t N, int steps)
 {
     for(tsize i = 0; i < N; ++i)
         steps = markval(rt, va[i], steps);
     return steps;
 }
 
-static int traverse_array(ga_RT& rt, const DArray *a, int steps)
+static int traverse_array(Runtime& rt, const DArray *a, int steps)
 {
+    // A view has no storage of its own, the parent has all the elements
+    if(DArray *p = a->parent)
+    {
+        makegrey(rt.gc, p);
+        return steps - 1;
+    }
+
     const tsize N = a->size();
     if(!N)
         return steps;
@@ -126,14 +145,19 @@ static int traverse_array(ga_RT& rt, const DArray *a, int steps)
         case PRIMTYPE_TYPE:
         if(const Type *ts = a->storage.ts)
             for(tsize i = 0; i < N; ++i)
-                rt.tr.mark(ts[i]);
+                rt.tr.mark(ts[i], rt.sp);
         break;
 
         case PRIMTYPE_STRING:
+        if(const _AnyValU *ss = a->storage.s)
+            for(tsize i = 0; i < N; ++i)
+                rt.sp.markval(ss[i]);
+        break;
+
         case PRIMTYPE_ERROR:
-        if(const sref *ss = a->storage.s)
+        if(const sref *es = static_cast<const sref*>(a->storage.p))
             for(tsize i = 0; i < N; ++i)
-                rt.sp.mark(ss[i]);
+                rt.sp.mark(es[i]);
         break;
 
         case PRIMTYPE_ARRAY:
@@ -149,7 +173,7 @@ static int traverse_array(ga_RT& rt, const DArray *a, int steps)
     return steps;
 }
 
-static int traverse_table(ga_RT& rt, Table *t, int steps)
+static int traverse_table(Runtime& rt, const Table *t, int steps)
 {
     traverse_array(rt, &t->values(), steps);
 
@@ -160,39 +184,7 @@ static int traverse_table(ga_RT& rt, Table *t, int steps)
 
     }*/
 
-    // mark table keys
-
-    /*if(TKey *ks = t->keys)
-    {
-        switch(t->keytype.id)
-        {
-            case PRIMTYPE_ANY:
-
-
-            case PRIMTYPE_TYPE:
-            if(const Type *ts = a->storage.ts)
-                for(tsize i = 0; i < N; ++i)
-                    rt.tr.mark(ks[i].u.t);
-            break;
-
-            case PRIMTYPE_STRING:
-            case PRIMTYPE_ERROR:
-            if(const sref *ss = a->storage.s)
-                for(tsize i = 0; i < N; ++i)
-                    rt.sp.mark(ss[i]);
-            break;
-
-            case PRIMTYPE_ARRAY:
-            case PRIMTYPE_TABLE:
-            case PRIMTYPE_OBJECT:
-            case PRIMTYPE_FUNC:
-            if(GCobj *objs = a->storage.objs)
-                for(tsize i = 0; i < N; ++i)
-                    makegrey(rt.gc, &objs[i]);
-            break;
-        }
-    }*/
-
+    // Mark table keys
     // FIXME: This might be slow. use faster code with direct keys access, but make sure any unused keys[] is some kind of nil
     const tsize N = t->size();
     for(tsize i = 0; i < N; ++i)
@@ -201,7 +193,7 @@ static int traverse_table(ga_RT& rt, Table *t, int steps)
     return steps;
 }
 
-static int traverse_dobj(ga_RT& rt, DObj *d, int steps)
+static int traverse_dobj(Runtime& rt, DObj *d, int steps)
 {
     //if(d->dfields)
     //    makegrey(rt.gc, d->dfields);
@@ -212,19 +204,33 @@ static int traverse_dobj(ga_RT& rt, DObj *d, int steps)
 
 }
 
-/*
-static int traverse_func(ga_RT& rt, DFunc *obj, int steps)
+static int traverse_func(Runtime& rt, DFunc *f, int steps)
 {
-    // TODO
+    rt.tr.mark(f->info.paramtype, rt.sp);
+    rt.tr.mark(f->info.rettype, rt.sp);
+    rt.tr.mark(f->info.functype, rt.sp);
+    if(f->upvals)
+        steps = traverse_valarray_any(rt, f->upvals, f->info.nupvals, steps);
+    return steps;
+}
+
+static int traverse_symtab(Runtime& rt, SymTable *st, int steps)
+{
+    return traverse_table(rt, &st->table(), steps);
+}
+
+static int traverse_dtype(Runtime& rt, DType *d, int steps)
+{
+    rt.tr.mark(d->tid, rt.sp); // Also marks the strings and types it refers to
+    return traverse_table(rt, &d->fieldIndices, steps);
 }
-*/
 
 // Mark object; delay marking of children
-static int traverse_obj(ga_RT& rt, GCobj *obj, int steps)
+static int traverse_obj(Runtime& rt, GCobj *obj, int steps)
 {
-    makegrey(rt.gc, obj->dtype);
+    if(obj->dtype)
+        makegrey(rt.gc, obj->dtype);
 
-    GCprefix *pre = prefixof(obj);
     u32 f = obj->gcTypeAndFlags;
     obj->gcTypeAndFlags = f | _GCF_BLACK;
 
@@ -237,8 +243,9 @@ static int traverse_obj(ga_RT& rt, GCobj *obj, int steps)
         case PRIMTYPE_ARRAY:  return traverse_array(rt, static_cast<DArray*>(obj), steps);
         case PRIMTYPE_TABLE:  return traverse_table(rt, static_cast<Table*>(obj), steps);
         case PRIMTYPE_OBJECT: return traverse_dobj(rt, static_cast<DObj*>(obj), steps);
-        //case PRIMTYPE_FUNC:   return traverse_func(rt, static_cast<DFunc*>(obj), steps);
-            // TODO
+        case PRIMTYPE_FUNC:   return traverse_func(rt, static_cast<DFunc*>(obj), steps);
+        case PRIMTYPE_SYMTAB: return traverse_symtab(rt, static_cast<SymTable*>(obj), steps);
+        case PRIMTYPE_TYPE:   return traverse_dtype(rt, static_cast<DType*>(obj), steps);
         default: ;
     }
 
@@ -255,46 +262,45 @@ static void _gc_freeobj(GC& gc, GCprefix *o)
 
 }
 
-// not sure if this is necessary
-void makePinnedGrey(GC& gc)
+static void markroots(Runtime& rt)
 {
-    GCprefix *o = gc.pinned;
-    if(!o) // TODO: there will always be some pinned objects later on, then this check can be removed
-        return;
-    GCprefix *greyhead = gc.grey;
-    GCprefix *whitehead = gc.normallywhite;
+    // Builtin types are always there
+    for(unsigned t = 0; t < PRIMTYPE_MAX; ++t)
+        if(DType *d = rt.tr.lookup(t))
+            makegrey(rt.gc, d);
 
-    do
-    {
-        GCprefix *const next = o->hdr.gcnext;
+    for(GCroot *r = rt.gc.roots; r; r = r->next)
+        r->mark(rt, r->ud);
+}
 
-        if(o->gcTypeAndFlags & _GCF_PINNED) // Keep pinned object pinned, and make it grey
-        {
-            o->gcTypeAndFlags |= _GCF_BLACK;
-            o->hdr.gcnext = greyhead;
-            greyhead = o;
-        }
-        else // Object got unpinned, unlink it from the pinned list into the regular list
+// Traverse grey objects until none are left. Returns 0 if more steps are needed.
+static size_t markstep(Runtime& rt, size_t n)
+{
+    GC& gc = rt.gc;
+    int steps = n < INT_MAX ? int(n) : INT_MAX;
+    for(;;)
+    {
+        while(gc.ngrey)
         {
-            o->hdr.gcnext = whitehead;
-            whitehead = o;
+            if(steps <= 0)
+                return 0;
+            steps = traverse_obj(rt, gc.grey[--gc.ngrey], steps - 1);
         }
-        o = next;
+        if(gc.markpass)
+            break;
+        // Roots may have picked up things since they were marked. Mark them again, all at once;
+        // afterwards, only what they reached is left to traverse.
+        markroots(rt);
+        gc.markpass = 1;
     }
-    while(o);
 
-    gc.pinned = NULL;
-    gc.normallywhite = whitehead;
-    gc.grey = greyhead;
+    gc_alloc_unmanaged_T(gc, gc.grey, gc.greycap, 0);
+    gc.grey = NULL;
+    gc.greycap = 0;
+    return steps > 0 ? size_t(steps) : 1;
 }
 
-static size_t markstep(GC& gc, int n)
-{
-    assert(false); // TODO
-    return n;
-}
-
-static void runfinalizer(ga_RT& gc, GCprefix *o)
+static void runfinalizer(Runtime& rt, GCprefix *o)
 {
     // TODO
     GCobj *obj = o->obj();
@@ -357,7 +363,7 @@ static bool gc_canstart(GC& gc)
     return true; // TODO
 }
 
-static void freesomedead(ga_RT& rt)
+static void freesomedead(Runtime& rt)
 {
     GCprefix *o = rt.gc.dead;
     if(!o)
@@ -402,7 +408,83 @@ static void freesomedead(ga_RT& rt)
     rt.gc.dead = o;
 }
 
-void gc_step(ga_RT& rt, size_t n)
+// Dedup sets can only be swept after marking is complete.
+// Compaction is cheap enough to allow it each time; it only happens when there's a lot to give back.
+static size_t sweepdedup(Runtime& rt, size_t n)
+{
+    GC& gc = rt.gc;
+    const tsize maxstep = tsize(-1) >> 1u;
+    switch(gc.sweepstage)
+    {
+        case GC_SWEEP_STRINGS:
+        {
+            const tsize left = rt.sp.sweepstep(n < maxstep ? tsize(n) : maxstep);
+            if(!left)
+                return 0;
+            rt.sp.sweepfinish(true);
+            rt.sp.sweeppending();
+            gc.sweepstage = GC_SWEEP_TYPES;
+            n = left;
+        }
+        // fall through
+        case GC_SWEEP_TYPES:
+        {
+            const tsize left = rt.tr.sweepstep(n < maxstep ? tsize(n) : maxstep);
+            if(!left)
+                return 0;
+            rt.tr.sweepfinish(true);
+            gc.sweepstage = GC_SWEEP_STRINGS;
+            return left;
+        }
+    }
+    unreachable();
+    return 0;
+}
+
+void gc_mark(GC& gc, GCobj *obj)
+{
+    if(gc.phase == GC_PHASE_MARK)
+        makegrey(gc, obj);
+}
+
+void gc_markval(Runtime& rt, const ValU& v)
+{
+    markval(rt, v, 1);
+}
+
+void gc_addroot(GC& gc, GCroot& r, GCmarkroot mark, const void *ud)
+{
+    assert(mark && !r.mark);
+    r.mark = mark;
+    r.ud = ud;
+    r.next = gc.roots;
+    gc.roots = &r;
+}
+
+void gc_removeroot(GC& gc, GCroot& r)
+{
+    if(!r.mark)
+        return;
+    for(GCroot **pr = &gc.roots; *pr; pr = &(*pr)->next)
+        if(*pr == &r)
+        {
+            *pr = r.next;
+            break;
+        }
+    r.mark = NULL;
+    r.next = NULL;
+}
+
+// Objects that were created during the last cycle and then reached via a root were never spliced,
+// so they still have its mark flags
+static GCprefix *clearmarks(GCprefix *o)
+{
+    for(GCprefix *p = o; p; p = p->hdr.gcnext)
+        p->gcTypeAndFlags &= ~(_GCF_BLACK | _GCF_GREY);
+    return o;
+}
+
+void gc_step(Runtime& rt, size_t n)
 {
     GC& gc = rt.gc;
 
@@ -415,16 +497,30 @@ void gc_step(ga_RT& rt, size_t n)
                 break;
             gc.phase = GC_PHASE_PREMARK;
         case GC_PHASE_PREMARK:
-            assert(!gc.grey);
+            assert(!gc.ngrey);
             assert(!gc.tosplice);
-            gc.tosplice = gc.normallywhite;
+            gc.tosplice = clearmarks(gc.normallywhite);
             // Objects created from now on end up in the new white list, and are not touched in this GC cycle.
             gc.normallywhite = NULL;
-            gc.grey = gc.pinned;
-            gc.pinned = NULL;
+            // Pinned objects are always grey. Splicing puts them back into the pinned list.
+            if(GCprefix *o = clearmarks(gc.pinned))
+            {
+                for(;;)
+                {
+                    makegrey(gc, o->obj());
+                    if(!o->hdr.gcnext)
+                        break;
+                    o = o->hdr.gcnext;
+                }
+                o->hdr.gcnext = gc.tosplice;
+                gc.tosplice = gc.pinned;
+                gc.pinned = NULL;
+            }
             gc.phase = GC_PHASE_MARK;
+            gc.markpass = 0;
+            markroots(rt);
         case GC_PHASE_MARK:
-            n = markstep(gc, n);
+            n = markstep(rt, n);
             if(!n)
                 return;
             gc.phase = GC_PHASE_SPLICE;
@@ -433,11 +529,29 @@ void gc_step(ga_RT& rt, size_t n)
             if(!n || gc.tosplice)
                 return;
             assert(!gc.tosplice);
+            gc.phase = GC_PHASE_SWEEP_DEDUP;
+        case GC_PHASE_SWEEP_DEDUP:
+            n = sweepdedup(rt, n);
+            if(!n)
+                return;
             gc.phase = GC_PHASE_IDLE;
             break;
     }
 }
 
+void gc_collect(Runtime& rt)
+{
+    GC& gc = rt.gc;
+    const size_t n = size_t(1) << 20;
+    while(gc.phase != GC_PHASE_IDLE)
+        gc_step(rt, n);
+    do
+        gc_step(rt, n);
+    while(gc.phase != GC_PHASE_IDLE);
+    while(gc.dead)
+        freesomedead(rt);
+}
+
 GCobj *gc_new(GC& gc, size_t bytes, PrimType gctype)
 {
     STATIC_ASSERT(PRIMTYPE_ANY < 0xff);
@@ -454,6 +568,7 @@ GCobj *gc_new(GC& gc, size_t bytes, PrimType gctype)
 
     p->gcTypeAndFlags = _GCF_GC_ALLOCATED | gctype;
     p->gcsize = bytes;
+    p->obj()->dtype = NULL; // Marking looks at it; not all objects set one
 
     // Link object into the gc list. If a collection is in progress,
     p->hdr.gcnext = gc.normallywhite;
@@ -3,7 +3,8 @@
 #include "defs.h"
 #include "util.h"
 
-struct ga_RT;
+struct Runtime;
+class StringPool;
 
 typedef void* (*Galloc)(void *ud, void *ptr, size_t osize, size_t nsize);
 
@@ -26,20 +27,38 @@ struct GCprefix;
 
 // Prototol: each walk consumes steps.
 // return >0 means this many steps are left (ie. this function finished its job); if 0, more steps are needed
-typedef size_t (*GCwalk)(ga_RT& rt, GCobj *obj, size_t steps);
+typedef size_t (*GCwalk)(Runtime& rt, GCobj *obj, size_t steps);
+
+// Anything that keeps strings, types or objects alive from outside of GC objects (VM stacks, Symstore, MLIR, ...)
+// registers a root. Its mark function is called at the start of the mark phase, and once more at its end.
+// It must mark everything the owner refers to, via gc_markval(), StringPool::mark() and TypeRegistry::mark().
+typedef void (*GCmarkroot)(Runtime& rt, const void *ud);
+
+struct GCroot
+{
+    GCroot *next;
+    GCmarkroot mark; // NULL when not registered
+    const void *ud;
+};
 
 struct GC
 {
     GCprefix *normallywhite; // Regular objects
-    GCprefix *grey;          // Grey list, used during mark phase
+    GCobj **grey;            // Grey stack: reached, but not traversed yet. Only allocated during the mark phase.
+    size_t ngrey, greycap;
+    GCroot *roots;
     GCprefix *pinned;
     GCprefix *tosplice;
     GCprefix *dead;
     GCiter iter;
     GCwalk walkfunc;
     unsigned phase;
+    unsigned markpass; // 1 once the roots were marked again at the end of the mark phase
+    unsigned sweepstage; // Which Dedup set is being swept in the GC_PHASE_SWEEP_DEDUP phase
     Galloc alloc;
     void *gcud;
+    uhash hashseed; // Seed for anything that hashes; randomized per runtime to make hash flooding impractical
+    StringPool *strings; // The runtime's pool. Tables intern pending strings (see strings.h) here when they become keys.
     struct
     {
         size_t used;
@@ -48,7 +67,12 @@ struct GC
 };
 
 
-void gc_step(GC& gc, size_t n);
+void gc_step(Runtime& rt, size_t n);
+void gc_collect(Runtime& rt); // Finishes the running GC cycle, if any, then runs a full one
+void gc_mark(GC& gc, GCobj *obj); // Keeps obj alive if a GC cycle is marking right now. For things the GC can't see on its own.
+void gc_markval(Runtime& rt, const ValU& v); // For GCmarkroot functions
+void gc_addroot(GC& gc, GCroot& r, GCmarkroot mark, const void *ud); // r must stay in place until it's removed
+void gc_removeroot(GC& gc, GCroot& r); // Does nothing if r isn't registered
 GCobj *gc_new(GC& gc, size_t bytes, PrimType gctype); // new object is uninitialized; use GA_PLACEMENT_NEW() to init
 void *gc_alloc_unmanaged(GC& gc, void *p, size_t oldsize, size_t newsize);
 
@@ -1,40 +1,140 @@
 #include "hashfunc.h"
+#include "strings.h"
+#include <string.h>
 
+/*
+Notes:
+- memhash() processes 16 bytes per iteration in two independent 64-bit lanes
+  (so the multiplies can overlap), then 8 bytes, then the tail in one go.
+- Each lane step is the usual multiply-rotate-multiply round; the final mix is the
+  murmur3 64-bit finalizer, so every input bit affects every output bit.
+- Loads go through memcpy() so unaligned input is fine; compilers turn that into a single load.
+- The result must not depend on the CPU the code is running on, since hashes are stored
+  (eg. Dedup::HBlock::h). That's why there's intentionally no separate SIMD path.
+*/
+
+enum : uint64_t
+{
+    PRIME1 = 0x9E3779B185EBCA87ull,
+    PRIME2 = 0xC2B2AE3D27D4EB4Full,
+    PRIME3 = 0x165667B19E3779F9ull,
+};
+
+FORCEINLINE static uint64_t rotl64(uint64_t x, unsigned n)
+{
+    return (x << n) | (x >> (64u - n));
+}
+
+FORCEINLINE static uint64_t load64(const unsigned char *p)
+{
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+// Up to 7 bytes; unused bytes are zero
+FORCEINLINE static uint64_t loadtail(const unsigned char *p, size_t n)
+{
+    uint64_t x = 0;
+    memcpy(&x, p, n);
+    return x;
+}
+
+FORCEINLINE static uint64_t round64(uint64_t acc, uint64_t w)
+{
+    acc += w * PRIME2;
+    acc = rotl64(acc, 31);
+    return acc * PRIME1;
+}
+
+// murmur3 fmix64
+FORCEINLINE static uint64_t fmix64(uint64_t x)
+{
+    x ^= x >> 33u;
+    x *= 0xFF51AFD7ED558CCDull;
+    x ^= x >> 33u;
+    x *= 0xC4CEB9FE1A85EC53ull;
+    x ^= x >> 33u;
+    return x;
+}
+
+FORCEINLINE static uhash fold(uint64_t x)
+{
+    return uhash(x ^ (x >> 32u));
+}
 
 // hash and strlen() in one
 HStr lenhash(uhash h, const char * const s)
 {
-    const char *p = s;
-    for(;;)
+    HStr hs;
+    hs.len = strlen(s);
+    hs.h = memhash(h, s, hs.len);
+    return hs;
+}
+
+FORCEINLINE static void hashbegin(MemHashState& st, uhash h)
+{
+    st.a = h + PRIME1;
+    st.b = (uint64_t(h) << 32u) ^ PRIME3;
+}
+
+FORCEINLINE static void hashblock(MemHashState& st, const unsigned char *p)
+{
+    st.a = round64(st.a, load64(p));
+    st.b = round64(st.b, load64(p + 8));
+}
+
+// n < 16
+FORCEINLINE static uhash hashend(MemHashState& st, const unsigned char *p, size_t n, size_t size)
+{
+    if(n >= 8)
     {
-        unsigned char c = (unsigned char)*p++;
-        if(!c)
-            break;
-        h = (h << 5u) + (h >> 2u) + c;
+        st.a = round64(st.a, load64(p));
+        p += 8;
+        n -= 8;
     }
+    if(n)
+        st.b = round64(st.b, loadtail(p, n));
 
-    HStr hs;
-    hs.len = (const char*)p - s - 1;
-    hs.h = h;
-    return hs;
+    return fold(fmix64(st.a ^ rotl64(st.b, 27) ^ (uint64_t(size) * PRIME3)));
 }
 
 // same hash but known length
 uhash memhash(uhash h, const void *buf, size_t size)
 {
     const unsigned char *p = (const unsigned char*)buf;
-    do
-        h = (h << 5u) + (h >> 2u) + *p++;
-    while(--size);
-    return h;
+    MemHashState st;
+    hashbegin(st, h);
+    size_t n = size;
+    for( ; n >= 16; n -= 16, p += 16)
+        hashblock(st, p);
+    return hashend(st, p, n, size);
+}
+
+void memhash_begin(MemHashState& st, uhash h)
+{
+    hashbegin(st, h);
+}
+
+void memhash_block(MemHashState& st, const void *block16)
+{
+    hashblock(st, (const unsigned char*)block16);
+}
+
+uhash memhash_end(MemHashState& st, const void *tail, size_t n, size_t size)
+{
+    assert(n < 16);
+    return hashend(st, (const unsigned char*)tail, n, size);
 }
 
 uhash hashvalue(uhash h, ValU v)
 {
-    h ^= rotl(0x811c9dc5, v.type);
-    h += v.u.opaque;
-    h ^= v.u.opaque >> 6u; // Improve binning for pointer values (which usually have the lower 2-3 bits at zero due to alignment)
-    if(sizeof(v.u.opaque) > sizeof(uhash))
-        h += v.u.opaque >> 29u;
-    return h;
+    assert(v.type != PRIMTYPE_STRING || !IsPendingStr(v.u)); // Must be flattened first
+    const uint64_t k = (uint64_t(h) << 32u | h) ^ (uint64_t(v.type) * PRIME1);
+    return fold(fmix64(uint64_t(v.u.opaque) ^ k));
+}
+
+uhash mkhashseed(uintptr_t entropy)
+{
+    return fold(fmix64(uint64_t(entropy) * PRIME2 + PRIME3));
 }
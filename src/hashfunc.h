@@ -11,9 +11,6 @@ struct HStr
 };
 
 
-#define HASH_SEED 0  // FIXME
-
-
 FORCEINLINE static uhash rotl(uhash h, unsigned n)
 {
     enum { Bits = CHAR_BIT * sizeof(uhash), Mask = Bits - 1 };
@@ -35,4 +32,20 @@ HStr lenhash(uhash h, const char * const s);
 // same hash but known length
 uhash memhash(uhash h, const void *buf, size_t size);
 
+// memhash() in pieces, for input that is scanned 16 bytes at a time anyway.
+// Feed every full 16-byte block in order, then finish with the remaining n < 16 bytes.
+// The result is the same as memhash() over all size bytes.
+struct MemHashState
+{
+    uint64_t a, b;
+};
+void memhash_begin(MemHashState& st, uhash h);
+void memhash_block(MemHashState& st, const void *block16);
+uhash memhash_end(MemHashState& st, const void *tail, size_t n, size_t size);
+
+// Hash of a value as it's used as a table key. Bits of the value and its type are mixed thoroughly,
+// so that consecutive integers or aligned pointers don't end up in consecutive slots.
 uhash hashvalue(uhash h, ValU v);
+
+// Turn some (low-quality) entropy, eg. a few addresses xor'd together, into a usable hash seed.
+uhash mkhashseed(uintptr_t entropy);
@@ -8,13 +8,40 @@
 #include "runtime.h"
 
 
-HLIRBuilder::HLIRBuilder(GC& gc)
-    : bla(gc)
+HLIRBuilder::HLIRBuilder(GC& gc, BlockListAllocator::Pool *pool)
+    : bla(gc, pool), gc(gc)
 {
 }
 
 HLIRBuilder::~HLIRBuilder()
 {
+    _freeLists();
+}
+
+void HLIRBuilder::reset()
+{
+    _freeLists();
+    bla.reset();
+}
+
+static void freeListsInBlock(void *ud, void *mem, size_t bytes)
+{
+    GC& gc = *(GC*)ud;
+    byte *p = (byte*)mem;
+    const byte * const end = p + bytes;
+    for(HLNode *node; p < end; p += node->_size)
+    {
+        node = (HLNode*)p;
+        if(node->_nch == HLList::Children && !(node->flags & HLFLAG_NOEXTMEM))
+            node->u.list.dealloc(gc);
+    }
+}
+
+// Nothing but nodes lives in bla, and each node knows its size, so the blocks can be walked.
+// Lists that were cleared already have _nch == 0, so nothing is freed twice.
+void HLIRBuilder::_freeLists()
+{
+    bla.forEachUsed(freeListsInBlock, &gc);
 }
 
 HLNode* HLIRBuilder::list(GC& gc, size_t prealloc)
@@ -27,7 +54,7 @@ HLNode *HLList::add(HLNode* node, GC& gc)
 {
     if(used == cap)
     {
-        const size_t newcap = 4 + (2 * cap);
+        const size_t newcap = list ? 4 + (2 * cap) : InlineCap;
         if(!resize(gc, newcap))
             return NULL;
     }
@@ -38,15 +65,40 @@ HLNode *HLList::add(HLNode* node, GC& gc)
 
 HLNode **HLList::resize(GC& gc, size_t n)
 {
-    HLNode **newlist = gc_alloc_unmanaged_T<HLNode*>(gc, list, cap, n);
+    HLNode **newlist;
+    if(!list || list == inl)
+    {
+        // Short lists don't need any extra memory
+        if(n <= InlineCap)
+        {
+            list = inl;
+            cap = InlineCap;
+            return list;
+        }
+        newlist = gc_alloc_unmanaged_T<HLNode*>(gc, NULL, 0, n);
+        if(newlist && used)
+            memcpy(newlist, inl, used * sizeof(*inl));
+    }
+    else
+        newlist = gc_alloc_unmanaged_T<HLNode*>(gc, list, cap, n);
+
     if(newlist)
     {
         list = newlist;
-        cap = n;
+        cap = u32(n);
     }
     return newlist;
 }
 
+void HLList::dealloc(GC& gc)
+{
+    if(list != inl)
+        gc_alloc_unmanaged_T<HLNode*>(gc, list, cap, 0);
+    list = NULL;
+    cap = 0;
+    used = 0;
+}
+
 HLNode::~HLNode()
 {
     assert(type == HLNODE_NONE);
@@ -384,7 +436,7 @@ void HLNode::clear(GC& gc)
     if(!(flags & HLFLAG_NOEXTMEM))
     {
         if(_nch == HLList::Children)
-            gc_alloc_unmanaged_T<HLNode*>(gc, u.list.list, u.list.cap, 0);
+            u.list.dealloc(gc);
     }
 
     _nch = 0;
@@ -510,7 +562,8 @@ HLNode * HLNode::clone(HLFoldTracker& ft) const
     byte *mem = (byte*)gc_alloc_unmanaged(rt.gc, NULL, 0, totalbytes);
 
     HLNode *funcroot = (HLNode*)mem;
-    memcpy(funcroot, body, sizeof(HLNode)); // Copy metadata like line number; this copies some more but whatev
+    memcpy(funcroot, body, body->_size); // Copy metadata like line number; this copies some more but whatev
+    funcroot->_size = sizeof(*funcroot);
     mem += sizeof(*funcroot);
 
     FuncProto * const proto = (FuncProto*)mem;
@@ -654,7 +707,9 @@ HLNode* HLNode::_clone(void* mem, size_t bytes, HLFoldTracker& ft) const
 
 byte *HLNode::_cloneRec(byte *m, HLNode *target, HLFoldTracker& ft) const
 {
-    memcpy(target, this, sizeof(*this));
+    // The clone gets a whole HLNode, so that folding can mutate it into anything
+    memcpy(target, this, _size);
+    target->_size = sizeof(*target);
 
     size_t nch = _nch;
     HLNode **dst = &target->u.aslist[0];
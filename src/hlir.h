@@ -9,6 +9,8 @@
 #include "gaalloc.h"
 #include "symtable.h"
 #include <vector>
+#include <string.h>
+#include <stddef.h>
 
 
 struct GC;
@@ -143,13 +145,15 @@ struct HLWhileLoop : HLNodeBase
 
 struct HLList : HLNodeBase
 {
-    enum { EnumType = HLNODE_LIST, Children = 0xff };
-    size_t used;
-    size_t cap;
-    HLNode **list;
+    enum { EnumType = HLNODE_LIST, Children = 0xff, InlineCap = 1 };
+    u32 used;
+    u32 cap;
+    HLNode **list; // points to inl while the list is short enough
+    HLNode *inl[InlineCap];
 
     HLNode *add(HLNode *node, GC& gc); // returns node, unless memory allocation fails
     HLNode **resize(GC& gc, size_t n);
+    void dealloc(GC& gc); // Frees external storage, if any, and empties the list
 };
 
 struct HLVarDef : HLNodeBase // appears only as child of HLVarDeclList
@@ -309,14 +313,25 @@ struct HLPreVisitResult
 typedef HLPreVisitResult (*HLPreVisitor)(HLNode *node, void *ud);
 typedef void (*HLPostVisitor)(HLNode *node, void *ud, uintptr_t aux);
 
-// All of the node types intentionally occupy the same memory.
+// All of the node types intentionally share the same memory.
 // This is so that a node type can be easily mutated into another,
 // while keeping pointers intact.
 // This is to make node-based optimization easier.
+// The header comes first, so that a node only needs to be as big as the type it was created as.
+// It can be mutated into any type that fits (see MinSize); everything is at least big enough for a constant.
 struct HLNode
 {
     ~HLNode();
 
+    u16 line;
+    u16 column;
+    byte type; // HLNodeType
+    byte tok; // Lexer::TokenType
+    byte flags; // any of the flags above, depends on type
+    byte _nch; // number of child nodes
+    Type mytype; // derived type (PRIMTYPE_* or custom),
+    byte _size; // bytes allocated for this node
+
     union
     {
         HLConstantValue constant;
@@ -347,13 +362,13 @@ struct HLNode
 
         HLNode *aslist[3];
     } u;
-    u16 line;
-    u16 column;
-    byte type; // HLNodeType
-    byte tok; // Lexer::TokenType
-    byte flags; // any of the flags above, depends on type
-    byte _nch; // number of child nodes
-    Type mytype; // derived type (PRIMTYPE_* or custom),
+
+    // Bytes needed for a node that starts out as T
+    template<typename T> static inline size_t MinSize()
+    {
+        const size_t n = offsetof(HLNode, u) + (sizeof(T) > sizeof(HLConstantValue) ? sizeof(T) : sizeof(HLConstantValue));
+        return (n + (sizeof(void*) - 1)) & ~(sizeof(void*) - 1);
+    }
 
     template<typename T> T *as()
     {
@@ -407,6 +422,7 @@ struct HLNode
     template<typename T>
     inline HLNode *unsafemorph()
     {
+        assert(offsetof(HLNode, u) + sizeof(T) <= _size);
         type = HLNodeType(T::EnumType);
         _nch = T::Children;
         mytype = T::DefaultValType;
@@ -449,8 +465,12 @@ private:
 class HLIRBuilder
 {
 public:
-    HLIRBuilder(GC& gc);
-    ~HLIRBuilder();
+    // If pool is given, memory comes from there and goes back there. The GC is still used for lists.
+    HLIRBuilder(GC& gc, BlockListAllocator::Pool *pool = NULL);
+    ~HLIRBuilder(); // Frees all nodes built so far, including the lists' storage
+
+    // Frees all nodes, but keeps the memory around to build the next tree
+    void reset();
 
     inline HLNode *constantValue() { return allocT<HLConstantValue>(); }
     inline HLNode *unary()         { return allocT<HLUnary>();         }
@@ -484,11 +504,24 @@ public:
 private:
 
     BlockListAllocator bla;
+    GC& gc;
+
+    void _freeLists();
 
     template<typename T> inline HLNode *allocT()
     {
-        HLNode *node = (HLNode*)bla.alloc(sizeof(HLNode));
-        return node ? node->unsafemorph<T>() : NULL;
+        const size_t sz = HLNode::MinSize<T>();
+        HLNode *node = (HLNode*)bla.alloc(sz);
+        if(!node)
+            return NULL;
+        // Only the part of the union that T uses must start out zeroed; the rest is never looked at
+        memset(&node->u, 0, sizeof(T));
+        node->line = 0;
+        node->column = 0;
+        node->tok = 0;
+        node->flags = 0;
+        node->_size = byte(sz);
+        return node->unsafemorph<T>();
     }
 };
 
@@ -1,6 +1,17 @@
 #include "io_libc.h"
 #include "serialio.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifndef _WIN32
+#define IO_USE_MMAP
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 int sinknop(BufSink *sk)
 {
@@ -41,3 +52,204 @@ void sink_initHexPrint(BufSink* sk)
     sk->Write = hexwrite;
     sk->Close = hexclose;
 }
+
+// --- Streams ---
+// mapped file: priv.a = mapping, priv.sz = size
+// chunked: priv.a = FILE*, priv.b = buffer, priv.c = non-NULL if the FILE is ours to close, priv.sz = buffer size
+
+static void smclosed(BufStream *sm)
+{
+    sm->cursor = sm->begin = sm->end = NULL;
+    sm->Refill = NULL;
+    sm->Close = NULL;
+}
+
+static int smeof(BufStream *sm)
+{
+    sm->begin = sm->cursor = sm->end;
+    sm->err = SM_EOF;
+    return SM_EOF;
+}
+
+#ifdef IO_USE_MMAP
+static void mapclose(BufStream *sm)
+{
+    if(sm->priv.sz)
+        munmap(sm->priv.a, sm->priv.sz);
+    smclosed(sm);
+}
+#endif
+
+static int filerefill(BufStream *sm)
+{
+    if(sm->err)
+        return sm->err;
+    FILE *f = (FILE*)sm->priv.a;
+    char *buf = (char*)sm->priv.b;
+    const size_t n = fread(buf, 1, sm->priv.sz, f);
+    sm->begin = sm->cursor = buf;
+    sm->end = buf + n;
+    if(n)
+        return 0;
+    if(ferror(f))
+    {
+        sm->err = EIO;
+        return EIO;
+    }
+    return smeof(sm);
+}
+
+static void fileclose(BufStream *sm)
+{
+    if(sm->priv.c)
+        fclose((FILE*)sm->priv.a);
+    free(sm->priv.b);
+    smclosed(sm);
+}
+
+int sm_initFILE(BufStream *sm, FILE *f, size_t bufsize)
+{
+    memset(sm, 0, sizeof(*sm));
+    if(!bufsize)
+        bufsize = 64 * 1024;
+    void *buf = malloc(bufsize);
+    if(!buf)
+        return ENOMEM;
+    sm->priv.a = f;
+    sm->priv.b = buf;
+    sm->priv.sz = bufsize;
+    sm->begin = sm->cursor = sm->end = (const char*)buf; // Empty; the first Refill() reads
+    sm->Refill = filerefill;
+    sm->Close = fileclose;
+    return 0;
+}
+
+int sm_openFile(BufStream *sm, const char *fn)
+{
+    memset(sm, 0, sizeof(*sm));
+#ifdef IO_USE_MMAP
+    const int fd = open(fn, O_RDONLY);
+    if(fd < 0)
+        return errno;
+    struct stat st;
+    if(!fstat(fd, &st) && S_ISREG(st.st_mode) && size_t(st.st_size) == uint64_t(st.st_size))
+    {
+        const size_t size = size_t(st.st_size);
+        void *p = size ? mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+        if(p != MAP_FAILED)
+        {
+            close(fd); // The mapping stays valid
+            sm->priv.a = p;
+            sm->priv.sz = size;
+            sm->begin = sm->cursor = (const char*)p;
+            sm->end = sm->begin + size;
+            sm->Refill = smeof; // Everything is already there
+            sm->Close = mapclose;
+            return 0;
+        }
+    }
+    close(fd);
+    // Not a regular file, or mapping failed. Just read it then.
+#endif
+
+    FILE *f = fopen(fn, "rb");
+    if(!f)
+        return errno ? errno : ENOENT;
+    const int err = sm_initFILE(sm, f, 0);
+    if(err)
+    {
+        fclose(f);
+        return err;
+    }
+    sm->priv.c = f; // Close it when done
+    return 0;
+}
+
+// --- File sink ---
+// priv.a = FILE*, priv.b = buffer, priv.c = write position in buffer, priv.sz = buffer size
+
+static int fileflushbuf(BufSink *sk)
+{
+    char *buf = (char*)sk->priv.b;
+    const size_t n = (char*)sk->priv.c - buf;
+    sk->priv.c = buf;
+    if(n && fwrite(buf, 1, n, (FILE*)sk->priv.a) != n && !sk->err)
+        sk->err = errno ? errno : EIO;
+    return sk->err;
+}
+
+static int filewrite(BufSink *sk, const void *mem, size_t n)
+{
+    if(sk->err)
+        return sk->err;
+    char *buf = (char*)sk->priv.b;
+    char *pos = (char*)sk->priv.c;
+    const size_t space = sk->priv.sz - (pos - buf);
+    if(n <= space)
+    {
+        memcpy(pos, mem, n);
+        sk->priv.c = pos + n;
+        return 0;
+    }
+
+    // Doesn't fit. Fill up the buffer and write it; anything larger than the buffer goes out directly.
+    memcpy(pos, mem, space);
+    sk->priv.c = pos + space;
+    const char *p = (const char*)mem + space;
+    n -= space;
+    if(fileflushbuf(sk))
+        return sk->err;
+    if(n >= sk->priv.sz)
+    {
+        if(fwrite(p, 1, n, (FILE*)sk->priv.a) != n)
+            sk->err = errno ? errno : EIO;
+        return sk->err;
+    }
+    memcpy(buf, p, n);
+    sk->priv.c = buf + n;
+    return 0;
+}
+
+static int fileflush(BufSink *sk)
+{
+    if(!fileflushbuf(sk) && fflush((FILE*)sk->priv.a))
+        sk->err = errno ? errno : EIO;
+    return sk->err;
+}
+
+static void fileclosesink(BufSink *sk)
+{
+    fileflushbuf(sk);
+    if(fclose((FILE*)sk->priv.a) && !sk->err)
+        sk->err = errno ? errno : EIO;
+    free(sk->priv.b);
+    sk->priv.a = sk->priv.b = sk->priv.c = NULL;
+    sk->Write = NULL;
+    sk->Flush = NULL;
+    sk->Close = NULL;
+}
+
+int sink_openFile(BufSink *sk, const char *fn, size_t bufsize)
+{
+    memset(sk, 0, sizeof(*sk));
+    if(!bufsize)
+        bufsize = 64 * 1024;
+    FILE *f = fopen(fn, "wb");
+    if(!f)
+        return errno ? errno : EIO;
+    char *buf = (char*)malloc(bufsize);
+    if(!buf)
+    {
+        fclose(f);
+        return ENOMEM;
+    }
+    setvbuf(f, NULL, _IONBF, 0); // We buffer already
+    sk->priv.a = f;
+    sk->priv.b = buf;
+    sk->priv.c = buf;
+    sk->priv.sz = bufsize;
+    sk->Write = filewrite;
+    sk->Flush = fileflush;
+    sk->Close = fileclosesink;
+    return 0;
+}
@@ -2,5 +2,17 @@
 
 #include "defs.h"
 #include "serialio.h"
+#include <stdio.h>
 
 void sink_initHexPrint(BufSink *sk);
+
+// All of these return 0 on success, otherwise an errno value, and the stream/sink is unusable then.
+
+// Reads a whole file. The file is mapped read-only if possible, and then all of it is available right away
+// without copying (the first Refill() already signals EOF). Otherwise it's read in chunks.
+int sm_openFile(BufStream *sm, const char *fn);
+// Reads from an already opened file (eg. stdin or a pipe) in chunks. Doesn't close f.
+int sm_initFILE(BufStream *sm, FILE *f, size_t bufsize);
+
+// Writes to a file through a buffer of bufsize bytes. Close() flushes and closes the file.
+int sink_openFile(BufSink *sk, const char *fn, size_t bufsize);
@@ -1,5 +1,10 @@
 #include "lex.h"
 #include "util.h"
+#include "strings.h"
+#include "serialio.h"
+#include "gc.h"
+#include "hashfunc.h"
+#include <string.h>
 
 struct ShortEntry
 {
@@ -7,8 +12,8 @@ struct ShortEntry
     Lexer::TokenType tt;
 };
 
-// Order matters! Must make sure that single-char identifiers are not accepted
-// before a multi-char token that starts with the same char
+// Only used to get the text of a token; the lexer itself uses punct() below,
+// which has to be kept in sync with this table.
 static const ShortEntry ShortTab[] =
 {
     { "(",  Lexer::TOK_LPAREN, },
@@ -23,6 +28,7 @@ static const ShortEntry ShortTab[] =
     { "+",  Lexer::TOK_PLUS,   },
     { "-",  Lexer::TOK_MINUS,  },
     { "*",  Lexer::TOK_STAR,   },
+    { "%",  Lexer::TOK_PERC,   },
     { "//", Lexer::TOK_SLASH2X },
     { "/",  Lexer::TOK_SLASH,  },
     { ">>", Lexer::TOK_SHR,    },
@@ -83,10 +89,315 @@ static const Keyword Keywords[] =
     { "defer",     Lexer::TOK_DEFER    },
 };
 
+// Keywords are found with a perfect hash over (first char, last char, length),
+// so classifying an identifier takes a single probe.
+// KeywordSlots[] is index + 1 into Keywords[], 0 if there's no keyword in that slot.
+// When changing Keywords[], pick multipliers that don't collide and regenerate the slots;
+// the Lexer ctor checks this in debug builds.
+enum
+{
+    KW_MINLEN = 2,
+    KW_MAXLEN = 8,
+    KW_SLOTS = 32
+};
+
+static FORCEINLINE unsigned kwslot(const char *s, size_t len)
+{
+    return ((unsigned char)s[0] * 21u + (unsigned char)s[len - 1] * 27u + unsigned(len)) & (KW_SLOTS - 1);
+}
+
+static const unsigned char KeywordSlots[KW_SLOTS] =
+{
+    8, 2, 0, 13, 12, 0, 0, 6, 0, 16, 0, 15, 0, 1, 11, 7,
+    0, 0, 0, 4, 3, 0, 0, 5, 9, 0, 10, 0, 0, 0, 14, 17
+};
+
+// returns TOK_IDENT if it's not a keyword
+static FORCEINLINE Lexer::TokenType kwlookup(const char *s, size_t len)
+{
+    if(len >= KW_MINLEN && len <= KW_MAXLEN)
+        if(unsigned i = KeywordSlots[kwslot(s, len)])
+        {
+            const Keyword& kw = Keywords[i - 1];
+            if(!strncmp(kw.kw, s, len) && !kw.kw[len]) // kw may be shorter than len
+                return kw.tt;
+        }
+    return Lexer::TOK_IDENT;
+}
+
+#ifndef NDEBUG
+static bool checkKeywordSlots()
+{
+    for(size_t i = 0; i < Countof(Keywords); ++i)
+    {
+        const char *kw = Keywords[i].kw;
+        const size_t len = strlen(kw);
+        if(len < KW_MINLEN || len > KW_MAXLEN || kwlookup(kw, len) != Keywords[i].tt)
+            return false;
+    }
+    return true;
+}
+#endif
+
 
 Lexer::Lexer(const char* text)
-    : _p(text),  _linebegin(text), _line(1)
+    : _p(text),  _linebegin(text), _line(1), _sp(NULL)
+    , _sm(NULL), _gc(NULL), _buf(NULL), _cap(0), _end(NULL), _dataend(NULL), _held(0), _err(NULL)
+    , _chunk(0), _ntok(0), _chunktok(0), _nold(0)
+{
+    assert(checkKeywordSlots());
+}
+
+// Starts with an empty window; the first call to next() pulls in the first one
+Lexer::Lexer(BufStream* sm, GC& gc)
+    : _p(""), _linebegin(_p), _line(1), _sp(NULL)
+    , _sm(sm), _gc(&gc), _buf(NULL), _cap(0), _end(_p), _dataend(_p), _held(0), _err(NULL)
+    , _chunk(0), _ntok(0), _chunktok(0), _nold(0)
 {
+    assert(checkKeywordSlots());
+}
+
+Lexer::~Lexer()
+{
+    for(unsigned i = 0; i < _nold; ++i)
+        gc_alloc_unmanaged(*_gc, _old[i].mem, _old[i].cap, 0);
+    if(_buf)
+        gc_alloc_unmanaged(*_gc, _buf, _cap, 0);
+}
+
+// SSE2 is part of the x86-64 baseline, so there's no point in detecting it at runtime.
+// The scanners only ever do aligned 16-byte loads: those never cross a page boundary,
+// so reading a bit past the 0 terminator is harmless. ASAN doesn't know that, so don't use them there.
+#if defined(__has_feature)
+#  if __has_feature(address_sanitizer)
+#    define GA_LEX_NO_SSE2
+#  endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#  define GA_LEX_NO_SSE2
+#endif
+#if !defined(GA_LEX_NO_SSE2) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+#  define GA_LEX_SSE2
+#  include <emmintrin.h>
+#endif
+
+enum CharClass
+{
+    CC_WS     = 0x01, // space, tab
+    CC_NL     = 0x02, // \n, \r
+    CC_LOWER  = 0x04, // a-z (may start a keyword)
+    CC_UPPER  = 0x08, // A-Z, _
+    CC_DIGIT  = 0x10, // 0-9
+    CC_IDENT  = 0x20, // a-z, A-Z, 0-9, _
+    CC_ALNUM  = 0x40, // a-z, A-Z, 0-9
+};
+
+#define _W CC_WS
+#define _N CC_NL
+#define _L (CC_LOWER | CC_IDENT | CC_ALNUM)
+#define _U (CC_UPPER | CC_IDENT | CC_ALNUM)
+#define _D (CC_DIGIT | CC_IDENT | CC_ALNUM)
+#define _S (CC_UPPER | CC_IDENT)
+
+// The 0 terminator and everything >= 0x80 is in no class,
+// so the scalar loops stop at the end of the input without an extra check.
+static const unsigned char CharClassTab[256] =
+{
+    0, 0, 0, 0, 0, 0, 0, 0, 0,_W,_N, 0, 0,_N, 0, 0,
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   _W, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   _D,_D,_D,_D,_D,_D,_D,_D,_D,_D, 0, 0, 0, 0, 0, 0,
+    0,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U,
+   _U,_U,_U,_U,_U,_U,_U,_U,_U,_U,_U, 0, 0, 0, 0,_S,
+    0,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L,
+   _L,_L,_L,_L,_L,_L,_L,_L,_L,_L,_L, 0, 0, 0, 0, 0,
+};
+
+#undef _W
+#undef _N
+#undef _L
+#undef _U
+#undef _D
+#undef _S
+
+static FORCEINLINE unsigned charclass(char c)
+{
+    return CharClassTab[(unsigned char)c];
+}
+
+#ifdef GA_LEX_SSE2
+
+// Index of the lowest set bit. x must not be 0.
+static FORCEINLINE unsigned lowbit(unsigned x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return __builtin_ctz(x);
+#else
+    unsigned r = 0;
+    while(!(x & 1))
+    {
+        x >>= 1u;
+        ++r;
+    }
+    return r;
+#endif
+}
+
+// Returns ptr to the first char where M::stop() has its bit set.
+// M::stop() must always flag the 0 terminator, otherwise this runs off the end.
+template<typename M>
+static FORCEINLINE const char *simdscan(const char *p, const M& m)
+{
+    const size_t mis = (size_t)p & 15;
+    const __m128i *a = (const __m128i*)(p - mis);
+    unsigned bits = m.stop(_mm_load_si128(a)) >> mis; // ignore bytes before p
+    if(bits)
+        return p + lowbit(bits);
+    for(;;)
+    {
+        bits = m.stop(_mm_load_si128(++a));
+        if(bits)
+            return (const char*)a + lowbit(bits);
+    }
+}
+
+// Chars that are not part of an identifier
+struct StopNotIdent
+{
+    FORCEINLINE unsigned stop(__m128i v) const
+    {
+        // Chars >= 0x80 are negative as signed bytes and fail all range checks, as they should.
+        // '@' | 0x20 == '`', '[' | 0x20 == '{', etc. so folding the case doesn't produce false positives.
+        const __m128i lc = _mm_or_si128(v, _mm_set1_epi8(0x20));
+        const __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(lc, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(lc, _mm_set1_epi8('z' + 1)));
+        const __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+        const __m128i us = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+        return ~_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), us)) & 0xffff;
+    }
+};
+
+// Chars that are not space or tab
+struct StopNotBlank
+{
+    FORCEINLINE unsigned stop(__m128i v) const
+    {
+        const __m128i ws = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+        return ~_mm_movemask_epi8(ws) & 0xffff;
+    }
+};
+
+// \n, \r, \0
+struct StopEOL
+{
+    FORCEINLINE unsigned stop(__m128i v) const
+    {
+        const __m128i nl = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+        return _mm_movemask_epi8(_mm_or_si128(nl, _mm_cmpeq_epi8(v, _mm_setzero_si128())));
+    }
+};
+
+// The string terminator, \\, \n, \0
+struct StopStr
+{
+    const __m128i term;
+    StopStr(char c) : term(_mm_set1_epi8(c)) {}
+    FORCEINLINE unsigned stop(__m128i v) const
+    {
+        const __m128i a = _mm_or_si128(_mm_cmpeq_epi8(v, term), _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')));
+        const __m128i b = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        return _mm_movemask_epi8(_mm_or_si128(a, b));
+    }
+};
+
+#endif // GA_LEX_SSE2
+
+// returns ptr to first char not part of ident
+static FORCEINLINE const char *eatident(const char *s)
+{
+    // Most identifiers are short; check the first few chars before firing up the vector unit
+    if(!(charclass(s[0]) & CC_IDENT))
+        return s;
+    if(!(charclass(s[1]) & CC_IDENT))
+        return s + 1;
+#ifdef GA_LEX_SSE2
+    return simdscan(s + 2, StopNotIdent());
+#else
+    s += 2;
+    while(charclass(*s) & CC_IDENT)
+        ++s;
+    return s;
+#endif
+}
+
+// Number of identifier chars at the start of the 16 bytes at s, 16 if all of them are
+static FORCEINLINE unsigned identprefix16(const char *s)
+{
+#ifdef GA_LEX_SSE2
+    // An unaligned load is fine unless it touches the next page, which may not exist
+    if(((uintptr_t)s & 4095) <= 4096 - 16)
+    {
+        const unsigned bits = StopNotIdent().stop(_mm_loadu_si128((const __m128i*)s));
+        return bits ? lowbit(bits) : 16;
+    }
+#endif
+    unsigned n = 0;
+    while(n < 16 && (charclass(s[n]) & CC_IDENT))
+        ++n;
+    return n;
+}
+
+// eatident() that feeds each full 16 chars to the hash as soon as they're scanned.
+// *tail is set to the start of the remaining < 16 chars, for memhash_end().
+static FORCEINLINE const char *eatidenthash(const char *s, MemHashState& st, const char **tail)
+{
+    for(;;)
+    {
+        const unsigned n = identprefix16(s);
+        if(n < 16)
+        {
+            *tail = s;
+            return s + n;
+        }
+        memhash_block(st, s);
+        s += 16;
+    }
+}
+
+// skip spaces and tabs
+static FORCEINLINE const char *eatblank(const char *s)
+{
+    // Usually there's just a single space between tokens
+    if(!(charclass(*s) & CC_WS))
+        return s;
+#ifdef GA_LEX_SSE2
+    return simdscan(s + 1, StopNotBlank());
+#else
+    do
+        ++s;
+    while(charclass(*s) & CC_WS);
+    return s;
+#endif
+}
+
+// returns ptr to the \n or \r that ends the line, or to the terminator
+static FORCEINLINE const char *findeol(const char *s)
+{
+#ifdef GA_LEX_SSE2
+    return simdscan(s, StopEOL());
+#else
+    return s + strcspn(s, "\r\n");
+#endif
+}
+
+// returns ptr to the next term, \\, \n or the terminator
+static FORCEINLINE const char *findstrstop(const char *s, char term)
+{
+#ifdef GA_LEX_SSE2
+    return simdscan(s, StopStr(term));
+#else
+    const char stops[] = { term, '\\', '\n', 0 };
+    return s + strcspn(s, stops);
+#endif
 }
 
 struct WsNoms
@@ -100,41 +411,27 @@ static WsNoms eatws(const char *p)
 {
     size_t nl = 0;
     const char *pnl = NULL;
-    bool skiptoend = false;
-    while(char c = *p)
-        if(skiptoend || c == ' ' || c == '\t' || c == '\n' || c == '\r')
+    for(;;)
+    {
+        p = eatblank(p);
+        const char c = *p;
+        if(charclass(c) & CC_NL) // account for newlines for diagnostics
         {
-            ++p; // it's whitespace, skip it
-            if(c == '\n' || c == '\r') // account for newlines for diagnostics
-            {
-                skiptoend = false;
-                ++nl;
-                if(*p != c && (*p == '\n' || *p == '\r'))
-                    ++p; // skip one extra char in case of windows line endings
-                pnl = p;
-            }
-
+            ++p;
+            ++nl;
+            if(*p != c && (charclass(*p) & CC_NL))
+                ++p; // skip one extra char in case of windows line endings
+            pnl = p;
         }
         else if(c == '-' && p[1] == '-') // for simplicity, consider comments whitespace
-        {
-            skiptoend = true;
-            p += 2;
-        }
+            p = findeol(p + 2);
         else
             break;
+    }
     WsNoms ret = {p, pnl, nl};
     return ret;
 }
 
-// returns ptr to first char not part of ident
-static const char *eatident(const char *s)
-{
-    char c;
-    while((c = *s) && ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || (c >= '0' && c <= '9')))
-        ++s;
-    return s;
-}
-
 /*
 static unsigned char hexnorm(unsigned char x)
 {
@@ -154,20 +451,28 @@ static unsigned char hexnorm(unsigned char x)
 static WsNoms eatstr(const char *p, char term)
 {
     WsNoms ret = {NULL, NULL, 0};
-    for(char c; (c = *p++); )
+    for(;;)
     {
+        p = findstrstop(p, term);
+        const char c = *p++;
         if(c == term)
         {
             ret.p = p;
             break;
         }
         if(c == '\\')
-            ++p;
+        {
+            // skip the escaped char, but not the terminator, and let the next round count an escaped newline
+            if(*p && *p != '\n')
+                ++p;
+        }
         else if(c == '\n')
         {
             ++ret.nl;
-            ret.pnl = p + 1;
+            ret.pnl = p;
         }
+        else // hit the terminator
+            break;
     }
     return ret;
 }
@@ -177,69 +482,219 @@ static WsNoms eatstr(const char *p, char term)
 static const char *eatnum(const char *p)
 {
     bool dot = false;
-    for(char c; (c = *p); )
+    for(char c; (c = *p); ++p)
     {
-        if( (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z'))
-        {} // nothing to do
-        else if(c == '.')
-        {
-            if(p[1] == '.') // special case: don't treat '0..' as '0.'+'.'
-                break;
-            if(dot)
-                break;
-            dot = true;
-        }
-        else
+        if(charclass(c) & CC_ALNUM)
+            continue;
+        if(c != '.' || dot || p[1] == '.') // special case: don't treat '0..' as '0.'+'.'
             break;
-        ++p;
+        dot = true;
     }
     return p;
 }
 
-static const unsigned match(const char *haystack, const char *needle)
+// Longest match of an operator or punctuation token, dispatched on the first char.
+// Returns the length of the token, 0 if there is none. Must be kept in sync with ShortTab.
+static unsigned punct(const char *p, Lexer::TokenType& tt)
 {
-    unsigned i = 0;
-    for(;;)
+#define ONE(t) { tt = Lexer::t; return 1; }
+#define TWO(c2, t) if(p[1] == c2) { tt = Lexer::t; return 2; }
+    switch(*p)
     {
-        const unsigned char n = needle[i];
-        if(!n)
+        case '(': ONE(TOK_LPAREN)
+        case ')': ONE(TOK_RPAREN)
+        case '[': ONE(TOK_LSQ)
+        case ']': ONE(TOK_RSQ)
+        case '{': ONE(TOK_LCUR)
+        case '}': ONE(TOK_RCUR)
+        case '*': ONE(TOK_STAR)
+        case '%': ONE(TOK_PERC)
+        case ',': ONE(TOK_COMMA)
+        case ';': ONE(TOK_SEMICOLON)
+        case '^': ONE(TOK_HAT)
+        case '~': ONE(TOK_TILDE)
+        case '#': ONE(TOK_HASH)
+        case '$': ONE(TOK_DOLLAR)
+        case '+': TWO('+', TOK_CONCAT)   ONE(TOK_PLUS)
+        case '-': TWO('>', TOK_RARROW)   ONE(TOK_MINUS)
+        case '/': TWO('/', TOK_SLASH2X)  ONE(TOK_SLASH)
+        case '!': TWO('=', TOK_NEQ)      ONE(TOK_EXCL)
+        case '?': TWO('?', TOK_QQM)      ONE(TOK_QM)
+        case '&': TWO('&', TOK_LOGAND)   ONE(TOK_BITAND)
+        case '|': TWO('|', TOK_LOGOR)    ONE(TOK_BITOR)
+        case '>': TWO('>', TOK_SHR)      TWO('=', TOK_GTE)      ONE(TOK_GT)
+        case '=': TWO('=', TOK_EQ)       TWO('>', TOK_FATARROW) ONE(TOK_CASSIGN)
+        case ':': TWO('=', TOK_MASSIGN)  TWO(':', TOK_DBLCOLON) ONE(TOK_COLON)
+        case '<': TWO('-', TOK_LARROW)   TWO('<', TOK_SHL)      TWO('=', TOK_LTE) ONE(TOK_LT)
+        case '.':
+            if(p[1] == '.')
+            {
+                if(p[2] == '.')
+                {
+                    tt = Lexer::TOK_TRIDOT;
+                    return 3;
+                }
+                tt = Lexer::TOK_DOTDOT;
+                return 2;
+            }
+            ONE(TOK_DOT)
+    }
+#undef ONE
+#undef TWO
+    return 0;
+}
+
+// Window boundary: Right behind a run of newline chars, so that a CRLF pair is never split.
+// Returns the last boundary in buf[0..n) that is > minpos, 0 if there is none.
+static size_t findsplit(const char *buf, size_t minpos, size_t n)
+{
+    for(size_t i = n - 1; i > minpos && i; --i)
+        if((charclass(buf[i - 1]) & CC_NL) && !(charclass(buf[i]) & CC_NL))
             return i;
-        const unsigned char h = haystack[i];
-        if(h != n)
+    return 0;
+}
+
+// Makes a new window that starts with [keep, _end) of the current one and extends further.
+// Pointers into the current window stay valid until the window is freed in _retire().
+// Returns false if there is no more input or on error.
+bool Lexer::_slide(const char *keep)
+{
+    assert(_sm && keep <= _end);
+    const size_t carry = _dataend - keep;
+    const size_t seen = _end - keep; // The new window must extend beyond this
+    size_t cap = WINDOW_SIZE;
+    while(cap <= 2 * carry)
+        cap *= 2;
+    char *nb = (char*)gc_alloc_unmanaged(*_gc, NULL, 0, cap);
+    if(!nb)
+    {
+        _err = "Out of memory";
+        return false;
+    }
+    memcpy(nb, keep, carry);
+    if(_end < _dataend)
+        nb[seen] = _held; // The copy has the 0 terminator in place of the held char
+
+    size_t have = carry, split, checked = seen;
+    bool eof = false;
+    for(;;)
+    {
+        if(have)
+        {
+            if((split = findsplit(nb, checked, have)))
+                break;
+            if(have - 1 > checked)
+                checked = have - 1; // Don't scan long lines over and over
+        }
+        if(eof)
+        {
+            split = have;
             break;
-        ++i;
+        }
+        if(have + 1 >= cap) // Need to fit a longer line. Always keep space for the terminator.
+        {
+            char *p = (char*)gc_alloc_unmanaged(*_gc, nb, cap, cap * 2);
+            if(!p)
+            {
+                gc_alloc_unmanaged(*_gc, nb, cap, 0);
+                _err = "Out of memory";
+                return false;
+            }
+            nb = p;
+            cap *= 2;
+        }
+        if(_sm->cursor == _sm->end && sm_refill(_sm))
+        {
+            if(_sm->err != SM_EOF)
+                _err = "Error reading input";
+            eof = true;
+            continue;
+        }
+        const size_t avail = _sm->end - _sm->cursor;
+        const size_t n = avail < cap - 1 - have ? avail : cap - 1 - have;
+        memcpy(nb + have, _sm->cursor, n);
+        _sm->cursor += n;
+        have += n;
     }
-    return 0;
+
+    if(split <= seen)
+    {
+        gc_alloc_unmanaged(*_gc, nb, cap, 0);
+        _sm = NULL;
+        return false;
+    }
+
+    _retire();
+    _p = nb + (_p - keep);
+    _linebegin = _linebegin >= keep ? nb + (_linebegin - keep) : nb;
+    _buf = nb;
+    _cap = cap;
+    _end = nb + split;
+    _dataend = nb + have;
+    _held = nb[split];
+    nb[split] = 0;
+    ++_chunk;
+    _chunktok = _ntok;
+    if(eof)
+        _sm = NULL;
+    return true;
+}
+
+// Frees old windows that can't have live tokens anymore and retires the current one
+void Lexer::_retire()
+{
+    while(_nold && _ntok - _old[0].lasttok >= KEEP_TOKENS)
+    {
+        gc_alloc_unmanaged(*_gc, _old[0].mem, _old[0].cap, 0);
+        --_nold;
+        for(unsigned i = 0; i < _nold; ++i)
+            _old[i] = _old[i + 1];
+    }
+    if(!_buf)
+        return;
+    if(_ntok == _chunktok) // No tokens from this window, nothing can point into it
+        gc_alloc_unmanaged(*_gc, _buf, _cap, 0);
+    else
+    {
+        assert(_nold < KEEP_TOKENS);
+        Window& w = _old[_nold++];
+        w.mem = _buf;
+        w.cap = _cap;
+        w.chunk = _chunk;
+        w.lasttok = _ntok;
+    }
+    _buf = NULL;
 }
 
 Lexer::Token Lexer::next()
 {
     const char *p = skipws();
     const char c = *p;
-    if(c >= 'a' && c <= 'z') // keyword or ident
-    {
-        // keyword (all keywords are lowercase)
-        for(size_t i = 0; i < Countof(Keywords); ++i)
-            if(unsigned len = match(p, Keywords[i].kw))
-                return tok(Keywords[i].tt, p, p+len);
-isident:
+    const unsigned cc = charclass(c);
+    if(cc & (CC_LOWER | CC_UPPER)) // keyword or ident
         return ident(p);
-
-    }
-    else if((c >= 'A' && c <= 'Z') || c == '_') // ident
-        goto isident;
     else if(c == '@' && (p[1] == '\"' || p[1] == '\''))
         return atident(p+1);
-    else if((c >= '0' && c <= '9') || (c == '.' && (p[1] >= '0' && p[1] <= '9'))) // numeric
+    else if((cc & CC_DIGIT) || (c == '.' && (charclass(p[1]) & CC_DIGIT))) // numeric
         return litnum(p);
     else if(c == '\"' || c == '\'') // "string literal"
         return litstr(p+1, c);
     else if(!c)
+    {
+        if(_sm && p == _end && _slide(p)) // End of the window, not of the input
+            return next();
+        if(UNLIKELY(_err))
+        {
+            Token t = errtok(_err);
+            _err = NULL;
+            return t;
+        }
         return tok(TOK_E_EOF, p, p);
-    else
-        for(size_t i = 0; i < Countof(ShortTab); ++i)
-            if(unsigned len = match(p, &ShortTab[i].s[0]))
-                return tok(ShortTab[i].tt, p, p+len);
+    }
+
+    TokenType tt;
+    if(unsigned len = punct(p, tt))
+        return tok(tt, p, p+len);
 
     return errtok("Unrecognized token");
 }
@@ -282,6 +737,9 @@ Lexer::Token Lexer::tok(TokenType tt, const char *where, const char *end)
     t.linebegin = _linebegin;
     t.line = _line;
     t.u.len = len;
+    t.h = 0;
+    t.chunk = _chunk;
+    ++_ntok;
     return t;
 }
 
@@ -293,6 +751,9 @@ Lexer::Token Lexer::errtok(const char *msg)
     t.linebegin = _linebegin;
     t.line = _line;
     t.u.err = msg;
+    t.h = 0;
+    t.chunk = _chunk;
+    ++_ntok;
     return t;
 }
 
@@ -307,9 +768,28 @@ const char* Lexer::skipws()
 
 Lexer::Token Lexer::ident(const char* where)
 {
-    const char *end = eatident(where);
-    TokenType tt = *where == '_' && where + 1 == end ? TOK_SINK : TOK_IDENT;
-    return tok(tt, where, end);
+    // When the parser interns identifiers, hash them in the same pass that scans them.
+    // Keywords are (short and) never interned, so the final hash step is only done for real identifiers.
+    MemHashState hs;
+    const char *tail = where;
+    const char *end;
+    if(_sp)
+    {
+        _sp->hashbegin(hs);
+        end = eatidenthash(where, hs, &tail);
+    }
+    else
+        end = eatident(where);
+    const size_t len = end - where;
+    TokenType tt = TOK_IDENT;
+    if(charclass(*where) & CC_LOWER) // all keywords are lowercase
+        tt = kwlookup(where, len);
+    else if(*where == '_' && len == 1)
+        tt = TOK_SINK;
+    Token t = tok(tt, where, end);
+    if(tt == TOK_IDENT && _sp)
+        t.h = _sp->hashend(hs, tail, end - tail, len);
+    return t;
 }
 
 // @"name with spaces"
@@ -317,16 +797,30 @@ Lexer::Token Lexer::ident(const char* where)
 Lexer::Token Lexer::atident(const char* where)
 {
     Lexer::Token t = litstr(where + 1, *where);
-    t.tt = TOK_IDENT;
+    if(t.tt == TOK_LITSTR)
+    {
+        t.tt = TOK_IDENT;
+        if(_sp)
+            t.h = _sp->hash(t.begin, t.u.len);
+    }
     return t;
 }
 
 // where points to first actual character of literal (after the opening ")
 Lexer::Token Lexer::litstr(const char* where, unsigned char term)
 {
-    WsNoms s = eatstr(where, term);
-    if(!s.p)
-        return errtok("Unterminated literal string");
+    WsNoms s;
+    for(;;)
+    {
+        s = eatstr(where, term);
+        if(s.p)
+            break;
+        // In stream mode, the string may go on in the next window. Keep the whole line for error reporting.
+        const size_t offs = where - _linebegin;
+        if(!(_sm && strlen(where) == size_t(_end - where) && _slide(_linebegin)))
+            return errtok("Unterminated literal string");
+        where = _linebegin + offs;
+    }
 
     _line += s.nl;
     if(s.pnl)
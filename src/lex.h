@@ -2,6 +2,9 @@
 
 #include "defs.h"
 
+class StringPool;
+struct BufStream;
+struct GC;
 
 class Lexer
 {
@@ -95,16 +98,38 @@ public:
             unsigned len;
             const char *err;
         } u;
+        uhash h; // TOK_IDENT only: hash of the name in the attached StringPool, 0 if there is none
+        unsigned chunk; // Stream mode: the window the text is in. See isLive()
         unsigned column() const { return begin - linebegin; }
         bool operator==(const Token& o) const { return tt == o.tt && begin == o.begin && line == o.line; }
         inline bool operator!=(const Token& o) const { return !(*this == o); }
     };
 
+    enum
+    {
+        KEEP_TOKENS = 3, // The parser holds on to prevtok, curtok, lookahead
+        WINDOW_SIZE = 64 * 1024
+    };
+
     Lexer(const char *text);
+
+    // Pulls input from sm, for input that doesn't fit into memory. The lexer doesn't close the stream.
+    // The input is processed in windows that end at a line boundary, so only multi-line strings
+    // ever need to be carried over into the next window. A window must fit at least one whole line.
+    // The text of the last KEEP_TOKENS tokens returned by next() always stays valid;
+    // older tokens may point to freed memory, use isLive() before touching their text.
+    Lexer(BufStream *sm, GC& gc);
+    ~Lexer();
+
     Token next();
-    bool done() const { return !*_p; }
+    bool done() const { return !*_p && !_sm; }
+    bool isLive(const Token& t) const { return t.chunk >= (_nold ? _old[0].chunk : _chunk); }
     const char *getLineBegin() const { return _linebegin; }
 
+    // Identifiers are hashed right after scanning, so that interning them via StringPool::put(s, n, h)
+    // doesn't have to hash again. The lexer doesn't put anything into the pool itself.
+    void setStringPool(const StringPool *sp) { _sp = sp; }
+
     static const char *GetTokenText(TokenType tt);
     static bool IsKeyword(TokenType tt);
 
@@ -123,6 +148,31 @@ private:
     const char *_p;
     const char *_linebegin;
     unsigned _line;
+    const StringPool *_sp;
+
+    // Stream mode only
+    struct Window
+    {
+        char *mem;
+        size_t cap;
+        unsigned chunk;
+        size_t lasttok; // _ntok when the window was retired
+    };
+    bool _slide(const char *keep);
+    void _retire();
+    BufStream *_sm; // NULL when all input has been read
+    GC *_gc;
+    char *_buf; // Current window, starts at _buf, 0 at _end
+    size_t _cap;
+    const char *_end;
+    const char *_dataend; // Input after _end that's already read but doesn't make a full line yet
+    char _held; // Char at _end that was replaced by the 0 terminator
+    const char *_err; // Reported once all input is processed
+    unsigned _chunk;
+    size_t _ntok;
+    size_t _chunktok; // _ntok when the current window started
+    Window _old[KEEP_TOKENS]; // Retired windows that may still have live tokens, oldest first
+    unsigned _nold;
 };
 
 
@@ -13,24 +13,49 @@
 #include "runtime.h"
 #include "mlir.h"
 #include "io_libc.h"
+#include "compiledriver.h"
+#include "rtops.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <sstream>
+#include <time.h>
 
 
-static char s_content[64*1024];
-
-const char *slurp(const char *fn)
+// Reads a whole file of any size and appends a terminating 0, since that's what the lexer wants. free() the result.
+char *slurp(const char *fn)
 {
-    FILE *f = fopen(fn, "rb");
-    if(!f)
+    BufStream sm;
+    if(sm_openFile(&sm, fn))
+        return NULL;
+
+    char *buf = NULL;
+    size_t len = 0;
+    for(;;)
+    {
+        const size_t n = sm.end - sm.cursor;
+        if(char *p = (char*)realloc(buf, len + n + 1))
+            buf = p;
+        else
+            break;
+        memcpy(buf + len, sm.cursor, n);
+        len += n;
+        buf[len] = 0;
+        sm.cursor = sm.end;
+        if(sm_refill(&sm))
+            break;
+    }
+
+    const bool ok = buf && sm.err == SM_EOF;
+    sm.Close(&sm);
+    if(!ok)
+    {
+        free(buf);
         return NULL;
-    size_t done = fread(s_content, 1, sizeof(s_content), f);
-    fclose(f);
-    s_content[done] = 0;
-    return &s_content[0];
+    }
+    return buf;
 }
 
 static void *myalloc(void *ud, void *ptr, size_t osz, size_t nsz)
@@ -186,6 +211,77 @@ void heaptest()
     h.dealloc(rt.gc);
 }
 
+// Bulk vu128 decoding vs. one at a time. Mostly small numbers, like in serialized code.
+void benchvu128()
+{
+    const size_t N = 4 * 1024 * 1024;
+    unsigned char *enc = (unsigned char*)malloc(N * 5);
+    unsigned *a = (unsigned*)malloc(N * sizeof(unsigned));
+    unsigned *b = (unsigned*)malloc(N * sizeof(unsigned));
+    memset(a, 0, N * sizeof(unsigned)); // Get page faults out of the way
+    memset(b, 0, N * sizeof(unsigned));
+
+    size_t sz = 0;
+    for(size_t i = 0; i < N; ++i)
+    {
+        const unsigned r = rand();
+        const unsigned x = (r & 15) ? r % 100 : (r & 16) ? r % 10000 : r * 7919u;
+        sz += vu128enc(enc + sz, x);
+    }
+
+    clock_t t0 = clock();
+    const unsigned char *p = enc;
+    for(size_t i = 0; i < N; ++i)
+    {
+        const vudec d = vu128dec(p);
+        a[i] = d.val;
+        p += d.adv;
+    }
+    clock_t t1 = clock();
+    size_t used;
+    const size_t done = vu128decn(b, N, enc, sz, &used);
+    clock_t t2 = clock();
+
+    const bool same = done == N && used == sz && !memcmp(a, b, N * sizeof(unsigned));
+    printf("vu128: %u numbers, %u bytes. Scalar: %.2f ms, bulk: %.2f ms, %s\n",
+        (unsigned)N, (unsigned)sz, (t1 - t0) * 1000.0 / CLOCKS_PER_SEC, (t2 - t1) * 1000.0 / CLOCKS_PER_SEC,
+        same ? "same results" : "MISMATCH");
+
+    free(enc);
+    free(a);
+    free(b);
+}
+
+// Lexer throughput, tokens only
+void benchlex(const char *code)
+{
+    const size_t len = strlen(code);
+    const unsigned N = 20;
+    size_t ntok = 0;
+    clock_t t0 = clock();
+    for(unsigned i = 0; i < N; ++i)
+    {
+        Lexer lex(code);
+        for(Lexer::TokenType tt; (tt = lex.next().tt) != Lexer::TOK_E_EOF && tt != Lexer::TOK_E_ERROR; )
+            ++ntok;
+    }
+    const double secs = double(clock() - t0) / CLOCKS_PER_SEC;
+    printf("lex: %u bytes, %u tokens, %.1f MB/s\n", (unsigned)len, (unsigned)(ntok / N), len * N / (secs * 1e6));
+}
+
+// Compile all files given on the command line in parallel
+int compileall(Runtime& rt, char **files, int n)
+{
+    CompileDriver cd(rt);
+    for(int i = 0; i < n; ++i)
+        cd.add(files[i]);
+    const size_t fail = cd.run(0);
+    for(size_t i = 0; i < cd.size(); ++i)
+        if(const MLIR *ml = cd.module(i))
+            printf("%s: %u ML nodes\n", cd.filename(i), (u32)ml->nodes.size());
+    return fail ? 1 : 0;
+}
+
 int main(int argc, char **argv)
 {
     Runtime rt;
@@ -200,14 +296,18 @@ int main(int argc, char **argv)
     //testref();
     //testtable();
     //testtype();
+    //benchvu128();
     //return 0;
 
+    //return compileall(rt, argv + 1, argc - 1);
+
     const char *fn = "test.txt";
 
-    const char *code = slurp(fn);
+    char *code = slurp(fn);
     if(!code)
         return 1;
 
+    //benchlex(code);
 
     Lexer lex(code);
     Parser pp(&lex, fn, rt.gc, rt.sp);
@@ -224,19 +324,35 @@ int main(int argc, char **argv)
     VM vm;
     vm.rt = &rt;
     rtinit(*env, rt.gc, rt.sp, rt.tr);
+    reg_uint_ops(*env, rt);
+    reg_sint_ops(*env, rt);
+    reg_float_ops(*env, rt);
+    reg_bool_ops(*env, rt);
 
     MLIR ml(rt.gc);
 
-    ml.construct(node, true);
+    ml.construct(node, rt.sp, MLIR::STRIP_DEBUGINFO);
     //ml.importSymbols(pp.syms, rt.sp);
 
     printf("ML nodes: %u, mem: %u\n", (u32)ml.nodes.size(), (u32)(ml.nodes.size() * sizeof(MLNode)));
 
+    MLInlineTracker mit = { pp.syms, *env, 16, 0 };
+    ml.inlineCalls(mit);
+    printf("ML inline: %u calls inlined\n", mit.ninlined);
+
+    MLFoldTracker mft = { vm, *env, 0, 0, 0 };
+    ml.fold(mft);
+    printf("ML fold: %u ops folded, %u vars propagated, %u branches removed\n", mft.nfolded, mft.npropagated, mft.nbranches);
+
+    MLDceTracker mdt = { pp.syms, *env, rt, 0, 0 };
+    ml.eliminateDeadCode(mdt);
+    printf("ML dce: %u statements removed, %u unreachable\n", mdt.nremoved, mdt.nunreachable);
+
     //ml.convert();
 
     BufSink hex;
     sink_initHexPrint(&hex);
-    ml.dump(&hex, rt.sp);
+    ml.dump(&hex, rt.sp, MLIR::Options(0));
     hex.Close(&hex);
 
 
@@ -259,5 +375,6 @@ int main(int argc, char **argv)
 
 #endif
 
+    free(code);
    return 0;
 }
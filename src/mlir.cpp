@@ -3,20 +3,55 @@
 #include "serialio.h"
 #include "valstore.h"
 #include "symstore.h"
+#include "strings.h"
+#include "symtable.h"
+#include "gaobj.h"
+#include "gavm.h"
+#include "runtime.h"
+#include <string.h>
+
+/* Precompiled module format. All numbers are vu128-encoded.
+   MAGIC_FILE_VARIANT('M')  -- 8 bytes. The version bytes must match exactly.
+   flags                    -- MODF_* bits
+   constants                -- ValStore::serialize(). ML_CONST refers to these.
+   names                    -- Same format. The strings that ML_NAMEDECL and variables refer to.
+   #vars, then per var:     kind, name idx, type, slot
+   #nodes, #numbers in the tree, then per node in breadth-first order:
+     zigzag(cmd) [params]   -- For lists: zigzag(-(len-1)), or 0 if empty.
+                               Lists of length 1 aren't stored, only their child.
+     All children of a node are consecutive, after everything that came before them.
+   If MODF_DEBUGINFO: per node, in the same order: line, column
+*/
+
+enum
+{
+    MODF_DEBUGINFO = 1
+};
 
+enum
+{
+    MAGIC_ID_SIZE = 5 // MAGIC_FILE_ID_BYTES + variant. The rest is the version.
+};
 
 struct MLWriter
 {
-    MLWriter(GC& gc) : gc(gc) {}
+    MLWriter(GC& gc) : gc(gc), fail(false), count(0) {}
     PodArray<byte> arr;
     GC& gc;
+    bool fail; // Ran out of memory at some point
+    size_t count; // Numbers written
 
     ~MLWriter()
     {
         arr.dealloc(gc);
     }
 
-    void write(int x)
+    FORCEINLINE void write(int x)
+    {
+        writeu(zigzagenc(x));
+    }
+
+    void writeu(unsigned x)
     {
         byte *dst;
         size_t oldsz = arr.sz;
@@ -25,26 +60,83 @@ struct MLWriter
         else
             dst = arr.data() + arr.sz;
 
-        u32 done = vu128enc(dst, zigzagenc(x));
-        printf("%08X -> %08X -> %u\n", x, zigzagenc(x), done);
+        if(!dst)
+        {
+            fail = true;
+            return;
+        }
+
+        u32 done = vu128enc(dst, x);
         arr.sz = oldsz + done;
+        ++count;
     }
 
-    void flush(BufSink *sk)
+    bool flush(BufSink *sk)
     {
-        sk->Write(sk, arr.data(), arr.size());
+        const bool ok = !fail && !sk->Write(sk, arr.data(), arr.size());
         arr.sz = 0;
+        return ok;
     }
 };
 
 struct MLDumper
 {
-    MLDumper(GC& gc) : tree(gc), dbg(gc), vals(gc) {}
+    MLDumper(GC& gc) : tree(gc), dbg(gc), head(gc), vals(gc), names(gc), count(0) {}
     ~MLDumper() { q.dealloc(tree.gc); }
     Queue<const MLNode*> q;
     MLWriter tree;
     MLWriter dbg;
+    MLWriter head; // stuff before the tree
     ValStore vals;
+    ValStore names;
+    size_t count; // nodes written
+};
+
+struct MLLoader
+{
+    MLLoader(GC& gc) : vals(gc), names(gc) {}
+    ~MLLoader() { refs.dealloc(vals.gc); }
+    ValStore vals;
+    ValStore names;
+    PodArray<sref> refs; // names index -> ref in the StringPool
+};
+
+// Decodes a known amount of numbers in bulk, a chunk at a time, without reading past them
+struct MLReader
+{
+    MLReader(BufStream *sm, size_t total) : sm(sm), left(total), pos(0), n(0) {}
+    BufStream * const sm;
+    size_t left; // not yet decoded
+    size_t pos, n; // in buf[]
+    unsigned buf[256];
+
+    FORCEINLINE bool next(unsigned& x)
+    {
+        if(UNLIKELY(pos == n) && !_fill())
+            return false;
+        x = buf[pos++];
+        return true;
+    }
+
+    FORCEINLINE bool nextint(int& x)
+    {
+        unsigned u;
+        if(!next(u))
+            return false;
+        x = zigzagdec(u);
+        return true;
+    }
+
+    NOINLINE bool _fill()
+    {
+        const size_t k = left < Countof(buf) ? left : Countof(buf);
+        if(!k || sm_readvun(sm, buf, k))
+            return false;
+        left -= k;
+        pos = 0;
+        n = k;
+        return true;
+    }
 };
 
 // statements have no associated type
@@ -74,11 +166,12 @@ static size_t mlirNumParams(MLCmd cmd)
     {
         case ML_CONST:
         case ML_VAR:
-        case ML_NAMEDECL:
         case ML_DECL:
         case ML_FUNC:
+        case ML_NEW_TABLE:
             return 1;
 
+        case ML_NAMEDECL:
         case ML_CLOSE:
             return 2;
 
@@ -148,9 +241,7 @@ static void mlirDumpNode(MLDumper& dump, const MLNode *node)
 
         case ML_LIST:
             nch = node->list.len;
-            if(nch == 1) // Skip lists that have exactly 1 child and emit that child in place of the list
-                goto dochildren;
-            // It's intentionally impossible to construct lists of length 1
+            assert(nch != 1); // Skipped by the caller
             dump.tree.write(nch ? -(int)(nch - 1) : 0);
             break;
 
@@ -166,50 +257,283 @@ static void mlirDumpNode(MLDumper& dump, const MLNode *node)
     // params follow directly after the enum type
     if(size_t nparams = mlirNumParams(cmd))
         for(size_t i = 0; i < nparams; ++i)
-            dump.tree.write(node->m.p[i]);
+        {
+            u32 p = node->m.p[i];
+            if(cmd == ML_NAMEDECL && !i) // name
+                p = dump.names.put(Val(_Str(p)));
+            dump.tree.write(p);
+        }
 
     // dump each child. via queue because that way all child nodes for any node are sequential in memory,
     // plus there's no way that while decoding deep nesting could cause a stack overflow.
     if(nch)
     {
-dochildren:
         const MLNode *c = node->firstChild();
         for(size_t i = 0; i < nch; ++i)
             dump.q.push(dump.vals.gc, &c[i]);
     }
 }
 
-void MLIR::dump(BufSink *sk, const StringPool& sp, Options options) const
+bool MLIR::dump(BufSink *sk, const StringPool& sp, Options options) const
 {
     MLDumper dump(sp.gc);
 
     const bool debuginfo = !infos.empty() && !(options & STRIP_DEBUGINFO);
+
+    const size_t nvars = vars.size();
+    dump.head.writeu(nvars);
+    for(size_t i = 0; i < nvars; ++i)
+    {
+        const MLVar& v = vars[i];
+        if(v.kind > MLVar::EXT) // Only exists during optimization
+            return false;
+        dump.head.writeu(v.kind);
+        dump.head.writeu(dump.names.put(Val(_Str(v.dbg.name))));
+        dump.head.writeu(v.u.val.type);
+        dump.head.writeu(v.u.slot);
+    }
+
     const MLNode *node = nodes.data();
     for(;;)
     {
+        // Skip lists that have exactly 1 child and emit that child in place of the list.
+        // It's intentionally impossible to construct lists of length 1, but who knows what the optimizer does.
+        while(node->m.cmd == ML_LIST && node->list.len == 1)
+            node = node->firstChild();
+
         mlirDumpNode(dump, node);
+        ++dump.count;
 
         if(debuginfo)
         {
             size_t idx = indexOf(node);
             MLInfo info = infos[idx];
-            dump.dbg.write(info.line);
-            dump.dbg.write(info.column);
+            dump.dbg.writeu(info.line);
+            dump.dbg.writeu(info.column);
         }
         if(dump.q.empty())
             break;
         node = dump.q.pop();
     }
+    dump.head.writeu(dump.count);
+    dump.head.writeu(dump.tree.count);
+
+    const byte hdr[] = MAGIC_FILE_VARIANT('M');
+    const byte flags = debuginfo ? MODF_DEBUGINFO : 0; // Single byte as long as it's < 0x80
+    return !sk->Write(sk, hdr, sizeof(hdr))
+        && !sk->Write(sk, &flags, 1)
+        && dump.vals.serialize(sk, sp)
+        && dump.names.serialize(sk, sp)
+        && dump.head.flush(sk)
+        && dump.tree.flush(sk)
+        && (!debuginfo || dump.dbg.flush(sk))
+        && !sk->err;
+}
 
-    byte hdr[] = MAGIC_FILE_VARIANT('M');
-    sk->Write(sk, hdr, sizeof(hdr));
+static FORCEINLINE bool mlirIsValidCmd(int x)
+{
+    return (x >= _ML_OP_FIRST && x < _ML_OP_MAX) || (x >= ML_CONST && x <= ML_EXPORT);
+}
 
-    dump.vals.serialize(sk, sp);
+MLIR::LoadResult MLIR::load(BufStream *sm, StringPool& sp)
+{
+    static const byte magic[] = MAGIC_FILE_VARIANT('M');
+    byte hdr[sizeof(magic)];
+    if(sm_read(sm, hdr, sizeof(hdr)) || memcmp(hdr, magic, MAGIC_ID_SIZE))
+        return LOAD_NOT_A_MODULE;
+    if(memcmp(hdr + MAGIC_ID_SIZE, magic + MAGIC_ID_SIZE, sizeof(magic) - MAGIC_ID_SIZE))
+        return LOAD_VERSION;
+
+    nodes.clear();
+    infos.clear();
+    vars.clear();
+
+    unsigned flags;
+    if(sm_readvu(sm, &flags))
+        return LOAD_ERROR;
+    if(flags & ~unsigned(MODF_DEBUGINFO))
+        return LOAD_VERSION;
+
+    MLLoader ld(gc);
+    if(!ld.vals.deserialize(sm, sp)
+        || !ld.names.deserialize(sm, sp))
+        return LOAD_ERROR;
+
+    // Names are kept as refs; 0 is never a valid name
+    const size_t nnames = ld.names.vals.size();
+    if(!ld.refs.resize(gc, nnames))
+        return LOAD_ERROR;
+    for(size_t i = 0; i < nnames; ++i)
+    {
+        const ValU& v = ld.names.vals[i];
+        ld.refs[i] = v.type == PRIMTYPE_STRING ? sp.internval(v.u) : 0;
+    }
+
+    unsigned nvars;
+    if(sm_readvu(sm, &nvars) || (nvars && !vars.resize(gc, nvars)))
+        return LOAD_ERROR;
+    for(size_t i = 0; i < nvars; ++i)
+    {
+        unsigned kind, name, type, slot;
+        if(sm_readvu(sm, &kind) || sm_readvu(sm, &name) || sm_readvu(sm, &type) || sm_readvu(sm, &slot)
+            || kind > MLVar::EXT || name >= nnames || !ld.refs[name] || type >= PRIMTYPE_ANY)
+            return LOAD_ERROR;
+        MLVar& v = vars[i];
+        v.kind = (MLVar::Kind)kind;
+        v.dbg.name = ld.refs[name];
+        v.u.val.type = (PrimType)type;
+        v.u.slot = slot;
+    }
 
-    dump.tree.flush(sk);
+    unsigned N, nnum;
+    if(sm_readvu(sm, &N) || sm_readvu(sm, &nnum) || !N || !nodes.resize(gc, N))
+        return LOAD_ERROR;
+    memset(nodes.data(), 0, sizeof(MLNode) * N);
+    MLReader rd(sm, nnum);
 
-    // TODO: make this conditional
-    dump.dbg.flush(sk);
+    // Nodes were written in breadth-first order, so the children of node i are simply
+    // the next unused ones at the time node i is read. No queue needed.
+    size_t next = 1;
+    for(size_t i = 0; i < next; ++i)
+    {
+        MLNode& m = nodes[i];
+        int x;
+        if(!rd.nextint(x))
+            return LOAD_ERROR;
+        size_t nch;
+        if(x <= 0)
+        {
+            nch = x ? size_t(-int64_t(x)) + 1 : 0;
+            m.m.cmd = ML_LIST;
+            m.list.len = u32(nch);
+        }
+        else
+        {
+            if(!mlirIsValidCmd(x))
+                return LOAD_ERROR;
+            const MLCmd cmd = (MLCmd)x;
+            if(cmd == ML_CONST)
+            {
+                int idx;
+                if(!rd.nextint(idx) || unsigned(idx) >= ld.vals.vals.size())
+                    return LOAD_ERROR;
+                m.setVal(ld.vals.vals[idx]);
+                continue;
+            }
+
+            m.m.cmd = cmd;
+            const size_t nparams = mlirNumParams(cmd);
+            for(size_t k = 0; k < nparams; ++k)
+            {
+                int pi;
+                if(!rd.nextint(pi))
+                    return LOAD_ERROR;
+                u32 p = u32(pi);
+                if(cmd == ML_NAMEDECL && !k) // name
+                {
+                    if(p >= nnames || !ld.refs[p])
+                        return LOAD_ERROR;
+                    p = ld.refs[p];
+                }
+                m.m.p[k] = p;
+            }
+            nch = mlirNumChildren(cmd);
+        }
+
+        if(nch)
+        {
+            if(nch > N - next)
+                return LOAD_ERROR;
+            m.m.chOffs = u32(next - i);
+            next += nch;
+        }
+    }
+    if(next != N || rd.left || rd.pos != rd.n) // Must have used up all numbers
+        return LOAD_ERROR;
+
+    if(flags & MODF_DEBUGINFO)
+    {
+        STATIC_ASSERT(sizeof(MLInfo) == 2 * sizeof(unsigned));
+        if(!infos.resize(gc, N) || sm_readvun(sm, (unsigned*)infos.data(), 2 * size_t(N)))
+            return LOAD_ERROR;
+    }
+
+    return LOAD_OK;
+}
+
+template<typename T>
+static bool copyarray(GC& gc, PodArray<T>& dst, const PodArray<T>& src)
+{
+    const tsize n = src.size();
+    if(!n)
+    {
+        dst.clear();
+        return true;
+    }
+    T *p = dst.resize(gc, n);
+    if(p)
+        memcpy(p, src.data(), n * sizeof(T));
+    return !!p;
+}
+
+// Strings are referenced by _ML_VAL nodes, ML_NAMEDECL, variable names and constant-folded variables.
+// Gather all refs in one go, import them at once, then put them back in the same order.
+bool MLIR::importFrom(const MLIR& src, const StringPool& srcsp, StringPool& sp)
+{
+    // Nodes don't contain pointers, so a plain copy is fine
+    if(!copyarray(gc, nodes, src.nodes) || !copyarray(gc, infos, src.infos) || !copyarray(gc, vars, src.vars))
+        return false;
+
+    PodArray<sref> refs;
+    bool ok = true;
+    for(int pass = 0; pass < 2 && ok; ++pass)
+    {
+        tsize k = 0;
+        for(tsize i = 0; i < nodes.size(); ++i)
+        {
+            MLNode& m = nodes[i];
+            if(m.m.cmd == _ML_VAL)
+            {
+                const Val v = m.asVal();
+                if(v.type == PRIMTYPE_STRING && !IsInlineStr(v.u))
+                {
+                    if(!pass)
+                        ok = ok && refs.push_back(gc, v.u.str);
+                    else
+                        m.setVal(sp.refval(refs[k++]));
+                }
+            }
+            else if(m.m.cmd == ML_NAMEDECL)
+            {
+                if(!pass)
+                    ok = ok && refs.push_back(gc, m.m.p[0]);
+                else
+                    m.m.p[0] = refs[k++];
+            }
+        }
+        for(tsize i = 0; i < vars.size(); ++i)
+        {
+            MLVar& v = vars[i];
+            if(v.dbg.name)
+            {
+                if(!pass)
+                    ok = ok && refs.push_back(gc, v.dbg.name);
+                else
+                    v.dbg.name = refs[k++];
+            }
+            if(v.kind == MLVar::CONSTVAL && v.u.val.type == PRIMTYPE_STRING && !IsInlineStr(v.u.val.u))
+            {
+                if(!pass)
+                    ok = ok && refs.push_back(gc, v.u.val.u.str);
+                else
+                    v.u.val = sp.refval(refs[k++]);
+            }
+        }
+        if(!pass && ok && refs.size())
+            ok = sp.importMany(srcsp, refs.data(), refs.data(), refs.size());
+    }
+    refs.dealloc(gc);
+    return ok;
 }
 
 MLNode* MLNode::firstChild()
@@ -234,6 +558,22 @@ MLSub MLNode::aslist()
     return ret;
 }
 
+MLConstSub MLNode::aslist() const
+{
+    MLConstSub ret;
+    if(m.cmd == ML_LIST)
+    {
+        ret.ch = firstChild();
+        ret.n = list.len;
+    }
+    else
+    {
+        ret.ch = this;
+        ret.n = 1;
+    }
+    return ret;
+}
+
 void MLNode::makedummy()
 {
     m.cmd = ML_LIST;
@@ -265,15 +605,39 @@ size_t MLNode::numchildren() const
     return m.cmd != ML_LIST ? mlirNumChildren((MLCmd)m.cmd) : list.len;
 }
 
+// Same refs as importFrom() handles
+static void mlirMarkRoot(Runtime& rt, const void *ud)
+{
+    const MLIR& ml = *static_cast<const MLIR*>(ud);
+    for(tsize i = 0; i < ml.nodes.size(); ++i)
+    {
+        const MLNode& m = ml.nodes[i];
+        if(m.m.cmd == _ML_VAL)
+            gc_markval(rt, m.asVal());
+        else if(m.m.cmd == ML_NAMEDECL)
+            rt.sp.mark(m.m.p[0]);
+    }
+    for(tsize i = 0; i < ml.vars.size(); ++i)
+    {
+        const MLVar& v = ml.vars[i];
+        rt.sp.mark(v.dbg.name);
+        if(v.kind == MLVar::CONSTVAL)
+            gc_markval(rt, v.u.val);
+    }
+}
+
 MLIR::MLIR(GC& gc)
-    : gc(gc)
+    : gc(gc), root()
 {
+    gc_addroot(gc, root, mlirMarkRoot, this);
 }
 
 MLIR::~MLIR()
 {
+    gc_removeroot(gc, root);
     nodes.dealloc(gc);
     infos.dealloc(gc);
+    vars.dealloc(gc);
 }
 
 size_t MLIR::indexOf(const MLNode* node) const
@@ -383,7 +747,7 @@ void MLIR::_opr(Queue<Cons>& q, MLNode *& dst, OperatorId op, const HLNode *hl)
 }
 
 // Don't call this recursively, call _cons() instead
-void MLIR::_construct(Queue<Cons>& q, MLNode *dst, const HLNode *hl)
+void MLIR::_construct(Queue<Cons>& q, MLNode *dst, const HLNode *hl, const StringPool& sp)
 {
     const HLNodeType hltype = (HLNodeType)hl->type;
 
@@ -430,6 +794,7 @@ dolist:
             const HLFuncDecl& decl = hl->u.funcdecl;
             HLIdent *hname = decl.ident->as<HLIdent>();
             dst->m.p[0] = hname->nameStrId;
+            dst->m.p[1] = hname->symid;
 
             MLCh s = _setupCh(dst, ML_NAMEDECL);
             assert(s.n == 2);
@@ -509,15 +874,17 @@ dolist:
             ch = &nodes[ls.chIdx]; // This now points to the list elements
 
             // Key+value goes first...
+            MLNode *kv = ch;
             for(size_t i = 0; i < nch; i += 2)
                 if(const HLNode *hk = hlch[i])
                 {
                     assert(hlch[i+1]);
                     if(hk->type == HLNODE_NAME) // Ensure that names are really just literal strings, ie. {k=v} becomes {["k"]=v}
-                        ch[i].setVal(Val(_Str(hl->u.name.nameStrId)));
+                        kv->setVal(sp.refval(hk->u.name.nameStrId)); // Short names are inline strings, like any string constant
                     else
-                        _cons(q, &ch[i], hlch[i]);
-                    _cons(q, &ch[i+1], hlch[i+1]);
+                        _cons(q, kv, hk);
+                    _cons(q, kv + 1, hlch[i+1]);
+                    kv += 2;
                 }
 
             // ... afterwards just values
@@ -548,6 +915,13 @@ dolist:
             _setupChDefault(q, dst, hl, ML_GETINDEX);
             return;
 
+        case HLNODE_CONDITIONAL: // A missing else block becomes a dummy
+            _setupChDefault(q, dst, hl, ML_IFELSE);
+            return;
+
+        case HLNODE_EXPORT: // The parser already flagged the exported symbols, what's left is the declaration
+            _cons(q, dst, hl->u.exprt.what);
+            return;
 
         case HLNODE_FUNCTIONHDR: // handled as part of HLNODE_FUNCTION
             ; // not reached
@@ -559,23 +933,31 @@ dolist:
     unreachable();
 }
 
-void MLIR::construct(const HLNode* root, Options options)
+void MLIR::construct(const HLNode* root, const StringPool& sp, Options options)
 {
     Queue<Cons> q;
 
     Cons r { root, indexOf(_add(1)) };
     for(;;)
     {
-        _construct(q, &nodes[r.mlidx], r.hl); // This may reallocate nodes[], don't keep a pointer
+        _construct(q, &nodes[r.mlidx], r.hl, sp); // This may reallocate nodes[], don't keep a pointer
 
         if(!(options & STRIP_DEBUGINFO))
         {
             if(infos.size() < nodes.size())
-                infos.alloc_n(gc, nodes.size() - infos.size());
+            {
+                // Not every node is made from its own HLNode; those have no position
+                const size_t n = nodes.size() - infos.size();
+                if(MLInfo *inf = infos.alloc_n(gc, tsize(n)))
+                    memset(inf, 0, n * sizeof(MLInfo));
+            }
 
-            MLInfo &info = infos[r.mlidx];
-            info.line = r.hl->line;
-            info.column = r.hl->column;
+            if(r.mlidx < infos.size())
+            {
+                MLInfo &info = infos[r.mlidx];
+                info.line = r.hl->line;
+                info.column = r.hl->column;
+            }
         }
 
         if(q.empty())
@@ -586,6 +968,997 @@ void MLIR::construct(const HLNode* root, Options options)
     q.dealloc(gc);
 }
 
+// Per-variable state for fold(), indexed by symbol id
+struct MLFoldVar
+{
+    u32 value; // Index of the initializer in nodes[], 0 if none
+    bool declared;
+    bool mutated; // Assigned to after the declaration; never replaced by a constant
+};
+
+// 1 if a condition with this value is taken, 0 if not, -1 if that's not known at compile time
+static int mlirTruthy(const Val& v)
+{
+    switch(v.type)
+    {
+        case PRIMTYPE_NIL:
+        case PRIMTYPE_ERROR:
+            return 0;
+        case PRIMTYPE_BOOL:
+            return !!v.u.ui;
+        case PRIMTYPE_OPAQUE:
+            return -1;
+        default: ;
+    }
+    return v.type < PRIMTYPE_ANY ? 1 : -1;
+}
+
+// ML_DECL's first child has one type expr per variable, and an untyped variable has an empty list there.
+// A single variable isn't wrapped in a list, so an empty list on its own is one untyped variable.
+static MLSub mlirDeclTypes(MLNode *decl)
+{
+    MLNode *types = decl->firstChild();
+    if(types->m.cmd == ML_LIST && !types->list.len)
+    {
+        MLSub one = { types, 1 };
+        return one;
+    }
+    return types->aslist();
+}
+
+static bool mlirIsUntyped(const MLNode *type)
+{
+    return type->m.cmd == ML_LIST && !type->list.len;
+}
+
+// ML_FUNC's first child has the parameter types, like ML_DECL. Without parameters, it's an empty list
+// and the first parameter's symbol id is 0. Parameters always have a type, but play it safe.
+static MLSub mlirFuncParams(MLNode *fn)
+{
+    MLNode *types = fn->firstChild();
+    if(mlirIsUntyped(types) && fn->m.p[0])
+    {
+        MLSub one = { types, 1 };
+        return one;
+    }
+    return types->aslist();
+}
+
+static void mlirMarkMutated(PodArray<MLFoldVar>& fv, MLNode *node)
+{
+    const MLSub s = node->aslist();
+    for(size_t i = 0; i < s.n; ++i)
+    {
+        const MLNode& c = s.ch[i];
+        if(c.m.cmd == ML_VAR && c.m.p[0] < fv.size())
+            fv[c.m.p[0]].mutated = true;
+        else if(c.m.cmd == ML_DECL)
+        {
+            const size_t n = mlirDeclTypes(const_cast<MLNode*>(&c)).n;
+            for(size_t k = 0; k < n && c.m.p[0] + k < fv.size(); ++k)
+                fv[c.m.p[0] + k].mutated = true;
+        }
+    }
+}
+
+// Gather declarations, initializers and assignments of all variables in the module into fv, indexed by symbol id.
+// Symbol ids of declarations are consecutive and unique in the module. Returns false on OOM.
+static bool mlirCollectVars(MLIR& ml, PodArray<MLFoldVar>& fv)
+{
+    const size_t N = ml.nodes.size();
+    size_t nsyms = 0;
+    for(size_t i = 0; i < N; ++i)
+    {
+        MLNode& m = ml.nodes[i];
+        size_t end = 0;
+        if(m.m.cmd == ML_VAR)
+            end = size_t(m.m.p[0]) + 1;
+        else if(m.m.cmd == ML_DECL)
+            end = m.m.p[0] + mlirDeclTypes(&m).n;
+        else if(m.m.cmd == ML_NAMEDECL && mlirIsUntyped(m.firstChild())) // No namespace
+            end = size_t(m.m.p[1]) + 1;
+        else if(m.m.cmd == ML_FUNC)
+            end = m.m.p[0] + mlirFuncParams(&m).n;
+        if(end > nsyms)
+            nsyms = end;
+    }
+    if(nsyms && !fv.resize(ml.gc, nsyms))
+        return false;
+    if(nsyms)
+        memset(fv.data(), 0, nsyms * sizeof(MLFoldVar));
+
+    for(size_t i = 0; i < N; ++i)
+    {
+        MLNode& m = ml.nodes[i];
+        switch(m.m.cmd)
+        {
+            case ML_DECL:
+            {
+                const MLSub types = mlirDeclTypes(&m);
+                const MLSub vals = m.firstChild()[1].aslist();
+                for(size_t k = 0; k < types.n; ++k)
+                {
+                    MLFoldVar& v = fv[m.m.p[0] + k];
+                    v.mutated |= v.declared; // Declared more than once? Play it safe.
+                    v.declared = true;
+                    // A declared type may convert the value, so only untyped variables take it as-is
+                    if(k < vals.n && mlirIsUntyped(&types.ch[k]))
+                        v.value = u32(ml.indexOf(&vals.ch[k]));
+                }
+                break;
+            }
+
+            case ML_NAMEDECL: // func name(...)
+            {
+                MLNode * const ch = m.firstChild();
+                if(!mlirIsUntyped(&ch[0]))
+                    break; // Goes into a namespace, there's no variable
+                MLFoldVar& v = fv[m.m.p[1]];
+                v.mutated |= v.declared;
+                v.declared = true;
+                v.value = u32(ml.indexOf(&ch[1]));
+                break;
+            }
+
+            case ML_FUNC: // Parameters are declared, but their value isn't known
+            {
+                const size_t n = mlirFuncParams(&m).n;
+                for(size_t k = 0; k < n; ++k)
+                {
+                    MLFoldVar& v = fv[m.m.p[0] + k];
+                    v.mutated |= v.declared;
+                    v.declared = true;
+                }
+                break;
+            }
+
+            case ML_ASSIGN:
+                mlirMarkMutated(fv, m.firstChild()); // dstlist
+                break;
+
+            case ML_FOR: // Iteration variables change every time
+                mlirMarkMutated(fv, m.firstChild());
+                break;
+
+            default: ;
+        }
+    }
+    return true;
+}
+
+// Run a pure operator on constant operands. Returns false if that can't be done at compile time.
+// Operator names, as they were registered in the namespaces
+static void mlirOpNames(const StringPool& sp, sref *opnames)
+{
+    for(size_t i = _ML_OP_FIRST; i < _OP_MAX; ++i)
+        opnames[i] = sp.get(GetOperatorName(OperatorId(i))).id;
+}
+
+// The pure leaf function behind operator name with operands of types ts, or NULL
+static const DFunc *mlirPureOp(const SymTable& env, const TypeRegistry& tr, sref name, const Type *ts, size_t n)
+{
+    const Val *v = name ? env.lookupInNamespace(ts[0], name) : NULL;
+    const DFunc *df = v ? v->asFunc() : NULL;
+    if(!df || !df->isPure() || (df->info.flags & FuncInfo::FuncTypeMask) != FuncInfo::LFunc || df->info.nrets != 1)
+        return NULL;
+
+    // Operators are overloaded by their first operand only, so make sure the rest matches too
+    return tr.lookuplist(ts, n) == df->info.paramtype ? df : NULL;
+}
+
+static bool mlirFoldOp(MLFoldTracker& ft, sref name, const MLNode *ch, size_t n, Val& result)
+{
+    assert(n <= 2);
+    Val stk[2];
+    Type ts[2];
+    for(size_t i = 0; i < n; ++i)
+    {
+        stk[i] = ch[i].asVal();
+        ts[i] = stk[i].type;
+    }
+
+    const DFunc *df = mlirPureOp(ft.env, ft.vm.rt->tr, name, ts, n);
+    if(!df)
+        return false;
+
+    // Leaf functions report errors via vm.state. On error, leave it to the runtime to complain.
+    const int oldstate = ft.vm.state;
+    ft.vm.state = 0;
+    const bool ok = df->call(&ft.vm, stk) == 1 && ft.vm.state >= 0;
+    ft.vm.state = oldstate;
+    if(!ok)
+        return false;
+    result = ft.vm.rt->sp.flatten(stk[0]); // Constants must be interned
+    return result.type != PRIMTYPE_NIL;
+}
+
+void MLIR::fold(MLFoldTracker& ft)
+{
+    const size_t N = nodes.size();
+    if(!N)
+        return;
+
+    sref opnames[_OP_MAX];
+    mlirOpNames(ft.vm.rt->sp, opnames);
+
+    PodArray<MLFoldVar> fv;
+    if(!mlirCollectVars(*this, fv))
+        return;
+    const size_t nsyms = fv.size();
+
+    // Children always come after their parent, so a backwards sweep visits the children of a node first
+    // and folds bottom-up without recursion. A variable may be read before the sweep got to its initializer,
+    // so repeat until nothing changes.
+    for(unsigned changed = 1; changed; )
+    {
+        changed = 0;
+        for(size_t i = N; i--; )
+        {
+            MLNode& m = nodes[i];
+            const MLCmd cmd = (MLCmd)m.m.cmd;
+            if(cmd == _ML_VAL || cmd == _ML_DEAD)
+                continue;
+
+            const size_t nch = m.numchildren();
+            MLNode * const ch = nch ? m.firstChild() : NULL;
+
+            if(cmd != ML_EXPORT) // Exports refer to the variable itself
+                for(size_t k = 0; k < nch; ++k)
+                {
+                    MLNode& c = ch[k];
+                    if(c.m.cmd != ML_VAR || c.m.p[0] >= nsyms)
+                        continue;
+                    const MLFoldVar& v = fv[c.m.p[0]];
+                    if(v.mutated || !v.value || nodes[v.value].m.cmd != _ML_VAL)
+                        continue;
+                    // Only the read is replaced; the variable itself stays as it is in vars[], since its declaration
+                    // is still there until eliminateDeadCode() removes it. fv is all the state that's needed here.
+                    c.setVal(nodes[v.value].asVal());
+                    ++ft.npropagated;
+                    ++changed;
+                }
+
+            if(cmd >= _ML_OP_FIRST && cmd < _ML_OP_MAX)
+            {
+                size_t k = 0;
+                while(k < nch && ch[k].m.cmd == _ML_VAL)
+                    ++k;
+                Val res;
+                if(k == nch && mlirFoldOp(ft, opnames[cmd], ch, nch, res))
+                {
+                    for(k = 0; k < nch; ++k)
+                        ch[k].invalidate();
+                    m.setVal(res);
+                    ++ft.nfolded;
+                    ++changed;
+                }
+            }
+            else if(cmd == ML_IFELSE && ch[0].m.cmd == _ML_VAL)
+            {
+                const int t = mlirTruthy(ch[0].asVal());
+                if(t < 0)
+                    continue;
+
+                // Move the branch that's taken in place of the ML_IFELSE, and kill everything else
+                MLNode * const keep = &ch[t ? 1 : 2];
+                MLNode repl = *keep;
+                if(repl.m.cmd != _ML_VAL && repl.numchildren())
+                    repl.m.chOffs += u32(keep - &m);
+                ch[0].invalidate();
+                ch[t ? 2 : 1].invalidate();
+                keep->m.cmd = _ML_DEAD; // Only this node, its children live on
+                if(indexOf(keep) < infos.size())
+                    infos[i] = infos[indexOf(keep)];
+                m = repl;
+                ++ft.nbranches;
+                ++changed;
+            }
+        }
+    }
+
+    fv.dealloc(gc);
+}
+
+enum
+{
+    ML_INLINE_MAX_PARAMS = 8,
+    ML_INLINE_MAX_ROUNDS = 4 // Functions that call each other get inlined into each other this many times at most
+};
+
+// What an expression does, as far as inlining is concerned
+struct MLInlineScan
+{
+    const PodArray<MLFoldVar>& fv;
+    u32 firstparam, nparams; // Reads of these are counted in uses[]
+    u32 self; // Symbol id of the function the expression is returned from. Recursive calls are not inlined.
+    const u32 *owner; // ML_FUNC each symbol is declared in (0: top level), or NULL to not check this
+    u32 site; // ML_FUNC the call is in
+    unsigned maxnodes;
+    unsigned nodes;
+    bool ok; // false if it contains something that can't be copied
+    bool calls; // Contains a call, which may have any side effect
+    bool volatil; // Reads something a call could change
+    unsigned uses[ML_INLINE_MAX_PARAMS];
+
+    // Scans an expression at the call site; set the other members to scan a function body
+    MLInlineScan(const PodArray<MLFoldVar>& fv, unsigned maxnodes)
+        : fv(fv), firstparam(0), nparams(0), self(u32(-1)), owner(NULL), site(0), maxnodes(maxnodes), nodes(0)
+        , ok(true), calls(false), volatil(false)
+    {
+        memset(uses, 0, sizeof(uses));
+    }
+};
+
+static void mlirInlineScan(MLInlineScan& s, const MLNode *node)
+{
+    if(!s.ok || ++s.nodes > s.maxnodes)
+    {
+        s.ok = false;
+        return;
+    }
+
+    const MLCmd cmd = (MLCmd)node->m.cmd;
+    switch(cmd)
+    {
+        case _ML_VAL:
+            return;
+
+        case ML_VAR:
+        {
+            // Externals stay valid as-is. Any other variable must be a local at the call site,
+            // otherwise the function around the call would need an upvalue that it doesn't capture.
+            const u32 id = node->m.p[0];
+            if(id - s.firstparam < s.nparams)
+                ++s.uses[id - s.firstparam];
+            else if(id == s.self)
+                s.ok = false;
+            else if(s.owner && id < s.fv.size() && s.fv[id].declared && s.owner[id] != s.site)
+                s.ok = false;
+            else if(id >= s.fv.size() || !s.fv[id].declared || s.fv[id].mutated)
+                s.volatil = true;
+            return;
+        }
+
+        case ML_FNCALL:
+        case ML_MTHCALL:
+            s.calls = true;
+            break;
+
+        case ML_GETINDEX:
+            s.volatil = true;
+            break;
+
+        case ML_LIST:
+        case ML_NEW_ARRAY:
+        case ML_NEW_TABLE:
+            break;
+
+        default: // Anything that declares symbols (ML_FUNC) would declare them twice when copied
+            if(!(cmd >= _ML_OP_FIRST && cmd < _ML_OP_MAX))
+                s.ok = false;
+            return;
+    }
+
+    if(const size_t nch = node->numchildren())
+    {
+        const MLNode *ch = node->firstChild();
+        for(size_t i = 0; i < nch; ++i)
+            mlirInlineScan(s, &ch[i]);
+    }
+}
+
+// Type named by a type expression, PRIMTYPE_ANY if there is none, or PRIMTYPE_AUTO if it's not known at compile time
+static Type mlirResolveType(const Symstore& syms, const SymTable& env, const MLNode *t)
+{
+    if(mlirIsUntyped(t))
+        return PRIMTYPE_ANY;
+
+    const Val *v = NULL;
+    if(t->m.cmd == _ML_VAL)
+        v = static_cast<const Val*>(&t->val);
+    else if(t->m.cmd == ML_VAR && t->m.p[0] < syms.numsyms())
+    {
+        const Symstore::Sym *sym = syms.getsym(t->m.p[0]);
+        if(sym->referencedHow & SYMREF_EXTERNAL) // A local variable may have the same name as a type
+            v = env.lookupSymbol(sym->nameStrId);
+    }
+    return v && v->type == PRIMTYPE_TYPE ? v->asDType()->tid : Type(PRIMTYPE_AUTO);
+}
+
+// Literals convert implicitly to a parameter's type where nothing is lost, eg. 'int a = 1' or 'float c = -1'
+static bool mlirCastLiteral(const Val& v, Type t, Val& out)
+{
+    if(v.type == t)
+        out = v;
+    else if(t == PRIMTYPE_SINT && v.type == PRIMTYPE_UINT && sint(v.u.ui) >= 0)
+        out = Val(sint(v.u.ui));
+    else if(t == PRIMTYPE_FLOAT && v.type == PRIMTYPE_UINT && v.u.ui <= (1u << 24)) // Exact as float
+        out = Val(real(v.u.ui));
+    else if(t == PRIMTYPE_FLOAT && v.type == PRIMTYPE_SINT && v.u.si <= (1 << 24) && v.u.si >= -(1 << 24))
+        out = Val(real(v.u.si));
+    else
+        return false;
+    return true;
+}
+
+// The expression returned by an ML_FUNC that can be inlined, or NULL
+static const MLNode *mlirInlineBody(const MLNode *fn)
+{
+    const MLNode *ch = fn->firstChild();
+    if(!mlirIsUntyped(&ch[1])) // Declared return types
+        return NULL;
+
+    // A body with one statement is that statement
+    const MLNode *body = &ch[2];
+    if(body->m.cmd != ML_RETURN)
+        return NULL;
+    const MLNode *e = body->firstChild();
+    if(e->m.cmd == ML_LIST) // Nothing or multiple values returned
+        return NULL;
+    return e;
+}
+
+bool MLIR::_copyTree(size_t dst, size_t src, u32 firstparam, size_t nparams, const u32 *args)
+{
+    MLNode n = nodes[src];
+    if(n.m.cmd == ML_VAR && n.m.p[0] - firstparam < nparams)
+        return _copyTree(dst, args[n.m.p[0] - firstparam], 0, 0, NULL);
+
+    const size_t nch = n.m.cmd != _ML_VAL ? n.numchildren() : 0;
+    if(nch)
+    {
+        const size_t srcch = src + n.m.chOffs;
+        if(!_add(nch)) // may reallocate nodes[]
+            return false;
+        const size_t ch = nodes.size() - nch;
+        n.m.chOffs = u32(ch - dst);
+        nodes[dst] = n;
+        for(size_t i = 0; i < nch; ++i)
+            if(!_copyTree(ch + i, srcch + i, firstparam, nparams, args))
+                return false;
+    }
+    else
+        nodes[dst] = n;
+    return true;
+}
+
+// Known types of variables, indexed by symbol id. Where a type was declared, it's enforced on every assignment.
+// PRIMTYPE_ANY if the variable is untyped, PRIMTYPE_AUTO if the type isn't known. Returns false on OOM.
+static bool mlirVarTypes(MLIR& ml, const Symstore& syms, const SymTable& env, const PodArray<MLFoldVar>& fv, PodArray<Type>& vt)
+{
+    if(fv.size() && !vt.resize(ml.gc, fv.size()))
+        return false;
+    for(size_t i = 0; i < vt.size(); ++i)
+        vt[i] = PRIMTYPE_AUTO;
+    for(size_t i = 0; i < ml.nodes.size(); ++i)
+    {
+        MLNode& m = ml.nodes[i];
+        if(m.m.cmd != ML_DECL && m.m.cmd != ML_FUNC)
+            continue;
+        const MLSub types = m.m.cmd == ML_DECL ? mlirDeclTypes(&m) : mlirFuncParams(&m);
+        const MLSub vals = m.m.cmd == ML_DECL ? m.firstChild()[1].aslist() : MLSub();
+        for(size_t k = 0; k < types.n; ++k)
+        {
+            const u32 id = m.m.p[0] + k;
+            Type t = mlirResolveType(syms, env, &types.ch[k]);
+            if(t == PRIMTYPE_ANY && k < vals.n && vals.ch[k].m.cmd == _ML_VAL && !fv[id].mutated)
+                t = vals.ch[k].val.type;
+            vt[id] = t;
+        }
+    }
+    return true;
+}
+
+// The ML_FUNC each node is in (0: top level), and the ML_FUNC each symbol is declared in.
+// Children always come after their parent, so one forward sweep is enough.
+static void mlirFindScopes(MLIR& ml, u32 *encl, u32 *owner, size_t nsyms)
+{
+    const size_t N = ml.nodes.size();
+    memset(encl, 0, N * sizeof(*encl));
+    memset(owner, 0, nsyms * sizeof(*owner));
+    for(size_t i = 0; i < N; ++i)
+    {
+        MLNode& m = ml.nodes[i];
+        const MLCmd cmd = (MLCmd)m.m.cmd;
+        if(cmd == _ML_VAL || cmd == _ML_DEAD)
+            continue;
+
+        size_t first = 0, n = 0;
+        u32 in = encl[i];
+        if(cmd == ML_DECL)
+        {
+            first = m.m.p[0];
+            n = mlirDeclTypes(&m).n;
+        }
+        else if(cmd == ML_NAMEDECL && mlirIsUntyped(m.firstChild()))
+        {
+            first = m.m.p[1];
+            n = 1;
+        }
+        else if(cmd == ML_FUNC)
+        {
+            first = m.m.p[0];
+            n = mlirFuncParams(&m).n;
+            in = u32(i);
+        }
+        for(size_t k = 0; k < n && first + k < nsyms; ++k)
+            owner[first + k] = in;
+
+        if(const size_t nch = m.numchildren())
+        {
+            const size_t ch = ml.indexOf(m.firstChild());
+            for(size_t k = 0; k < nch; ++k)
+                encl[ch + k] = in;
+        }
+    }
+}
+
+void MLIR::inlineCalls(MLInlineTracker& it)
+{
+    // Inlining only replaces calls in place and adds new nodes, so variables stay where they are
+    PodArray<MLFoldVar> fv;
+    if(!mlirCollectVars(*this, fv))
+        return;
+
+    PodArray<Type> vt;
+    if(!mlirVarTypes(*this, it.syms, it.env, fv, vt))
+    {
+        fv.dealloc(gc);
+        return;
+    }
+
+    PodArray<u32> encl, owner;
+    for(unsigned round = 0, changed = 1; changed && round < ML_INLINE_MAX_ROUNDS; ++round)
+    {
+        changed = 0;
+        const size_t N = nodes.size(); // Calls in copies that are added while going are handled next round
+        if(!encl.resize(gc, N) || (fv.size() && !owner.resize(gc, fv.size())))
+            break;
+        mlirFindScopes(*this, encl.data(), owner.data(), owner.size());
+        for(size_t i = 0; i < N; ++i)
+        {
+            if(nodes[i].m.cmd != ML_FNCALL)
+                continue;
+
+            // The callee must be a variable that's initialized with a function and never changes
+            const size_t callch = i + nodes[i].m.chOffs;
+            const MLNode& callee = nodes[callch];
+            if(callee.m.cmd != ML_VAR || callee.m.p[0] >= fv.size())
+                continue;
+            const u32 self = callee.m.p[0];
+            const MLFoldVar& v = fv[self];
+            if(v.mutated || !v.value || nodes[v.value].m.cmd != ML_FUNC)
+                continue;
+
+            MLNode * const fn = &nodes[v.value];
+            const MLNode *e = mlirInlineBody(fn);
+            const MLSub params = mlirFuncParams(fn);
+            const MLSub args = nodes[callch + 1].aslist();
+            if(!e || params.n != args.n || params.n > ML_INLINE_MAX_PARAMS)
+                continue;
+            const u32 firstparam = fn->m.p[0];
+
+            MLInlineScan body(fv, it.maxnodes);
+            body.firstparam = firstparam;
+            body.nparams = u32(params.n);
+            body.self = self;
+            body.owner = owner.data();
+            body.site = encl[i];
+            mlirInlineScan(body, e);
+            if(!body.ok)
+                continue;
+
+            // A call checks that each argument has the type of its parameter; the inlined expression can't.
+            // Arguments are evaluated before the call, and moving them into the expression must not change that.
+            // So each one is either a constant, a variable that may be read any number of times,
+            // or an expression without side effects that is used exactly once.
+            u32 argidx[ML_INLINE_MAX_PARAMS];
+            Val lit[ML_INLINE_MAX_PARAMS];
+            size_t k = 0;
+            for( ; k < args.n; ++k)
+            {
+                const MLNode *a = &args.ch[k];
+                argidx[k] = u32(indexOf(a));
+
+                const Type pt = mlirResolveType(it.syms, it.env, &params.ch[k]);
+                if(a->m.cmd == _ML_VAL)
+                {
+                    if(pt == PRIMTYPE_ANY)
+                        lit[k] = a->asVal();
+                    else if(pt == PRIMTYPE_AUTO || !mlirCastLiteral(a->asVal(), pt, lit[k]))
+                        break;
+                    continue;
+                }
+                const Type at = a->m.cmd == ML_VAR && a->m.p[0] < vt.size() ? vt[a->m.p[0]] : Type(PRIMTYPE_AUTO);
+                if(pt != PRIMTYPE_ANY && (pt != at || pt == PRIMTYPE_AUTO))
+                    break;
+
+                MLInlineScan as(fv, it.maxnodes); // Already at the call site
+                mlirInlineScan(as, a);
+                if(!as.ok || as.calls || (as.volatil && body.calls))
+                    break;
+                if(body.uses[k] != 1 && a->m.cmd != ML_VAR)
+                    break;
+            }
+            if(k < args.n)
+                continue;
+
+            // The call would convert literals the same way, so this is fine even if the rest fails
+            for(k = 0; k < args.n; ++k)
+                if(args.ch[k].m.cmd == _ML_VAL)
+                    args.ch[k].setVal(lit[k]);
+
+            // Build the copy off to the side, then move its root in place of the call
+            const size_t oldsize = nodes.size();
+            const size_t eidx = indexOf(e);
+            if(!_add(1) || !_copyTree(oldsize, eidx, firstparam, params.n, argidx))
+            {
+                for(size_t j = oldsize; j < nodes.size(); ++j)
+                    nodes[j].m.cmd = _ML_DEAD;
+                continue;
+            }
+
+            nodes[callch].invalidate();
+            nodes[callch + 1].invalidate();
+            MLNode repl = nodes[oldsize];
+            if(repl.m.cmd != _ML_VAL && repl.numchildren())
+                repl.m.chOffs += u32(oldsize - i);
+            nodes[oldsize].m.cmd = _ML_DEAD;
+            nodes[i] = repl;
+
+            // New nodes take the debug info of the call
+            if(const size_t ninfos = infos.size())
+                if(MLInfo *inf = infos.alloc_n(gc, nodes.size() - ninfos))
+                    for(size_t j = 0; j < nodes.size() - ninfos; ++j)
+                        inf[j] = infos[i];
+
+            ++it.ninlined;
+            ++changed;
+        }
+    }
+    owner.dealloc(gc);
+    encl.dealloc(gc);
+    vt.dealloc(gc);
+    fv.dealloc(gc);
+}
+
+// Per-variable state for eliminateDeadCode(), indexed by symbol id
+struct MLDceVar
+{
+    u32 reads; // In live code
+    u32 writes; // As assignment target in live code
+};
+
+// State of eliminateDeadCode()
+struct MLDce
+{
+    MLIR& ml;
+    MLDceTracker& dt;
+    const PodArray<MLFoldVar>& fv;
+    PodArray<MLDceVar>& dv;
+    const PodArray<Type>& vt; // Known variable types
+    const sref *opnames;
+    unsigned changed;
+};
+
+// Add delta to the read and write counts of every variable in the tree at node
+static void mlirDceCount(PodArray<MLDceVar>& dv, const MLNode *node, u32 delta)
+{
+    const MLCmd cmd = (MLCmd)node->m.cmd;
+    if(cmd == _ML_VAL)
+        return;
+    if(cmd == ML_VAR)
+    {
+        dv[node->m.p[0]].reads += delta;
+        return;
+    }
+    const size_t nch = node->numchildren();
+    if(!nch)
+        return;
+    const MLNode *ch = node->firstChild();
+    size_t i = 0;
+    if(cmd == ML_ASSIGN)
+    {
+        const MLConstSub dst = ch[0].aslist();
+        for(size_t k = 0; k < dst.n; ++k)
+        {
+            if(dst.ch[k].m.cmd == ML_VAR)
+                dv[dst.ch[k].m.p[0]].writes += delta;
+            else // t[k] = ... reads t and k
+                mlirDceCount(dv, &dst.ch[k], delta);
+        }
+        i = 1;
+    }
+    for( ; i < nch; ++i)
+        mlirDceCount(dv, &ch[i], delta);
+}
+
+// A variable declared in this module that is never read and not exported
+static bool mlirDceUnread(const MLDce& d, u32 id)
+{
+    if(d.dv[id].reads || !d.fv[id].declared)
+        return false;
+    return id >= d.dt.syms.numsyms() || !(d.dt.syms.getsym(id)->referencedHow & SYMREF_EXPORTED);
+}
+
+static const DFunc *mlirDceOp(const MLDce& d, const MLNode *node);
+
+// Type of an expression if it's a primitive known at compile time, otherwise PRIMTYPE_AUTO
+static Type mlirDceType(const MLDce& d, const MLNode *node)
+{
+    const MLCmd cmd = (MLCmd)node->m.cmd;
+    Type t = PRIMTYPE_AUTO;
+    if(cmd == _ML_VAL)
+        t = node->val.type;
+    else if(cmd == ML_VAR && node->m.p[0] < d.vt.size())
+        t = d.vt[node->m.p[0]];
+    else if(const DFunc *df = mlirDceOp(d, node))
+    {
+        const TypeIdList rets = d.dt.rt.tr.getlist(df->info.rettype);
+        if(rets.ptr && rets.n == 1)
+            t = rets.ptr[0];
+    }
+    return t < PRIMTYPE_ANY ? t : Type(PRIMTYPE_AUTO);
+}
+
+// The pure leaf function an operator calls, if that's known at compile time, otherwise NULL.
+// This is the same check that fold() makes, but the operands don't need to be constant.
+static const DFunc *mlirDceOp(const MLDce& d, const MLNode *node)
+{
+    const MLCmd cmd = (MLCmd)node->m.cmd;
+    if(!(cmd >= _ML_OP_FIRST && cmd < _ML_OP_MAX))
+        return NULL;
+    const size_t n = node->numchildren();
+    assert(n <= 2);
+    const MLNode *ch = node->firstChild();
+    Type ts[2];
+    for(size_t i = 0; i < n; ++i)
+        if((ts[i] = mlirDceType(d, &ch[i])) == PRIMTYPE_AUTO)
+            return NULL;
+    return mlirPureOp(d.dt.env, d.dt.rt.tr, d.opnames[cmd], ts, n);
+}
+
+// No side effects, and not known to fail at runtime
+static bool mlirIsPure(const MLDce& d, const MLNode *node)
+{
+    const MLCmd cmd = (MLCmd)node->m.cmd;
+    const bool isop = cmd >= _ML_OP_FIRST && cmd < _ML_OP_MAX;
+    switch(cmd)
+    {
+        case _ML_VAL:
+        case ML_CONST:
+        case ML_VAR:
+        case ML_FUNC: // Only makes a closure, the body doesn't run
+            return true;
+
+        case ML_LIST:
+        case ML_NEW_ARRAY:
+        case ML_NEW_TABLE:
+            break;
+
+        default:
+            if(!isop)
+                return false;
+    }
+
+    const size_t nch = node->numchildren();
+    const MLNode *ch = nch ? node->firstChild() : NULL;
+    bool allconst = true;
+    for(size_t i = 0; i < nch; ++i)
+    {
+        if(!mlirIsPure(d, &ch[i]))
+            return false;
+        allconst = allconst && ch[i].m.cmd == _ML_VAL;
+    }
+    // An operator may call anything unless its operands have types that resolve to a pure function.
+    // fold() leaves operators with constant operands alone if they would fail.
+    return !isop || (!allconst && mlirDceOp(d, node));
+}
+
+// Move a node to an earlier slot. Its children stay where they are.
+static void mlirMoveNode(MLIR& ml, size_t dst, size_t src)
+{
+    assert(dst < src);
+    MLNode n = ml.nodes[src];
+    if(n.m.cmd != _ML_VAL && n.numchildren())
+        n.m.chOffs += u32(src - dst);
+    ml.nodes[dst] = n;
+    ml.nodes[src].m.cmd = _ML_DEAD;
+    if(src < ml.infos.size())
+        ml.infos[dst] = ml.infos[src];
+}
+
+static void mlirDceRemove(MLDce& d, size_t s)
+{
+    mlirDceCount(d.dv, &d.ml.nodes[s], u32(-1));
+    d.ml.nodes[s].invalidate();
+    ++d.changed;
+}
+
+static void mlirDceBlock(MLDce& d, size_t b);
+
+// Clean up the bodies of functions in the tree at idx
+static void mlirDceFuncs(MLDce& d, size_t idx)
+{
+    const MLNode& n = d.ml.nodes[idx];
+    const size_t nch = n.m.cmd != _ML_VAL ? n.numchildren() : 0;
+    if(!nch)
+        return;
+    const size_t ch = idx + n.m.chOffs;
+    const bool isfunc = n.m.cmd == ML_FUNC;
+    for(size_t i = 0; i < nch; ++i)
+    {
+        if(isfunc && i == 2)
+            mlirDceBlock(d, ch + i);
+        else
+            mlirDceFuncs(d, ch + i);
+    }
+}
+
+// Clean up inside of a statement. Returns true if the statement itself does nothing and can go.
+static bool mlirDceStmt(MLDce& d, size_t s)
+{
+    MLIR& ml = d.ml;
+    const MLCmd cmd = (MLCmd)ml.nodes[s].m.cmd;
+    const size_t ch = s + ml.nodes[s].m.chOffs;
+    switch(cmd)
+    {
+        case ML_LIST: // Nested block
+            mlirDceBlock(d, s);
+            return ml.nodes[s].m.cmd == ML_LIST && !ml.nodes[s].list.len;
+
+        case ML_IFELSE:
+            mlirDceFuncs(d, ch);
+            mlirDceBlock(d, ch + 1);
+            mlirDceBlock(d, ch + 2);
+            return false;
+
+        case ML_WHILE:
+        case ML_FOR:
+            mlirDceFuncs(d, ch);
+            mlirDceBlock(d, ch + 1);
+            return false;
+
+        case ML_NAMEDECL:
+            mlirDceFuncs(d, s);
+            return mlirIsUntyped(&ml.nodes[ch]) // Not in a namespace
+                && mlirDceUnread(d, ml.nodes[s].m.p[1]) && !d.dv[ml.nodes[s].m.p[1]].writes
+                && mlirIsPure(d, &ml.nodes[ch + 1]);
+
+        case ML_DECL:
+        case ML_ASSIGN:
+        {
+            mlirDceFuncs(d, s);
+            MLNode& m = ml.nodes[s];
+            if(cmd == ML_DECL)
+            {
+                // Assignments come after the declaration and were looked at already
+                const size_t n = mlirDeclTypes(&m).n;
+                for(size_t k = 0; k < n; ++k)
+                    if(!mlirDceUnread(d, m.m.p[0] + k) || d.dv[m.m.p[0] + k].writes)
+                        return false;
+            }
+            else
+            {
+                const MLSub dst = ml.nodes[ch].aslist();
+                for(size_t k = 0; k < dst.n; ++k)
+                    if(dst.ch[k].m.cmd != ML_VAR || !mlirDceUnread(d, dst.ch[k].m.p[0]))
+                        return false;
+            }
+
+            // All variables are unused. The values may still have side effects.
+            const MLNode& vals = ml.nodes[ch + 1];
+            if(mlirIsPure(d, &vals))
+                return true;
+            if(vals.m.cmd != ML_FNCALL && vals.m.cmd != ML_MTHCALL)
+                return false;
+
+            // Keep only the call, as a statement
+            mlirDceCount(d.dv, &m, u32(-1));
+            mlirDceCount(d.dv, &vals, 1);
+            ml.nodes[ch].invalidate();
+            mlirMoveNode(ml, s, ch + 1);
+            ++d.dt.nremoved;
+            ++d.changed;
+            return false;
+        }
+
+        case ML_FNCALL:
+        case ML_MTHCALL:
+        case ML_RETURN:
+        case ML_YIELD:
+        case ML_EMIT:
+        case ML_EXPORT:
+        case ML_CLOSE:
+            mlirDceFuncs(d, s);
+            return false;
+
+        default: // Expression whose value is discarded
+            mlirDceFuncs(d, s);
+            return mlirIsPure(d, &ml.nodes[s]);
+    }
+}
+
+// b is a list of statements, or a single statement
+static void mlirDceBlock(MLDce& d, size_t b)
+{
+    MLIR& ml = d.ml;
+    if(ml.nodes[b].m.cmd != ML_LIST)
+    {
+        if(mlirDceStmt(d, b))
+        {
+            mlirDceRemove(d, b);
+            ml.nodes[b].makedummy();
+            ++d.dt.nremoved;
+        }
+        return;
+    }
+
+    const size_t n = ml.nodes[b].list.len;
+    const size_t first = b + ml.nodes[b].m.chOffs;
+
+    // Nothing after a return is ever run
+    size_t end = 0;
+    while(end < n && ml.nodes[first + end++].m.cmd != ML_RETURN) {}
+    for(size_t k = end; k < n; ++k)
+    {
+        mlirDceRemove(d, first + k);
+        ++d.dt.nunreachable;
+    }
+
+    // Backwards, so that when a statement goes, the variables it read may be unused by the time their declaration comes up
+    for(size_t k = end; k--; )
+        if(mlirDceStmt(d, first + k))
+        {
+            mlirDceRemove(d, first + k);
+            ++d.dt.nremoved;
+        }
+
+    // Close the gaps
+    size_t w = 0;
+    for(size_t k = 0; k < n; ++k)
+        if(ml.nodes[first + k].m.cmd != _ML_DEAD)
+        {
+            if(w != k)
+                mlirMoveNode(ml, first + w, first + k);
+            ++w;
+        }
+    ml.nodes[b].list.len = u32(w);
+    if(w == 1) // There are no lists of length 1
+        mlirMoveNode(ml, b, first);
+}
+
+void MLIR::eliminateDeadCode(MLDceTracker& dt)
+{
+    if(nodes.empty())
+        return;
+
+    sref opnames[_OP_MAX];
+    mlirOpNames(dt.rt.sp, opnames);
+
+    PodArray<MLFoldVar> fv;
+    PodArray<MLDceVar> dv;
+    PodArray<Type> vt;
+    if(mlirCollectVars(*this, fv) && (!fv.size() || dv.resize(gc, fv.size())) && mlirVarTypes(*this, dt.syms, dt.env, fv, vt))
+    {
+        if(dv.size())
+            memset(dv.data(), 0, dv.size() * sizeof(MLDceVar));
+        mlirDceCount(dv, &nodes[0], 1);
+
+        // Removing something may leave more unused. Usually the backwards order catches that in one go.
+        MLDce d = { *this, dt, fv, dv, vt, opnames, 0 };
+        do
+        {
+            d.changed = 0;
+            mlirDceBlock(d, 0);
+        }
+        while(d.changed);
+    }
+    vt.dealloc(gc);
+    dv.dealloc(gc);
+    fv.dealloc(gc);
+}
+
 
 #if 0
 void MLIR::construct(const HLNode* root)
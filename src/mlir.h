@@ -3,11 +3,16 @@
 #include "defs.h"
 #include "array.h"
 #include "typing.h"
+#include "gc.h"
 
 struct HLNode;
 struct BufSink;
+struct BufStream;
 class StringPool;
 class Symstore;
+class SymTable;
+struct VM;
+struct Runtime;
 
 enum MLCmd
 {
@@ -21,7 +26,7 @@ enum MLCmd
 
     ML_CONST = 40,      // expr (1, const table idx)
     ML_VAR,             // expr (1, local table idx) -- local, upval, or extval
-    ML_NAMEDECL,        // stmt (1, name) [2, namespace, value]
+    ML_NAMEDECL,        // stmt (2, name, symid) [2, namespace, value] -- symid is only valid without namespace
     ML_DECL,            // stmt (1, local start) [2, typeexprs, exprs] -- num of vars = #typeexprs
     ML_CLOSE,           // stmt (2, local start, N)
     ML_ASSIGN,          // stmt (0) [2, dstlist, exprlist]
@@ -75,6 +80,12 @@ struct MLSub
     size_t n;
 };
 
+struct MLConstSub
+{
+    const MLNode *ch;
+    size_t n;
+};
+
 /* Design decisions:
 - Always stored in a single memory block that can me memmove()'d around
 - All children of a parent are consecutive as one block in memory
@@ -117,13 +128,14 @@ union MLNode
     void setVal(const ValU &v);
     size_t numchildren() const;
     MLSub aslist(); // Returns children, or itself if not list (as if it was a list with 1 child)
+    MLConstSub aslist() const;
 
     // Invalidate this node and all its children
     void invalidate();
     void makedummy();
 };
 
-union MLInfo
+struct MLInfo
 {
     u32 line, column;
 };
@@ -161,6 +173,34 @@ struct MLVar
 
 struct MLFoldTracker
 {
+    VM& vm; // Pure functions run on this at compile time. The module's strings must be in vm.rt->sp.
+    const SymTable& env; // Operators are looked up here, in the namespace of their first operand's type
+
+    // Counted by MLIR::fold()
+    unsigned nfolded;     // Operators replaced by their result
+    unsigned npropagated; // Variable reads replaced by the variable's constant value
+    unsigned nbranches;   // ML_IFELSE with a constant condition replaced by one of its branches
+};
+
+struct MLInlineTracker
+{
+    const Symstore& syms; // The module's symbols, to get the names of types
+    const SymTable& env; // Types are looked up here by name
+    unsigned maxnodes; // Functions whose returned expression has more nodes than this are not inlined
+
+    // Counted by MLIR::inlineCalls()
+    unsigned ninlined; // Calls replaced by the expression returned by the called function
+};
+
+struct MLDceTracker
+{
+    const Symstore& syms; // Exported symbols are kept even if the module never reads them
+    const SymTable& env; // Operators and types are looked up here, to tell whether an operator has side effects
+    const Runtime& rt; // Operator names and type lists
+
+    // Counted by MLIR::eliminateDeadCode()
+    unsigned nremoved;     // Statements that had no effect: unused declarations, dead stores, pure expressions
+    unsigned nunreachable; // Statements after a return
 };
 
 
@@ -186,21 +226,57 @@ public:
 
     // Construct a MLNode tree out of a HLNode tree.
     // The generated MLNodes are unresolved (cmd == _ML_HL_TODO) and still point to their HLNode.
-    void construct(const HLNode *root, Options options);
+    // sp is the StringPool the parser put the strings in.
+    void construct(const HLNode *root, const StringPool& sp, Options options);
 
-    // Typecheck and optimize the tree.
+    // Optimize the tree in place: Fold operators with constant operands using pure functions,
+    // replace variables that are initialized with a constant and never assigned to with that constant,
+    // and drop the branch of an ML_IFELSE with a constant condition that is never taken.
+    // Dead nodes stay in place, marked _ML_DEAD.
     void fold(MLFoldTracker& ft);
 
+    // Replace calls to small functions with the expression they return. A function qualifies if it's bound to
+    // a variable that is never assigned to, declares no return types, and its body is a single 'return expr'
+    // that doesn't declare anything. Parameters are replaced by copies of the arguments, as long as each
+    // argument is known to have the parameter's type and that doesn't change how often or in which order
+    // side effects happen. Best followed by fold().
+    void inlineCalls(MLInlineTracker& it);
+
+    // Remove declarations of variables that are never read, assignments to local variables that are never read,
+    // expression statements without side effects, and statements after a return. If the value of an otherwise
+    // dead declaration or assignment is a call, only the call stays. Run this after inlineCalls() and fold(),
+    // which leave many variables unused.
+    void eliminateDeadCode(MLDceTracker& dt);
+
     size_t indexOf(const MLNode *node) const;
 
     void visit(MLVisitorPre pre, MLVisitorPost post, void *ud);
-    void dump(BufSink *sink, const StringPool& sp, Options options) const;
+
+    // Write the tree as a precompiled module. Returns false if the sink failed or something can't be serialized.
+    bool dump(BufSink *sink, const StringPool& sp, Options options) const;
+
+    enum LoadResult
+    {
+        LOAD_OK,
+        LOAD_NOT_A_MODULE, // Header doesn't match
+        LOAD_VERSION,      // Written by an incompatible version; recompile from source
+        LOAD_ERROR         // Corrupt data, read error, or out of memory
+    };
+
+    // Read a module written by dump(), replacing everything in here. Strings are put into sp.
+    // Reads exactly as much as dump() wrote, so the stream can be used for other things afterwards.
+    LoadResult load(BufStream *sm, StringPool& sp);
+
+    // Copy of src, whose strings live in srcsp, with all strings imported into sp. Returns false on OOM.
+    // For modules that were compiled against a separate StringPool, eg. on another thread.
+    bool importFrom(const MLIR& src, const StringPool& srcsp, StringPool& sp);
 
     PodArray<MLNode> nodes;
     PodArray<MLInfo> infos;
     PodArray<MLVar> vars;
 
     GC& gc;
+    GCroot root; // Keeps the strings and values in here alive
 
     void convertNode(MLNode& m, const HLNode& h, MLNode *parent);
     void convertList(HLNode& list);
@@ -219,7 +295,7 @@ private:
         size_t n;
     };
 
-    void _construct(Queue<Cons>& q, MLNode *dst, const HLNode *hl); // may reallocate dst
+    void _construct(Queue<Cons>& q, MLNode *dst, const HLNode *hl, const StringPool& sp); // may reallocate dst
     void _cons(Queue<Cons>& q, MLNode *dst, const HLNode *hl);
 
     MLNode *_add(size_t n); // add a couple nodes to the end as one block; points to first node.
@@ -229,5 +305,7 @@ private:
 
     sref _decllist(Queue<Cons>& q, MLNode *& dst, const HLNode *decllist);
     void _opr(Queue<Cons>& q, MLNode *& dst, OperatorId op, const HLNode *hl);
+    // Copy the tree at src to dst, with ML_VARs of symids firstparam ..< firstparam+nparams replaced by copies of args[]
+    bool _copyTree(size_t dst, size_t src, u32 firstparam, size_t nparams, const u32 *args); // may reallocate nodes[]
 
 };
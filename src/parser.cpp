@@ -92,13 +92,15 @@ const char* Parser::symbolname(const Symstore::Sym* sym) const
 
 Val Parser::makestr(const char *s, const char *end)
 {
-    Str q = strpool.put(s, end - s);
-    return Val(q);
+    return strpool.putval(s, end - s);
 }
 
 Str Parser::_tokenStr(const Lexer::Token& tok)
 {
-    return strpool.put(tok.begin, tok.u.len);
+    // The lexer already hashed identifiers
+    return tok.tt == Lexer::TOK_IDENT
+        ? strpool.put(tok.begin, tok.u.len, tok.h)
+        : strpool.put(tok.begin, tok.u.len);
 }
 
 Str Parser::_identStr(const Lexer::Token& tok)
@@ -251,12 +253,24 @@ const Parser::ParseRule * Parser::GetRule(Lexer::TokenType tok)
     return NULL;
 }
 
+static void markSyms(Runtime& rt, const void *ud)
+{
+    static_cast<const Symstore*>(ud)->mark(rt);
+}
+
 Parser::Parser(Lexer* lex, const char *fn, GC& gc, StringPool& strpool)
-    : hlir(NULL), strpool(strpool), _lex(lex), _fn(fn), hadError(false), panic(false), gc(gc)
+    : hlir(NULL), strpool(strpool), _lex(lex), _fn(fn), hadError(false), panic(false), gc(gc), _symroot()
 {
     curtok.tt = Lexer::TOK_E_ERROR;
     prevtok.tt = Lexer::TOK_E_ERROR;
     lookahead.tt = Lexer::TOK_E_UNDEF;
+    lex->setStringPool(&strpool);
+    gc_addroot(gc, _symroot, markSyms, &syms);
+}
+
+Parser::~Parser()
+{
+    gc_removeroot(gc, _symroot);
 }
 
 HLNode *Parser::parse()
@@ -374,10 +388,37 @@ HLNode* Parser::_export()
         }
 
         ret->u.exprt.what = decl();
+        _markExported(ret->u.exprt.what);
     }
     return ret;
 }
 
+// Flag the symbols introduced by a declaration as exported
+void Parser::_markExported(HLNode *node)
+{
+    if(!node)
+        return;
+    switch(node->type)
+    {
+        case HLNODE_VARDECLASSIGN:
+            if(const HLNode *decls = node->u.vardecllist.decllist)
+                for(size_t i = 0; i < decls->u.list.used; ++i)
+                    _markExported(decls->u.list.list[i]->as<HLVarDef>()->ident);
+            break;
+
+        case HLNODE_FUNCDECL:
+            if(!node->u.funcdecl.namespac) // Methods belong to something else
+                _markExported(node->u.funcdecl.ident);
+            break;
+
+        case HLNODE_IDENT:
+            syms.getsym(node->u.ident.symid)->referencedHow |= SYMREF_EXPORTED;
+            break;
+
+        default: ;
+    }
+}
+
 HLNode *Parser::parsePrecedence(Prec p)
 {
     const ParseRule *rule = GetRule(curtok.tt);
@@ -505,16 +546,15 @@ void Parser::_endFunction()
             }
         }
 
-        if(f.boundary < SCOPE_FILE)
+        // The file itself is parsed as a function too (see parse()), but its symbols can be exported
+        if(f.boundary < SCOPE_FILE && syms.depth())
         {
             if(sym->referencedHow & SYMREF_EXPORTED)
             {
                 const char *name = symbolname(sym);
                 std::ostringstream os;
                 os << "'" << name << "': Can't export locals declared inside functions";
-                errorAt(sym->firstuse, os.str().c_str(), "Move this to file scope");
-                panic = false;
-                errorAt(sym->tok, "(Originally declared here)");
+                errorAt(sym->tok, os.str().c_str(), "Move this to file scope");
             }
         }
     }
@@ -586,6 +626,7 @@ HLNode* Parser::_functiondef(HLNode **pname, HLNode **pnamespac)
         selftok.begin = "self";
         selftok.u.len = 4;
         selftok.tt = Lexer::TOK_IDENT;
+        selftok.h = strpool.hash(selftok.begin, selftok.u.len);
         self->u.vardef.ident = _ident(selftok, "implicit 'self' in method def", IDENT_USAGE_DECL, SYMREF_VISIBLE);
         self->u.vardef.type = ns;
         list->list[0] = self;
@@ -1131,8 +1172,7 @@ HLNode* Parser::_suffixed(HLNode *prefix)
                 // Convert t.x to t["x"]
                 sref str = rhs->u.name.nameStrId;
                 rhs->unsafemorph<HLConstantValue>();
-                rhs->u.constant.val.u.str = str;
-                rhs->u.constant.val.type = PRIMTYPE_STRING;
+                rhs->u.constant.val = strpool.refval(str);
                 next->u.index.idx = rhs;
             }
             break;
@@ -1196,7 +1236,7 @@ HLNode* Parser::nameAsLitstr(const char* whatfor)
     {
         sref strid = n->u.name.nameStrId;
         n->type = HLNODE_CONSTANT_VALUE;
-        n->u.constant.val = Val(_Str(strid));
+        n->u.constant.val = strpool.refval(strid);
     }
     return n;
 }
@@ -1293,8 +1333,8 @@ HLNode * Parser::binary(Context ctx, const Parser::ParseRule *rule, HLNode *lhs)
     if(node)
     {
         node->tok = rule->tok;
-        node->u.binary.a = rhs;
-        node->u.binary.b = lhs;
+        node->u.binary.a = lhs;
+        node->u.binary.b = rhs;
         node->u.binary.opid = Lexer::TokenToBinOp(rule->tok);
     }
     return node;
@@ -1380,7 +1420,7 @@ void Parser::eatmatching(Lexer::TokenType tt, const Lexer::Token& begintok)
     }
 
     char buf[64], hint[64];
-    sprintf(&buf[0], "Expected to close %c in line %u", *begintok.begin, begintok.line);
+    sprintf(&buf[0], "Expected to close %s in line %u", Lexer::GetTokenText(begintok.tt), begintok.line);
     errorAt(curtok, &buf[0]);
 
     sprintf(&buf[0], "'%s' expected", Lexer::GetTokenText(tt));
@@ -1398,7 +1438,7 @@ void Parser::errorAt(const Lexer::Token& tok, const char *msg, const char *hint)
 
     const char * const beg = tok.linebegin; //_lex->getLineBegin();
     assert(beg);
-    if(beg <= tok.begin)
+    if(beg <= tok.begin && _lex->isLive(tok)) // When streaming, the text of old tokens may be gone
     {
         const char *p = beg;
         for( ; *p && *p != '\r' && *p != '\n'; ++p) {}
@@ -1469,7 +1509,7 @@ HLNode* Parser::tablecons(Context ctx)
 
             if(lookahead.tt == Lexer::TOK_CASSIGN)
             {
-                key = name("key"); // key=...
+                key = nameAsLitstr("key"); // key=...
                 eat(Lexer::TOK_CASSIGN);
             }
             // else it's a single var lookup; handle as expr
@@ -57,6 +57,7 @@ public:
     };
 
     Parser(Lexer *lex, const char *fn, GC& gc, StringPool& strpool);
+    ~Parser();
     HLNode *parse();
     //std::vector<Val> constants;
 
@@ -113,6 +114,7 @@ protected:
     HLNode *suffixedexpr();
     HLNode *_suffixed(HLNode *prefix);
     HLNode *_export();
+    void _markExported(HLNode *node);
 
     // prefixexpr { .ident | [expr] | :ident paramlist | paramlist }
 
@@ -180,6 +182,7 @@ private:
 public:
     Symstore syms;
 private:
+    GCroot _symroot; // syms is a GC root while the parser exists
 
     typedef HLNode* (Parser::*UnaryMth)(Context ctx);
     typedef HLNode* (Parser::*InfixMth)(Context ctx, const ParseRule *rule, HLNode *prefix);
@@ -0,0 +1,462 @@
+#include "rtarray.h"
+#include "array.h"
+#include "gavm.h"
+#include "runtime.h"
+
+// SSE2 is part of the x86-64 baseline, so there's no point in detecting it at runtime.
+// Only the float kernels use it; the integer loops are simple enough that the compiler vectorizes them.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define GA_ARRAY_SSE2
+#  include <emmintrin.h>
+#endif
+
+// ---- Scalar kernels ----
+// Manually unrolled with independent accumulators so that the loop-carried
+// dependency doesn't stall the pipeline (and to help the autovectorizer).
+
+template<typename T>
+static T k_sum(const T *a, tsize n)
+{
+    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    tsize i = 0;
+    for( ; i + 4 <= n; i += 4)
+    {
+        s0 += a[i];
+        s1 += a[i+1];
+        s2 += a[i+2];
+        s3 += a[i+3];
+    }
+    for( ; i < n; ++i)
+        s0 += a[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+template<typename T>
+static T k_dot(const T *a, const T *b, tsize n)
+{
+    T s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    tsize i = 0;
+    for( ; i + 4 <= n; i += 4)
+    {
+        s0 += a[i] * b[i];
+        s1 += a[i+1] * b[i+1];
+        s2 += a[i+2] * b[i+2];
+        s3 += a[i+3] * b[i+3];
+    }
+    for( ; i < n; ++i)
+        s0 += a[i] * b[i];
+    return (s0 + s1) + (s2 + s3);
+}
+
+template<typename T> static FORCEINLINE T pickmin(T a, T b) { return a < b ? a : b; }
+template<typename T> static FORCEINLINE T pickmax(T a, T b) { return b < a ? a : b; }
+
+template<typename T, T (*Pick)(T, T)>
+static T k_minmax(const T *a, tsize n)
+{
+    assert(n);
+    T m = a[0];
+    for(tsize i = 1; i < n; ++i)
+        m = Pick(a[i], m);
+    return m;
+}
+
+template<typename T>
+static void k_fill(T *a, tsize n, T x)
+{
+    for(tsize i = 0; i < n; ++i)
+        a[i] = x;
+}
+
+template<typename T>
+static void k_scale(T *a, tsize n, T k)
+{
+    for(tsize i = 0; i < n; ++i)
+        a[i] *= k;
+}
+
+template<typename T>
+static void k_offset(T *a, tsize n, T k)
+{
+    for(tsize i = 0; i < n; ++i)
+        a[i] += k;
+}
+
+template<typename T>
+static void k_axpy(T *y, tsize n, T k, const T *x)
+{
+    for(tsize i = 0; i < n; ++i)
+        y[i] += k * x[i];
+}
+
+struct CmpLT { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a < b; } };
+struct CmpLE { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a <= b; } };
+struct CmpGT { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a > b; } };
+struct CmpGE { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a >= b; } };
+struct CmpEQ { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a == b; } };
+struct CmpNE { template<typename T> static FORCEINLINE bool Do(T a, T b) { return a != b; } };
+
+template<typename Cmp, typename T>
+static void k_cmp(u32 *dst, const T *a, tsize n, T x)
+{
+    for(tsize i = 0; i < n; ++i)
+        dst[i] = Cmp::Do(a[i], x);
+}
+
+template<typename T>
+static tsize k_find(const T *a, tsize n, T x)
+{
+    for(tsize i = 0; i < n; ++i)
+        if(a[i] == x)
+            return i;
+    return n;
+}
+
+// ---- SSE2 float kernels ----
+#ifdef GA_ARRAY_SSE2
+
+static FORCEINLINE float hsum(__m128 v)
+{
+    __m128 t = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    t = _mm_add_ss(t, _mm_shuffle_ps(t, t, 1));
+    return _mm_cvtss_f32(t);
+}
+
+template<> real k_sum<real>(const real *a, tsize n)
+{
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    tsize i = 0;
+    for( ; i + 8 <= n; i += 8)
+    {
+        s0 = _mm_add_ps(s0, _mm_loadu_ps(a + i));
+        s1 = _mm_add_ps(s1, _mm_loadu_ps(a + i + 4));
+    }
+    real s = hsum(_mm_add_ps(s0, s1));
+    for( ; i < n; ++i)
+        s += a[i];
+    return s;
+}
+
+template<> real k_dot<real>(const real *a, const real *b, tsize n)
+{
+    __m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+    tsize i = 0;
+    for( ; i + 8 <= n; i += 8)
+    {
+        s0 = _mm_add_ps(s0, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+        s1 = _mm_add_ps(s1, _mm_mul_ps(_mm_loadu_ps(a + i + 4), _mm_loadu_ps(b + i + 4)));
+    }
+    real s = hsum(_mm_add_ps(s0, s1));
+    for( ; i < n; ++i)
+        s += a[i] * b[i];
+    return s;
+}
+
+// _mm_min_ps(x, m) is exactly (x < m ? x : m) per lane, so NaN handling matches pickmin()
+static real k_minf(const real *a, tsize n)
+{
+    if(n < 8)
+        return k_minmax<real, pickmin<real> >(a, n);
+    __m128 m = _mm_loadu_ps(a);
+    tsize i = 4;
+    for( ; i + 4 <= n; i += 4)
+        m = _mm_min_ps(_mm_loadu_ps(a + i), m);
+    float tmp[4];
+    _mm_storeu_ps(tmp, m);
+    real r = k_minmax<real, pickmin<real> >(tmp, 4);
+    for( ; i < n; ++i)
+        r = pickmin(a[i], r);
+    return r;
+}
+
+// _mm_max_ps(x, m) is (x > m ? x : m), same as pickmax(x, m)
+static real k_maxf(const real *a, tsize n)
+{
+    if(n < 8)
+        return k_minmax<real, pickmax<real> >(a, n);
+    __m128 m = _mm_loadu_ps(a);
+    tsize i = 4;
+    for( ; i + 4 <= n; i += 4)
+        m = _mm_max_ps(_mm_loadu_ps(a + i), m);
+    float tmp[4];
+    _mm_storeu_ps(tmp, m);
+    real r = k_minmax<real, pickmax<real> >(tmp, 4);
+    for( ; i < n; ++i)
+        r = pickmax(a[i], r);
+    return r;
+}
+
+template<> tsize k_find<real>(const real *a, tsize n, real x)
+{
+    const __m128 vx = _mm_set1_ps(x);
+    tsize i = 0;
+    for( ; i + 4 <= n; i += 4)
+    {
+        const int m = _mm_movemask_ps(_mm_cmpeq_ps(_mm_loadu_ps(a + i), vx));
+        if(m)
+            return i + (m & 1 ? 0 : m & 2 ? 1 : m & 4 ? 2 : 3);
+    }
+    for( ; i < n; ++i)
+        if(a[i] == x)
+            return i;
+    return n;
+}
+
+// Compare ops produce all-ones or all-zero lanes; mask with 1 to get proper bools
+template<typename Cmp> static FORCEINLINE __m128 cmpps(__m128 a, __m128 b);
+template<> FORCEINLINE __m128 cmpps<CmpLT>(__m128 a, __m128 b) { return _mm_cmplt_ps(a, b); }
+template<> FORCEINLINE __m128 cmpps<CmpLE>(__m128 a, __m128 b) { return _mm_cmple_ps(a, b); }
+template<> FORCEINLINE __m128 cmpps<CmpGT>(__m128 a, __m128 b) { return _mm_cmpgt_ps(a, b); }
+template<> FORCEINLINE __m128 cmpps<CmpGE>(__m128 a, __m128 b) { return _mm_cmpge_ps(a, b); }
+template<> FORCEINLINE __m128 cmpps<CmpEQ>(__m128 a, __m128 b) { return _mm_cmpeq_ps(a, b); }
+template<> FORCEINLINE __m128 cmpps<CmpNE>(__m128 a, __m128 b) { return _mm_cmpneq_ps(a, b); }
+
+template<typename Cmp>
+static void k_cmpf(u32 *dst, const real *a, tsize n, real x)
+{
+    const __m128 vx = _mm_set1_ps(x);
+    const __m128i one = _mm_set1_epi32(1);
+    tsize i = 0;
+    for( ; i + 4 <= n; i += 4)
+    {
+        const __m128i m = _mm_castps_si128(cmpps<Cmp>(_mm_loadu_ps(a + i), vx));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_and_si128(m, one));
+    }
+    for( ; i < n; ++i)
+        dst[i] = Cmp::Do(a[i], x);
+}
+
+#else // !GA_ARRAY_SSE2
+
+static real k_minf(const real *a, tsize n) { return k_minmax<real, pickmin<real> >(a, n); }
+static real k_maxf(const real *a, tsize n) { return k_minmax<real, pickmax<real> >(a, n); }
+template<typename Cmp>
+static void k_cmpf(u32 *dst, const real *a, tsize n, real x) { k_cmp<Cmp>(dst, a, n, x); }
+
+#endif
+
+// ---- Script bindings ----
+
+// Raw elements of a numeric array or contiguous view
+struct NumSpan
+{
+    union
+    {
+        uint *ui;
+        sint *si;
+        real *f;
+        void *p;
+    };
+    tsize n;
+    Type t;
+};
+
+// TODO: strided views are rejected for now; copy or add strided kernels if this turns out to be needed
+static bool numspan(NumSpan& s, const Val& v)
+{
+    const DArray *a = static_cast<const DArray*>(v.asAnyObj(PRIMTYPE_ARRAY));
+    if(!a || !(a->t == PRIMTYPE_UINT || a->t == PRIMTYPE_SINT || a->t == PRIMTYPE_FLOAT))
+        return false;
+    s.p = a->contiguousData();
+    s.n = a->sz;
+    s.t = a->t;
+    return s.p || !s.n;
+}
+
+int arr_sum(VM *, Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]))
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    if(!n)
+        v[0] = _Nil();
+    else switch(a.t)
+    {
+        case PRIMTYPE_UINT:  v[0] = Val(k_sum(a.ui, n)); break;
+        case PRIMTYPE_SINT:  v[0] = Val(k_sum(a.si, n)); break;
+        case PRIMTYPE_FLOAT: v[0] = Val(k_sum(a.f, n)); break;
+    }
+    return 1;
+}
+
+int arr_min(VM *, Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]))
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    if(!n)
+        v[0] = _Nil();
+    else switch(a.t)
+    {
+        case PRIMTYPE_UINT:  v[0] = Val(k_minmax<uint, pickmin<uint> >(a.ui, n)); break;
+        case PRIMTYPE_SINT:  v[0] = Val(k_minmax<sint, pickmin<sint> >(a.si, n)); break;
+        case PRIMTYPE_FLOAT: v[0] = Val(k_minf(a.f, n)); break;
+    }
+    return 1;
+}
+
+int arr_max(VM *, Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]))
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    if(!n)
+        v[0] = _Nil();
+    else switch(a.t)
+    {
+        case PRIMTYPE_UINT:  v[0] = Val(k_minmax<uint, pickmax<uint> >(a.ui, n)); break;
+        case PRIMTYPE_SINT:  v[0] = Val(k_minmax<sint, pickmax<sint> >(a.si, n)); break;
+        case PRIMTYPE_FLOAT: v[0] = Val(k_maxf(a.f, n)); break;
+    }
+    return 1;
+}
+
+int arr_dot(VM *, Val *v)
+{
+    NumSpan a, b;
+    if(!numspan(a, v[0]) || !numspan(b, v[1]) || a.t != b.t)
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    if(n != b.n)
+        return RTE_SIZE_MISMATCH;
+    if(!n)
+        v[0] = _Nil();
+    else switch(a.t)
+    {
+        case PRIMTYPE_UINT:  v[0] = Val(k_dot(a.ui, b.ui, n)); break;
+        case PRIMTYPE_SINT:  v[0] = Val(k_dot(a.si, b.si, n)); break;
+        case PRIMTYPE_FLOAT: v[0] = Val(k_dot(a.f, b.f, n)); break;
+    }
+    return 1;
+}
+
+// Shared by the ops that take an array and a scalar of the array's element type
+template<void (*UI)(uint*, tsize, uint), void (*SI)(sint*, tsize, sint), void (*F)(real*, tsize, real)>
+static int inplace(Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]) || v[1].type != a.t)
+        return RTE_VALUE_CAST;
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:  UI(a.ui, a.n, v[1].u.ui); break;
+        case PRIMTYPE_SINT:  SI(a.si, a.n, v[1].u.si); break;
+        case PRIMTYPE_FLOAT: F(a.f, a.n, v[1].u.f); break;
+    }
+    return 0;
+}
+
+int arr_fill(VM *, Val *v)
+{
+    return inplace<k_fill<uint>, k_fill<sint>, k_fill<real> >(v);
+}
+
+int arr_scale(VM *, Val *v)
+{
+    return inplace<k_scale<uint>, k_scale<sint>, k_scale<real> >(v);
+}
+
+int arr_offset(VM *, Val *v)
+{
+    return inplace<k_offset<uint>, k_offset<sint>, k_offset<real> >(v);
+}
+
+int arr_axpy(VM *, Val *v)
+{
+    NumSpan y, x;
+    if(!numspan(y, v[0]) || !numspan(x, v[2]) || y.t != x.t || v[1].type != y.t)
+        return RTE_VALUE_CAST;
+    const tsize n = y.n;
+    if(n != x.n)
+        return RTE_SIZE_MISMATCH;
+    switch(y.t)
+    {
+        case PRIMTYPE_UINT:  k_axpy(y.ui, n, v[1].u.ui, x.ui); break;
+        case PRIMTYPE_SINT:  k_axpy(y.si, n, v[1].u.si, x.si); break;
+        case PRIMTYPE_FLOAT: k_axpy(y.f, n, v[1].u.f, x.f); break;
+    }
+    return 0;
+}
+
+template<typename Cmp>
+static int cmpmask(VM *vm, Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]) || v[1].type != a.t)
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    DArray *m = DArray::GCNew(vm->rt->gc, n, PRIMTYPE_BOOL);
+    if(!m)
+        return RTE_ALLOC_FAIL;
+    u32 *dst = (u32*)m->storage.p;
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:  k_cmp<Cmp>(dst, a.ui, n, v[1].u.ui); break;
+        case PRIMTYPE_SINT:  k_cmp<Cmp>(dst, a.si, n, v[1].u.si); break;
+        case PRIMTYPE_FLOAT: k_cmpf<Cmp>(dst, a.f, n, v[1].u.f); break;
+    }
+    m->sz = n;
+    v[0].type = PRIMTYPE_ARRAY;
+    v[0].u.obj = m;
+    return 1;
+}
+
+int arr_lt(VM *vm, Val *v) { return cmpmask<CmpLT>(vm, v); }
+int arr_le(VM *vm, Val *v) { return cmpmask<CmpLE>(vm, v); }
+int arr_gt(VM *vm, Val *v) { return cmpmask<CmpGT>(vm, v); }
+int arr_ge(VM *vm, Val *v) { return cmpmask<CmpGE>(vm, v); }
+int arr_eq(VM *vm, Val *v) { return cmpmask<CmpEQ>(vm, v); }
+int arr_ne(VM *vm, Val *v) { return cmpmask<CmpNE>(vm, v); }
+
+int arr_find(VM *, Val *v)
+{
+    NumSpan a;
+    if(!numspan(a, v[0]) || v[1].type != a.t)
+        return RTE_VALUE_CAST;
+    const tsize n = a.n;
+    tsize i = n;
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:  i = k_find(a.ui, n, v[1].u.ui); break;
+        case PRIMTYPE_SINT:  i = k_find(a.si, n, v[1].u.si); break;
+        case PRIMTYPE_FLOAT: i = k_find(a.f, n, v[1].u.f); break;
+    }
+    if(i < n)
+        v[0] = Val(uint(i));
+    else
+        v[0] = _Nil();
+    return 1;
+}
+
+static int mkview(VM *vm, Val *v, tsize stride)
+{
+    DArray *a = static_cast<DArray*>(v[0].asAnyObj(PRIMTYPE_ARRAY));
+    if(!a || v[1].type != PRIMTYPE_UINT || v[2].type != PRIMTYPE_UINT)
+        return RTE_VALUE_CAST;
+    const uint offs = v[1].u.ui, len = v[2].u.ui;
+    if(len && (offs >= a->sz || (a->sz - 1 - offs) / stride < len - 1))
+        return RTE_SIZE_MISMATCH; // view would reach past the end
+    DArray *w = DArray::GCNewView(vm->rt->gc, a, tsize(offs), tsize(len), stride);
+    if(!w)
+        return RTE_ALLOC_FAIL;
+    v[0].u.obj = w;
+    return 1;
+}
+
+int arr_slice(VM *vm, Val *v)
+{
+    return mkview(vm, v, 1);
+}
+
+int arr_view(VM *vm, Val *v)
+{
+    if(v[3].type != PRIMTYPE_UINT)
+        return RTE_VALUE_CAST;
+    const uint stride = v[3].u.ui;
+    if(!stride || stride > tsize(-1))
+        return RTE_SIZE_MISMATCH;
+    return mkview(vm, v, tsize(stride));
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+// Bulk operations on typed arrays, exposed to scripts as methods of 'array'.
+// They work directly on DArray storage and support the numeric element types uint, sint, float.
+// Arrays of other element types (including 'any') fail with RTE_VALUE_CAST.
+// Views can be passed too, as long as they are contiguous (stride 1).
+// Integer arithmetic wraps around, like the scalar ops do.
+
+#include "gaobj.h"
+
+// --- Reductions. Return nil for an empty array. ---
+int arr_sum(VM *vm, Val *v);  // (a) -> elem. Float summation order is unspecified.
+int arr_min(VM *vm, Val *v);  // (a) -> elem
+int arr_max(VM *vm, Val *v);  // (a) -> elem
+int arr_dot(VM *vm, Val *v);  // (a, b) -> elem. Both arrays must have the same element type and size.
+
+// --- In-place modification. No return value. ---
+int arr_fill(VM *vm, Val *v);   // (a, x): a[i] = x
+int arr_scale(VM *vm, Val *v);  // (a, k): a[i] *= k
+int arr_offset(VM *vm, Val *v); // (a, k): a[i] += k
+int arr_axpy(VM *vm, Val *v);   // (y, k, x): y[i] += k * x[i]
+
+// --- Compare each element to a constant, returns a new array of bool. ---
+int arr_lt(VM *vm, Val *v); // (a, x) -> [a[i] < x]
+int arr_le(VM *vm, Val *v);
+int arr_gt(VM *vm, Val *v);
+int arr_ge(VM *vm, Val *v);
+int arr_eq(VM *vm, Val *v);
+int arr_ne(VM *vm, Val *v);
+
+// (a, x) -> index of the first element equal to x, or nil
+int arr_find(VM *vm, Val *v);
+
+// --- Views. Don't copy, any element type. ---
+int arr_slice(VM *vm, Val *v); // (a, offset, len) -> view of a[offset ..< offset+len]
+int arr_view(VM *vm, Val *v);  // (a, offset, len, stride) -> view of every stride-th element, starting at a[offset]
@@ -320,7 +320,7 @@ struct WrappedUnOp : WrappedBase<RT, IT, ST>
 
 
 template<typename T, typename TDef<T>::CompBin F, OperatorId opid>
-struct WrappedBinComp : WrappedBase<bool, bool, T>
+struct WrappedBinComp : WrappedBase<bool, T, T>
 {
     static VMFUNC_MTH_IMM(Op, Imm_3xu32)
     {
@@ -0,0 +1,11 @@
+#pragma once
+
+class SymTable;
+struct Runtime;
+
+// Operators of primitive types, as pure leaf functions that can also run at compile time.
+// Each is registered under its GetOperatorName() in the namespace of its first operand's type.
+void reg_uint_ops(SymTable& syms, Runtime& rt);
+void reg_sint_ops(SymTable& syms, Runtime& rt);
+void reg_float_ops(SymTable& syms, Runtime& rt);
+void reg_bool_ops(SymTable& syms, Runtime& rt);
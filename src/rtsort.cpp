@@ -0,0 +1,838 @@
+#include "rtsort.h"
+#include "array.h"
+#include "gavm.h"
+#include "runtime.h"
+#include "gc.h"
+#include <string.h>
+
+// Sorting strategy:
+// - uint/sint: LSD radix sort (stable). Small arrays use insertion sort.
+// - float, string: pattern-defeating quicksort (https://github.com/orlp/pdqsort) for unstable sorting,
+//   bottom-up merge sort for stable sorting.
+// - Strings are first turned into (8-byte big-endian prefix, ref) pairs so that most comparisons
+//   don't have to look at the actual string contents.
+
+enum
+{
+    INSERTION_THRESHOLD = 24,
+    NINTHER_THRESHOLD = 128,
+    PARTIAL_INSERTION_LIMIT = 8,
+    MERGE_RUN = 16,
+    RADIX_THRESHOLD = 64
+};
+
+template<typename T> static FORCEINLINE void swp(T& a, T& b) { T tmp = a; a = b; b = tmp; }
+
+static unsigned log2floor(size_t n)
+{
+    unsigned r = 0;
+    while(n >>= 1)
+        ++r;
+    return r;
+}
+
+// ---- Comparators ----
+
+template<typename T>
+struct LessNum
+{
+    FORCEINLINE bool operator()(T a, T b) const { return a < b; }
+};
+
+// Strict weak ordering also in the presence of NaN (NaNs are last). Required by the unguarded loops below.
+struct LessFloat
+{
+    FORCEINLINE bool operator()(real a, real b) const { return a < b || (b != b && a == a); }
+};
+
+struct StrKey
+{
+    uint prefix; // first 8 bytes, big endian, zero-padded
+    _AnyValU s; // string value, ref or inline
+};
+
+static uint strprefix(const Strp& s)
+{
+    uint p = 0;
+    const size_t n = s.len < 8 ? s.len : 8;
+    for(size_t i = 0; i < n; ++i)
+        p |= uint((unsigned char)s.s[i]) << (56 - 8*i);
+    return p;
+}
+
+static int strcompare(const Strp& a, const Strp& b)
+{
+    const size_t n = a.len < b.len ? a.len : b.len;
+    if(const int c = memcmp(a.s, b.s, n))
+        return c;
+    return (a.len > b.len) - (a.len < b.len);
+}
+
+struct LessStr
+{
+    const StringPool *sp;
+    FORCEINLINE bool operator()(const StrKey& a, const StrKey& b) const
+    {
+        if(a.prefix != b.prefix)
+            return a.prefix < b.prefix;
+        if(a.s.opaque == b.s.opaque)
+            return false;
+        StrTmp ta, tb;
+        return strcompare(sp->lookupval(a.s, ta), sp->lookupval(b.s, tb)) < 0;
+    }
+};
+
+// Compares indices by what they index
+template<typename T, typename L>
+struct LessIdx
+{
+    const T *keys;
+    L less;
+    FORCEINLINE bool operator()(u32 a, u32 b) const { return less(keys[a], keys[b]); }
+};
+
+// ---- Insertion sort & heapsort ----
+
+template<typename T, typename L>
+static void insertion_sort(T *begin, T *end, const L& less)
+{
+    if(begin == end)
+        return;
+    for(T *cur = begin + 1; cur != end; ++cur)
+    {
+        T *sift = cur;
+        T *sift_1 = cur - 1;
+        if(less(*sift, *sift_1))
+        {
+            const T tmp = *sift;
+            do
+                *sift-- = *sift_1;
+            while(sift != begin && less(tmp, *--sift_1));
+            *sift = tmp;
+        }
+    }
+}
+
+// Assumes *(begin - 1) is <= all elements in [begin, end)
+template<typename T, typename L>
+static void unguarded_insertion_sort(T *begin, T *end, const L& less)
+{
+    if(begin == end)
+        return;
+    for(T *cur = begin + 1; cur != end; ++cur)
+    {
+        T *sift = cur;
+        T *sift_1 = cur - 1;
+        if(less(*sift, *sift_1))
+        {
+            const T tmp = *sift;
+            do
+                *sift-- = *sift_1;
+            while(less(tmp, *--sift_1));
+            *sift = tmp;
+        }
+    }
+}
+
+// Gives up and returns false after moving too many elements
+template<typename T, typename L>
+static bool partial_insertion_sort(T *begin, T *end, const L& less)
+{
+    if(begin == end)
+        return true;
+    size_t limit = 0;
+    for(T *cur = begin + 1; cur != end; ++cur)
+    {
+        T *sift = cur;
+        T *sift_1 = cur - 1;
+        if(less(*sift, *sift_1))
+        {
+            const T tmp = *sift;
+            do
+                *sift-- = *sift_1;
+            while(sift != begin && less(tmp, *--sift_1));
+            *sift = tmp;
+            limit += cur - sift;
+        }
+        if(limit > PARTIAL_INSERTION_LIMIT)
+            return false;
+    }
+    return true;
+}
+
+template<typename T, typename L>
+static void siftdown(T *a, size_t i, size_t n, const L& less)
+{
+    const T e = a[i];
+    for(;;)
+    {
+        size_t c = 2 * i + 1;
+        if(c >= n)
+            break;
+        if(c + 1 < n && less(a[c], a[c + 1]))
+            ++c;
+        if(!less(e, a[c]))
+            break;
+        a[i] = a[c];
+        i = c;
+    }
+    a[i] = e;
+}
+
+template<typename T, typename L>
+static void heapsort(T *begin, T *end, const L& less)
+{
+    const size_t n = end - begin;
+    for(size_t i = n / 2; i--; )
+        siftdown(begin, i, n, less);
+    for(size_t i = n; i-- > 1; )
+    {
+        swp(begin[0], begin[i]);
+        siftdown(begin, 0, i, less);
+    }
+}
+
+// ---- pdqsort ----
+
+// Sorts *a <= *b <= *c
+template<typename T, typename L>
+static FORCEINLINE void sort3(T *a, T *b, T *c, const L& less)
+{
+    if(less(*b, *a))
+        swp(*a, *b);
+    if(less(*c, *b))
+    {
+        swp(*b, *c);
+        if(less(*b, *a))
+            swp(*a, *b);
+    }
+}
+
+// Pivot is *begin. Elements equal to the pivot go to the right.
+// Returns the final position of the pivot; sets 'already' if no elements had to be moved.
+template<typename T, typename L>
+static T *partition_right(T *begin, T *end, const L& less, bool& already)
+{
+    const T pivot = *begin;
+    T *first = begin;
+    T *last = end;
+
+    // The pivot is a median of at least 3 elements, so these loops stop in time
+    while(less(*++first, pivot)) {}
+    if(first - 1 == begin)
+        while(first < last && !less(*--last, pivot)) {}
+    else
+        while(!less(*--last, pivot)) {}
+
+    already = first >= last;
+
+    while(first < last)
+    {
+        swp(*first, *last);
+        while(less(*++first, pivot)) {}
+        while(!less(*--last, pivot)) {}
+    }
+
+    T *pivotpos = first - 1;
+    *begin = *pivotpos;
+    *pivotpos = pivot;
+    return pivotpos;
+}
+
+// Like partition_right(), but elements equal to the pivot go to the left.
+// Used when there are many equal elements; those are then never touched again.
+template<typename T, typename L>
+static T *partition_left(T *begin, T *end, const L& less)
+{
+    const T pivot = *begin;
+    T *first = begin;
+    T *last = end;
+
+    while(less(pivot, *--last)) {}
+    if(last + 1 == end)
+        while(first < last && !less(pivot, *++first)) {}
+    else
+        while(!less(pivot, *++first)) {}
+
+    while(first < last)
+    {
+        swp(*first, *last);
+        while(less(pivot, *--last)) {}
+        while(!less(pivot, *++first)) {}
+    }
+
+    T *pivotpos = last;
+    *begin = *pivotpos;
+    *pivotpos = pivot;
+    return pivotpos;
+}
+
+// Moves the median of some elements to *begin
+template<typename T, typename L>
+static void choosepivot(T *begin, T *end, const L& less)
+{
+    const size_t size = end - begin;
+    const size_t s2 = size / 2;
+    if(size > NINTHER_THRESHOLD)
+    {
+        sort3(begin, begin + s2, end - 1, less);
+        sort3(begin + 1, begin + (s2 - 1), end - 2, less);
+        sort3(begin + 2, begin + (s2 + 1), end - 3, less);
+        sort3(begin + (s2 - 1), begin + s2, begin + (s2 + 1), less);
+        swp(*begin, *(begin + s2));
+    }
+    else
+        sort3(begin + s2, begin, end - 1, less);
+}
+
+template<typename T, typename L>
+static void pdqsort_loop(T *begin, T *end, const L& less, int badallowed, bool leftmost)
+{
+    for(;;)
+    {
+        const size_t size = end - begin;
+        if(size < INSERTION_THRESHOLD)
+        {
+            if(leftmost)
+                insertion_sort(begin, end, less);
+            else
+                unguarded_insertion_sort(begin, end, less);
+            return;
+        }
+
+        choosepivot(begin, end, less);
+
+        // If the element before this partition is equal to the pivot, all elements equal to the
+        // pivot are in this partition. Put them left, they are done.
+        if(!leftmost && !less(*(begin - 1), *begin))
+        {
+            begin = partition_left(begin, end, less) + 1;
+            continue;
+        }
+
+        bool already;
+        T *pivot = partition_right(begin, end, less, already);
+
+        const size_t ls = pivot - begin;
+        const size_t rs = end - (pivot + 1);
+        if(ls < size / 8 || rs < size / 8) // highly unbalanced?
+        {
+            if(!--badallowed)
+            {
+                heapsort(begin, end, less);
+                return;
+            }
+
+            // Break up patterns that might lead to bad pivots
+            if(ls >= INSERTION_THRESHOLD)
+            {
+                swp(begin[0], begin[ls / 4]);
+                swp(pivot[-1], pivot[-ptrdiff_t(ls / 4)]);
+                if(ls > NINTHER_THRESHOLD)
+                {
+                    swp(begin[1], begin[ls / 4 + 1]);
+                    swp(begin[2], begin[ls / 4 + 2]);
+                    swp(pivot[-2], pivot[-ptrdiff_t(ls / 4 + 1)]);
+                    swp(pivot[-3], pivot[-ptrdiff_t(ls / 4 + 2)]);
+                }
+            }
+            if(rs >= INSERTION_THRESHOLD)
+            {
+                swp(pivot[1], pivot[1 + rs / 4]);
+                swp(end[-1], end[-ptrdiff_t(rs / 4)]);
+                if(rs > NINTHER_THRESHOLD)
+                {
+                    swp(pivot[2], pivot[2 + rs / 4]);
+                    swp(pivot[3], pivot[3 + rs / 4]);
+                    swp(end[-2], end[-ptrdiff_t(1 + rs / 4)]);
+                    swp(end[-3], end[-ptrdiff_t(2 + rs / 4)]);
+                }
+            }
+        }
+        else if(already // Probably sorted already? Try to finish cheaply.
+            && partial_insertion_sort(begin, pivot, less)
+            && partial_insertion_sort(pivot + 1, end, less))
+                return;
+
+        // Recurse into the left part, loop on the right part
+        pdqsort_loop(begin, pivot, less, badallowed, leftmost);
+        begin = pivot + 1;
+        leftmost = false;
+    }
+}
+
+template<typename T, typename L>
+static void pdqsort(T *begin, T *end, const L& less)
+{
+    if(end - begin > 1)
+        pdqsort_loop(begin, end, less, log2floor(end - begin), true);
+}
+
+// Introselect with the same partitioning; falls back to heapsort on bad pivots.
+template<typename T, typename L>
+static void nth_element(T *begin, T *nth, T *end, const L& less)
+{
+    int badallowed = 2 * log2floor((end - begin) | 1);
+    while(end - begin >= INSERTION_THRESHOLD)
+    {
+        choosepivot(begin, end, less);
+        bool already;
+        T *pivot = partition_right(begin, end, less, already);
+        if(pivot == nth)
+            return;
+        if(nth < pivot)
+            end = pivot;
+        else
+            begin = pivot + 1;
+        if(!--badallowed)
+        {
+            heapsort(begin, end, less);
+            return;
+        }
+    }
+    insertion_sort(begin, end, less);
+}
+
+// ---- Merge sort (stable) ----
+
+// tmp must have space for n elements
+template<typename T, typename L>
+static void mergesort(T *a, T *tmp, size_t n, const L& less)
+{
+    for(size_t i = 0; i < n; i += MERGE_RUN)
+        insertion_sort(a + i, a + (i + MERGE_RUN < n ? i + MERGE_RUN : n), less);
+
+    T *src = a, *dst = tmp;
+    for(size_t w = MERGE_RUN; w < n; w *= 2)
+    {
+        for(size_t lo = 0; lo < n; lo += 2 * w)
+        {
+            const size_t mid = lo + w < n ? lo + w : n;
+            const size_t hi = lo + 2 * w < n ? lo + 2 * w : n;
+            size_t i = lo, j = mid, k = lo;
+            while(i < mid && j < hi)
+                dst[k++] = less(src[j], src[i]) ? src[j++] : src[i++]; // take from the left on ties
+            while(i < mid)
+                dst[k++] = src[i++];
+            while(j < hi)
+                dst[k++] = src[j++];
+        }
+        swp(src, dst);
+    }
+    if(src != a)
+        memcpy(a, src, n * sizeof(T));
+}
+
+// ---- Radix sort (stable) ----
+
+// Sorts 64-bit keys; flip = 1<<63 for signed keys
+static void radixsort(uint *a, uint *tmp, size_t n, uint flip)
+{
+    tsize hist[8][256];
+    memset(hist, 0, sizeof(hist));
+    for(size_t i = 0; i < n; ++i)
+    {
+        const uint k = a[i] ^ flip;
+        for(unsigned b = 0; b < 8; ++b)
+            ++hist[b][(k >> (8 * b)) & 0xff];
+    }
+
+    uint *src = a, *dst = tmp;
+    for(unsigned b = 0; b < 8; ++b)
+    {
+        const unsigned shift = 8 * b;
+        tsize *h = hist[b];
+        if(h[((src[0] ^ flip) >> shift) & 0xff] == n)
+            continue; // all keys have the same byte here, skip the pass
+
+        tsize sum = 0;
+        for(unsigned i = 0; i < 256; ++i)
+        {
+            const tsize c = h[i];
+            h[i] = sum;
+            sum += c;
+        }
+        for(size_t i = 0; i < n; ++i)
+        {
+            const uint x = src[i];
+            dst[h[((x ^ flip) >> shift) & 0xff]++] = x;
+        }
+        swp(src, dst);
+    }
+    if(src != a)
+        memcpy(a, src, n * sizeof(uint));
+}
+
+// ---- Script bindings ----
+
+struct SortSpan
+{
+    union
+    {
+        uint *ui;
+        sint *si;
+        real *f;
+        _AnyValU *s;
+        void *p;
+    };
+    tsize n;
+    Type t;
+};
+
+// TODO: strided views are rejected for now
+static bool sortspan(SortSpan& s, const Val& v)
+{
+    const DArray *a = static_cast<const DArray*>(v.asAnyObj(PRIMTYPE_ARRAY));
+    if(!a)
+        return false;
+    switch(a->t)
+    {
+        case PRIMTYPE_UINT:
+        case PRIMTYPE_SINT:
+        case PRIMTYPE_FLOAT:
+        case PRIMTYPE_STRING:
+            break;
+        default:
+            return false;
+    }
+    s.p = a->contiguousData();
+    s.n = a->sz;
+    s.t = a->t;
+    return s.p || !s.n;
+}
+
+static StrKey mkstrkey(const StringPool& sp, const _AnyValU& s)
+{
+    StrTmp tmp;
+    StrKey k;
+    k.prefix = strprefix(sp.lookupval(s, tmp));
+    k.s = s;
+    return k;
+}
+
+// Returns NULL on alloc fail
+static StrKey *mkstrkeys(GC& gc, const StringPool& sp, const _AnyValU *s, size_t n, size_t extra)
+{
+    StrKey *keys = gc_alloc_unmanaged_T<StrKey>(gc, NULL, 0, n + extra);
+    if(keys)
+        for(size_t i = 0; i < n; ++i)
+            keys[i] = mkstrkey(sp, s[i]);
+    return keys;
+}
+
+static int sortstrings(VM *vm, const SortSpan& a, bool stable)
+{
+    GC& gc = vm->rt->gc;
+    const size_t n = a.n;
+    const size_t extra = stable ? n : 0;
+    StrKey *keys = mkstrkeys(gc, vm->rt->sp, a.s, n, extra);
+    if(!keys)
+        return RTE_ALLOC_FAIL;
+
+    const LessStr less = { &vm->rt->sp };
+    if(stable)
+        mergesort(keys, keys + n, n, less);
+    else
+        pdqsort(keys, keys + n, less);
+
+    for(size_t i = 0; i < n; ++i)
+        a.s[i] = keys[i].s;
+
+    gc_alloc_unmanaged_T<StrKey>(gc, keys, n + extra, 0);
+    return 0;
+}
+
+static int sortints(VM *vm, const SortSpan& a)
+{
+    const size_t n = a.n;
+    uint *p = (uint*)a.p;
+    const uint flip = a.t == PRIMTYPE_SINT ? uint(1) << 63u : 0;
+    if(n < RADIX_THRESHOLD)
+    {
+        if(flip)
+            insertion_sort(a.si, a.si + n, LessNum<sint>());
+        else
+            insertion_sort(a.ui, a.ui + n, LessNum<uint>());
+        return 0;
+    }
+
+    GC& gc = vm->rt->gc;
+    uint *tmp = gc_alloc_unmanaged_T<uint>(gc, NULL, 0, n);
+    if(!tmp)
+        return RTE_ALLOC_FAIL;
+    radixsort(p, tmp, n, flip);
+    gc_alloc_unmanaged_T<uint>(gc, tmp, n, 0);
+    return 0;
+}
+
+static int dosort(VM *vm, Val *v, bool stable)
+{
+    SortSpan a;
+    if(!sortspan(a, v[0]))
+        return RTE_VALUE_CAST;
+    if(a.n < 2)
+        return 0;
+
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:
+        case PRIMTYPE_SINT:
+            return sortints(vm, a); // always stable
+
+        case PRIMTYPE_FLOAT:
+            if(!stable)
+            {
+                pdqsort(a.f, a.f + a.n, LessFloat());
+                return 0;
+            }
+            else
+            {
+                GC& gc = vm->rt->gc;
+                real *tmp = gc_alloc_unmanaged_T<real>(gc, NULL, 0, a.n);
+                if(!tmp)
+                    return RTE_ALLOC_FAIL;
+                mergesort(a.f, tmp, a.n, LessFloat());
+                gc_alloc_unmanaged_T<real>(gc, tmp, a.n, 0);
+                return 0;
+            }
+
+        case PRIMTYPE_STRING:
+            return sortstrings(vm, a, stable);
+    }
+
+    assert(false);
+    return RTE_VALUE_CAST;
+}
+
+int arr_sort(VM *vm, Val *v)
+{
+    return dosort(vm, v, false);
+}
+
+int arr_stable_sort(VM *vm, Val *v)
+{
+    return dosort(vm, v, true);
+}
+
+// Partial sort is nth_element() followed by sorting the part before
+static int doselect(VM *vm, Val *v, bool sortprefix)
+{
+    SortSpan a;
+    if(!sortspan(a, v[0]) || v[1].type != PRIMTYPE_UINT)
+        return RTE_VALUE_CAST;
+    const uint k = v[1].u.ui;
+    if(k > a.n || (!sortprefix && k == a.n))
+        return RTE_SIZE_MISMATCH;
+    const size_t n = a.n;
+    if(n < 2)
+        return 0;
+    if(k == n)
+        return dosort(vm, v, false);
+
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:
+        {
+            const LessNum<uint> less;
+            nth_element(a.ui, a.ui + k, a.ui + n, less);
+            if(sortprefix)
+                pdqsort(a.ui, a.ui + k, less);
+            return 0;
+        }
+        case PRIMTYPE_SINT:
+        {
+            const LessNum<sint> less;
+            nth_element(a.si, a.si + k, a.si + n, less);
+            if(sortprefix)
+                pdqsort(a.si, a.si + k, less);
+            return 0;
+        }
+        case PRIMTYPE_FLOAT:
+        {
+            const LessFloat less;
+            nth_element(a.f, a.f + k, a.f + n, less);
+            if(sortprefix)
+                pdqsort(a.f, a.f + k, less);
+            return 0;
+        }
+        case PRIMTYPE_STRING:
+        {
+            GC& gc = vm->rt->gc;
+            StrKey *keys = mkstrkeys(gc, vm->rt->sp, a.s, n, 0);
+            if(!keys)
+                return RTE_ALLOC_FAIL;
+            const LessStr less = { &vm->rt->sp };
+            nth_element(keys, keys + k, keys + n, less);
+            if(sortprefix)
+                pdqsort(keys, keys + k, less);
+            for(size_t i = 0; i < n; ++i)
+                a.s[i] = keys[i].s;
+            gc_alloc_unmanaged_T<StrKey>(gc, keys, n, 0);
+            return 0;
+        }
+    }
+
+    assert(false);
+    return RTE_VALUE_CAST;
+}
+
+int arr_partial_sort(VM *vm, Val *v)
+{
+    return doselect(vm, v, true);
+}
+
+int arr_nth_element(VM *vm, Val *v)
+{
+    return doselect(vm, v, false);
+}
+
+// Index of the first element that is not less than x
+template<typename T, typename L>
+static size_t lowerbound(const T *a, size_t n, const T& x, const L& less)
+{
+    size_t lo = 0;
+    while(n)
+    {
+        const size_t half = n / 2;
+        if(less(a[lo + half], x))
+        {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+    return lo;
+}
+
+// Like lowerbound(), but builds string keys on the fly instead of for the whole array
+static size_t lowerbound_str(const StringPool& sp, const _AnyValU *a, size_t n, const StrKey& x)
+{
+    const LessStr less = { &sp };
+    size_t lo = 0;
+    while(n)
+    {
+        const size_t half = n / 2;
+        if(less(mkstrkey(sp, a[lo + half]), x))
+        {
+            lo += half + 1;
+            n -= half + 1;
+        }
+        else
+            n = half;
+    }
+    return lo;
+}
+
+int arr_binary_search(VM *vm, Val *v)
+{
+    SortSpan a;
+    if(!sortspan(a, v[0]) || v[1].type != a.t)
+        return RTE_VALUE_CAST;
+    const size_t n = a.n;
+    size_t i = n;
+    bool found = false;
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:
+        {
+            const uint x = v[1].u.ui;
+            i = lowerbound(a.ui, n, x, LessNum<uint>());
+            found = i < n && a.ui[i] == x;
+            break;
+        }
+        case PRIMTYPE_SINT:
+        {
+            const sint x = v[1].u.si;
+            i = lowerbound(a.si, n, x, LessNum<sint>());
+            found = i < n && a.si[i] == x;
+            break;
+        }
+        case PRIMTYPE_FLOAT:
+        {
+            const real x = v[1].u.f;
+            const LessFloat less;
+            i = lowerbound(a.f, n, x, less);
+            found = i < n && !less(x, a.f[i]); // also finds NaN
+            break;
+        }
+        case PRIMTYPE_STRING:
+        {
+            const StringPool& sp = vm->rt->sp;
+            const StrKey x = mkstrkey(sp, v[1].u);
+            i = lowerbound_str(sp, a.s, n, x);
+            // Equal contents means equal value, see strings.h. Except for pending strings.
+            StrTmp ta, tb;
+            found = i < n && (a.s[i].opaque == x.s.opaque
+                || ((IsPendingStr(a.s[i]) || IsPendingStr(x.s)) && !strcompare(sp.lookupval(a.s[i], ta), sp.lookupval(x.s, tb))));
+            break;
+        }
+    }
+
+    if(found)
+        v[0] = Val(uint(i));
+    else
+        v[0] = _Nil();
+    return 1;
+}
+
+template<typename T, typename L>
+static void argsort_keys(u32 *idx, u32 *tmp, const T *keys, size_t n, const L& less)
+{
+    const LessIdx<T, L> li = { keys, less };
+    mergesort(idx, tmp, n, li);
+}
+
+int arr_argsort(VM *vm, Val *v)
+{
+    SortSpan a;
+    if(!sortspan(a, v[0]))
+        return RTE_VALUE_CAST;
+    const size_t n = a.n;
+    if(n > u32(-1))
+        return RTE_SIZE_MISMATCH;
+
+    GC& gc = vm->rt->gc;
+    DArray *out = DArray::GCNew(gc, tsize(n), PRIMTYPE_UINT);
+    if(!out)
+        return RTE_ALLOC_FAIL;
+
+    // Sort 32-bit indices to halve the memory traffic, then widen them into the output array
+    u32 *idx = gc_alloc_unmanaged_T<u32>(gc, NULL, 0, 2 * n);
+    if(n && !idx)
+        return RTE_ALLOC_FAIL;
+    for(size_t i = 0; i < n; ++i)
+        idx[i] = u32(i);
+
+    int ret = 1;
+    switch(a.t)
+    {
+        case PRIMTYPE_UINT:  argsort_keys(idx, idx + n, a.ui, n, LessNum<uint>()); break;
+        case PRIMTYPE_SINT:  argsort_keys(idx, idx + n, a.si, n, LessNum<sint>()); break;
+        case PRIMTYPE_FLOAT: argsort_keys(idx, idx + n, a.f, n, LessFloat()); break;
+        case PRIMTYPE_STRING:
+        {
+            StrKey *keys = mkstrkeys(gc, vm->rt->sp, a.s, n, 0);
+            if(!keys)
+            {
+                ret = RTE_ALLOC_FAIL;
+                break;
+            }
+            const LessStr less = { &vm->rt->sp };
+            argsort_keys(idx, idx + n, keys, n, less);
+            gc_alloc_unmanaged_T<StrKey>(gc, keys, n, 0);
+            break;
+        }
+    }
+
+    if(ret > 0)
+    {
+        for(size_t i = 0; i < n; ++i)
+            out->storage.ui[i] = idx[i];
+        out->sz = tsize(n);
+        v[0].u.obj = out;
+    }
+
+    gc_alloc_unmanaged_T<u32>(gc, idx, 2 * n, 0);
+    return ret;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+// Native sorting and searching on typed arrays, exposed to scripts as methods of 'array'.
+// Supported element types: uint, sint, float, string. Views are fine as long as they are contiguous.
+// Floats sort NaNs last. Strings sort by contents (bytewise), not by ref id.
+// All of these sort ascending and work in-place unless noted otherwise.
+
+#include "gaobj.h"
+
+int arr_sort(VM *vm, Val *v);          // (a)
+int arr_stable_sort(VM *vm, Val *v);   // (a)
+int arr_partial_sort(VM *vm, Val *v);  // (a, k): a[0..k) are the k smallest elements, in order. The rest is unspecified.
+int arr_nth_element(VM *vm, Val *v);   // (a, k): a[k] is the element that would be there if a was sorted;
+                                       //         everything before is <=, everything after is >=.
+int arr_binary_search(VM *vm, Val *v); // (a, x) -> index of the first element equal to x, or nil. a must be sorted.
+
+// (a) -> new array of uint indices that would stable-sort a.
+// Leaf functions can't call back into the VM, so instead of sorting with a script comparator,
+// compute a sort key per element and argsort the keys.
+int arr_argsort(VM *vm, Val *v);
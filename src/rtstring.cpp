@@ -0,0 +1,105 @@
+#include "rtstring.h"
+#include "array.h"
+#include "gavm.h"
+#include "runtime.h"
+
+static FORCEINLINE int retstr(Val *v, const Val& s)
+{
+    if(s.type != PRIMTYPE_STRING)
+        return RTE_ALLOC_FAIL;
+    v[0] = s;
+    return 1;
+}
+
+// Short results are built in place and never touch the pool
+static Val finishstr(StrBuilder& sb, StringPool& sp, const char *s, size_t n)
+{
+    if(n <= MAX_INLINE_STR)
+        return Val(MakeInlineStr(s, n), PRIMTYPE_STRING);
+    const Str r = sb.finish(sp);
+    return r.id ? Val(r) : Val(_Nil());
+}
+
+int str_concat(VM *vm, Val *v)
+{
+    if(v[0].type != PRIMTYPE_STRING || v[1].type != PRIMTYPE_STRING)
+        return RTE_VALUE_CAST;
+
+    // Not interned yet; the result of a chain of ++ is only interned once it's needed as a key
+    return retstr(v, vm->rt->sp.concatval(v[0].u, v[1].u));
+}
+
+int str_join(VM *vm, Val *v)
+{
+    const DArray *a = static_cast<const DArray*>(v[0].asAnyObj(PRIMTYPE_ARRAY));
+    if(!a || v[1].type != PRIMTYPE_STRING || (a->t != PRIMTYPE_STRING && a->t != PRIMTYPE_ANY))
+        return RTE_VALUE_CAST;
+
+    StringPool& sp = vm->rt->sp;
+    const tsize n = a->sz;
+    StrTmp tsep, tmp;
+    const Strp sep = sp.lookupval(v[1].u, tsep);
+
+    // Check and measure first so that the buffer is allocated only once
+    size_t total = n ? sep.len * (n - 1) : 0;
+    for(tsize i = 0; i < n; ++i)
+    {
+        const Val e = a->dynamicLookup(i);
+        if(e.type != PRIMTYPE_STRING)
+            return RTE_VALUE_CAST;
+        total += sp.lookupval(e.u, tmp).len;
+    }
+
+    StrBuilder sb(vm->rt->gc);
+    if(!sb.reserve(total))
+        return RTE_ALLOC_FAIL;
+    for(tsize i = 0; i < n; ++i)
+    {
+        if(i)
+            sb.append(sep.s, sep.len);
+        const Strp e = sp.lookupval(a->dynamicLookup(i).u, tmp);
+        sb.append(e.s, e.len);
+    }
+    assert(sb.size() == total);
+    return retstr(v, finishstr(sb, sp, sb.data(), total));
+}
+
+int str_rep(VM *vm, Val *v)
+{
+    if(v[0].type != PRIMTYPE_STRING || v[1].type != PRIMTYPE_UINT)
+        return RTE_VALUE_CAST;
+
+    StringPool& sp = vm->rt->sp;
+    StrTmp tmp;
+    const Strp s = sp.lookupval(v[0].u, tmp);
+    const uint n = v[1].u.ui;
+    if(n == 1)
+        return 1;
+    if(!n || !s.len)
+        return retstr(v, sp.putval("", 0));
+    if(n > size_t(-1) / s.len)
+        return RTE_OVERFLOW;
+
+    StrBuilder sb(vm->rt->gc);
+    if(!sb.reserve(s.len * n))
+        return RTE_ALLOC_FAIL;
+    for(uint i = 0; i < n; ++i)
+        sb.append(s.s, s.len);
+    return retstr(v, finishstr(sb, sp, sb.data(), sb.size()));
+}
+
+int str_eq(VM *vm, Val *v)
+{
+    if(v[0].type != PRIMTYPE_STRING || v[1].type != PRIMTYPE_STRING)
+        return RTE_VALUE_CAST;
+    v[0] = Val(vm->rt->sp.sameval(v[0].u, v[1].u));
+    return 1;
+}
+
+int str_neq(VM *vm, Val *v)
+{
+    if(v[0].type != PRIMTYPE_STRING || v[1].type != PRIMTYPE_STRING)
+        return RTE_VALUE_CAST;
+    v[0] = Val(!vm->rt->sp.sameval(v[0].u, v[1].u));
+    return 1;
+}
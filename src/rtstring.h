@@ -0,0 +1,14 @@
+#pragma once
+
+// String building, exposed to scripts as methods of 'string'.
+// join() and rep() intern at most one new string, no matter how many parts go in (short results aren't interned at all).
+// concat() doesn't intern at all; its result is pending until it's flattened (see strings.h).
+// s = s ++ x in a loop appends to the same buffer, so that's linear too.
+
+#include "gaobj.h"
+
+int str_concat(VM *vm, Val *v); // (a, b) -> a ++ b. Also the ++ operator.
+int str_join(VM *vm, Val *v);   // (parts, sep) -> parts[0] ++ sep ++ parts[1] ++ ... Elements must be strings.
+int str_rep(VM *vm, Val *v);    // (s, n) -> s repeated n times
+int str_eq(VM *vm, Val *v);     // (a, b) -> a == b, by contents. Also the == operator; pending strings are fine.
+int str_neq(VM *vm, Val *v);    // (a, b) -> a != b
@@ -5,6 +5,9 @@
 #include "strings.h"
 #include "gavm.h"
 #include "runtime.h"
+#include "rtarray.h"
+#include "rtsort.h"
+#include "rtstring.h"
 #include <assert.h>
 #include <limits>
 
@@ -263,8 +266,8 @@ VMFUNC_IMM(strlen, Imm_2xu32)
 static int mth_string_len(VM *vm, Val *v)
 {
     assert(v->type == PRIMTYPE_STRING);
-    const sref s = v->u.str;
-    v->u.str = vm->rt->sp.lookup(s).len;
+    StrTmp tmp;
+    v->u.ui = vm->rt->sp.lookupval(v->u, tmp).len;
     v->type = PRIMTYPE_UINT;
     return 1;
 }
@@ -279,6 +282,17 @@ static void reg_type_string(RTReg& r)
         const Type str1[] = { PRIMTYPE_STRING };
         const Type uint1[] = { PRIMTYPE_UINT };
         xstr.method("len", mth_string_len, str1, uint1);
+
+        const Type str2[] = { PRIMTYPE_STRING, PRIMTYPE_STRING };
+        const Type join[] = { PRIMTYPE_ARRAY, PRIMTYPE_STRING };
+        const Type rep[] = { PRIMTYPE_STRING, PRIMTYPE_UINT };
+        const Type bool1[] = { PRIMTYPE_BOOL };
+        xstr.method("concat", str_concat, str2, str1, FuncInfo::Pure);
+        xstr.method(GetOperatorName(OP_CONCAT), str_concat, str2, str1, FuncInfo::Pure);
+        xstr.method("join", str_join, join, str1, FuncInfo::Pure);
+        xstr.method("rep", str_rep, rep, str1, FuncInfo::Pure);
+        xstr.method(GetOperatorName(OP_EQ), str_eq, str2, bool1, FuncInfo::Pure);
+        xstr.method(GetOperatorName(OP_NEQ), str_neq, str2, bool1, FuncInfo::Pure);
     }
 }
 
@@ -287,6 +301,42 @@ static void reg_type_array(RTReg& r)
     DType *d = r.tr.mkprim(PRIMTYPE_ARRAY);
     r.types.array = d;
     ClassReg xarr = r.regclass("array", d);
+
+    {
+        const Type arr1[] = { PRIMTYPE_ARRAY };
+        const Type arr2[] = { PRIMTYPE_ARRAY, PRIMTYPE_ARRAY };
+        const Type arrx[] = { PRIMTYPE_ARRAY, PRIMTYPE_ANY };
+        const Type axpy[] = { PRIMTYPE_ARRAY, PRIMTYPE_ANY, PRIMTYPE_ARRAY };
+        const Type any1[] = { PRIMTYPE_ANY };
+        xarr.method("sum", arr_sum, arr1, any1, FuncInfo::Pure);
+        xarr.method("min", arr_min, arr1, any1, FuncInfo::Pure);
+        xarr.method("max", arr_max, arr1, any1, FuncInfo::Pure);
+        xarr.method("dot", arr_dot, arr2, any1, FuncInfo::Pure);
+        xarr.method("find", arr_find, arrx, any1, FuncInfo::Pure);
+        xarr.method("lt", arr_lt, arrx, arr1);
+        xarr.method("le", arr_le, arrx, arr1);
+        xarr.method("gt", arr_gt, arrx, arr1);
+        xarr.method("ge", arr_ge, arrx, arr1);
+        xarr.method("eq", arr_eq, arrx, arr1);
+        xarr.method("ne", arr_ne, arrx, arr1);
+        xarr.method("fill", arr_fill, arrx, Countof(arrx), NULL, 0, FuncInfo::None);
+        xarr.method("scale", arr_scale, arrx, Countof(arrx), NULL, 0, FuncInfo::None);
+        xarr.method("offset", arr_offset, arrx, Countof(arrx), NULL, 0, FuncInfo::None);
+        xarr.method("axpy", arr_axpy, axpy, Countof(axpy), NULL, 0, FuncInfo::None);
+
+        const Type slice[] = { PRIMTYPE_ARRAY, PRIMTYPE_UINT, PRIMTYPE_UINT };
+        const Type view[] = { PRIMTYPE_ARRAY, PRIMTYPE_UINT, PRIMTYPE_UINT, PRIMTYPE_UINT };
+        xarr.method("slice", arr_slice, slice, arr1);
+        xarr.method("view", arr_view, view, arr1);
+
+        const Type arru[] = { PRIMTYPE_ARRAY, PRIMTYPE_UINT };
+        xarr.method("sort", arr_sort, arr1, Countof(arr1), NULL, 0, FuncInfo::None);
+        xarr.method("stable_sort", arr_stable_sort, arr1, Countof(arr1), NULL, 0, FuncInfo::None);
+        xarr.method("partial_sort", arr_partial_sort, arru, Countof(arru), NULL, 0, FuncInfo::None);
+        xarr.method("nth_element", arr_nth_element, arru, Countof(arru), NULL, 0, FuncInfo::None);
+        xarr.method("binary_search", arr_binary_search, arrx, any1, FuncInfo::Pure);
+        xarr.method("argsort", arr_argsort, arr1, arr1);
+    }
 }
 
 static void reg_type_table(RTReg& r)
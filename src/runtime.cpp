@@ -1,20 +1,118 @@
 #include "runtime.h"
+#include "hashfunc.h"
+#include "io_libc.h"
+#include <stdio.h>
+#include <string.h>
 
 Runtime::Runtime()
-    : sp(gc)
+    : gc()
+    , sp(gc)
     , tr(gc)
+    , _strfile()
 {
 }
 
 Runtime::~Runtime()
 {
+    sp.attachBase(NULL);
+    if(_strfile.Close)
+        _strfile.Close(&_strfile);
+    _strcopy.dealloc(gc);
 }
 
-bool Runtime::init(Galloc alloc)
+bool Runtime::init(Galloc alloc, const char *strings)
 {
     gc.alloc = alloc;
+    gc.strings = &sp;
+#ifdef _DEBUG
+    gc.hashseed = 0; // For reproducibility across debug runs
+#else
+    // No libc randomness needed; with ASLR, heap, stack and code addresses differ per process
+    gc.hashseed = mkhashseed(uintptr_t(this) ^ (uintptr_t(&alloc) << 7u) ^ (uintptr_t(alloc) << 13u));
+#endif
 
-    return sp.init() && tr.init();
+    if(!sp.init())
+        return false;
+    if(strings)
+        _loadStrings(strings); // Works the same without it
+    return tr.init();
+}
+
+bool Runtime::_loadStrings(const char *fn)
+{
+    if(sm_openFile(&_strfile, fn))
+        return false;
+
+    // A mapped file is all there right away and is used in place. Otherwise it starts out empty; read it all.
+    const char *p = _strfile.cursor;
+    size_t n = _strfile.end - p;
+    if(!n)
+    {
+        for(;;)
+        {
+            if(const size_t k = _strfile.end - _strfile.cursor)
+            {
+                char *dst = _strcopy.alloc_n(gc, tsize(k));
+                if(!dst)
+                    break;
+                memcpy(dst, _strfile.cursor, k);
+                _strfile.cursor = _strfile.end;
+            }
+            if(sm_refill(&_strfile))
+                break;
+        }
+        const bool eof = _strfile.err == SM_EOF;
+        _strfile.Close(&_strfile);
+        if(!eof)
+        {
+            _strcopy.dealloc(gc);
+            return false;
+        }
+        p = _strcopy.data();
+        n = _strcopy.size();
+    }
+
+    if(!_strbase.init(p, n))
+    {
+        if(_strfile.Close)
+            _strfile.Close(&_strfile);
+        _strcopy.dealloc(gc);
+        return false;
+    }
+    sp.attachBase(&_strbase);
+    return true;
+}
+
+int Runtime::saveStrings(const char *fn) const
+{
+    // Write to a temp file first, so that nobody ever maps a partial snapshot
+    char tmpfn[1024];
+    const int len = snprintf(tmpfn, sizeof(tmpfn), "%s.tmp", fn);
+    if(len <= 0 || size_t(len) >= sizeof(tmpfn))
+        return -1;
+
+    BufSink sk;
+    int err = sink_openFile(&sk, tmpfn, 0);
+    if(err)
+        return err;
+    err = StringSnapshot::Write(&sk, sp, gc.hashseed);
+    if(!err)
+        err = sk.Flush(&sk);
+    sk.Close(&sk);
+    if(!err)
+        err = sk.err;
+
+    if(!err)
+    {
+#ifdef _WIN32
+        remove(fn); // rename() doesn't replace existing files there
+#endif
+        if(rename(tmpfn, fn))
+            err = -1;
+    }
+    if(err)
+        remove(tmpfn);
+    return err;
 }
 
 /*
@@ -3,6 +3,7 @@
 #include "strings.h"
 #include "rttypes.h"
 #include "gc.h"
+#include "serialio.h"
 
 
 // internal use only
@@ -19,11 +20,22 @@ struct Runtime
 {
     Runtime();
     ~Runtime();
-    bool init(Galloc alloc);
+    // strings: Optional file made by saveStrings(), used as the read-only base layer of sp (see StringSnapshot).
+    // It's mapped, not read, if possible, and stays in use until the runtime is destroyed.
+    // If the file is missing or unusable, everything works the same, only without it.
+    bool init(Galloc alloc, const char *strings = NULL);
+    // Writes all strings in sp, including its base layer, for init(). Returns 0 on success, otherwise an errno value or -1.
+    int saveStrings(const char *fn) const;
 
     GC gc;
     StringPool sp;
     TypeRegistry tr;
 
     //void registerOperator(SymTable& syms, const OpRegHelper& reg);
+
+private:
+    bool _loadStrings(const char *fn);
+    StringSnapshot _strbase;
+    BufStream _strfile;
+    PodArray<char> _strcopy; // Only if the file couldn't be mapped
 };
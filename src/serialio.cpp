@@ -1,4 +1,5 @@
 #include "serialio.h"
+#include <string.h>
 
 
 // https://dcreager.net/2021/03/a-better-varint/
@@ -84,3 +85,181 @@ vudec vu128dec(const unsigned char *src)
     d.val = x;
     return d;
 }
+
+unsigned vu128len(unsigned char first)
+{
+    if(!(first & 0x80))
+        return 1;
+    if(!(first & 0x40))
+        return 2;
+    if(!(first & 0x20))
+        return 3;
+    if(first < 0xf0)
+        return 4;
+    return (first & 0x0f) + 2;
+}
+
+// Most numbers in serialized code are small and take 1 byte.
+// Check 8 bytes at once for that and copy them all, otherwise decode the numbers in those 8 bytes one by one.
+// The 8-byte check doesn't care about endianness, and the main loop needs no bounds checks per number.
+size_t vu128decn(unsigned *dst, size_t n, const unsigned char *src, size_t size, size_t *used)
+{
+    const unsigned char * const begin = src;
+    const unsigned char * const end = src + size;
+    size_t i = 0;
+
+    // 8 bytes for the check, plus up to 4 more if the last number in those 8 bytes is longer than 1 byte
+    while(i + 8 <= n && end - src >= 12)
+    {
+        uint64_t w;
+        memcpy(&w, src, 8);
+        if(!(w & 0x8080808080808080ull))
+        {
+            for(unsigned k = 0; k < 8; ++k)
+                dst[i + k] = src[k];
+            i += 8;
+            src += 8;
+            continue;
+        }
+
+        // Mixed. Decode every number that starts in these 8 bytes; that's at most 8.
+        const unsigned char * const wend = src + 8;
+        do
+        {
+            const unsigned x = *src;
+            if(x < 0x80)
+            {
+                dst[i++] = x;
+                ++src;
+            }
+            else if(x < 0xc0)
+            {
+                dst[i++] = (x & 0x3f) | (unsigned(src[1]) << 6u);
+                src += 2;
+            }
+            else
+            {
+                if(x >= 0xf0 && x != 0xf3) // Only the 5-byte form fits into 32 bits
+                    goto out;
+                const vudec d = vu128dec(src);
+                dst[i++] = d.val;
+                src += d.adv;
+            }
+        }
+        while(src < wend);
+    }
+
+    // Near the end, check that each number is complete
+    while(i < n && src < end)
+    {
+        const unsigned len = vu128len(*src);
+        if(len > size_t(end - src) || (*src >= 0xf0 && len != 5))
+            break;
+        dst[i++] = vu128dec(src).val;
+        src += len;
+    }
+
+out:
+    *used = src - begin;
+    return i;
+}
+
+int sm_refill(BufStream *sm)
+{
+    for(;;)
+    {
+        if(int err = sm->Refill(sm))
+            return err;
+        if(sm->cursor < sm->end)
+            return 0;
+    }
+}
+
+int sm_read(BufStream *sm, void *dst, size_t n)
+{
+    char *p = (char*)dst;
+    while(n)
+    {
+        if(sm->cursor >= sm->end)
+            if(int err = sm_refill(sm))
+                return err;
+        size_t avail = sm->end - sm->cursor;
+        if(avail > n)
+            avail = n;
+        memcpy(p, sm->cursor, avail);
+        sm->cursor += avail;
+        p += avail;
+        n -= avail;
+    }
+    return 0;
+}
+
+int sm_readvu(BufStream *sm, unsigned *x)
+{
+    // Only the 5-byte form of the long encoding fits into 32 bits; anything else is never written
+    if(sm->end - sm->cursor >= 5) // Fast path: Everything is in the buffer
+    {
+        const vudec d = vu128dec((const unsigned char*)sm->cursor);
+        if((unsigned char)*sm->cursor >= 0xf0 && d.adv != 5)
+            return SM_BAD_DATA;
+        sm->cursor += d.adv;
+        *x = d.val;
+        return 0;
+    }
+
+    unsigned char buf[5];
+    if(int err = sm_read(sm, buf, 1))
+        return err;
+    const unsigned n = vu128len(buf[0]);
+    if(buf[0] >= 0xf0 && n != 5)
+        return SM_BAD_DATA;
+    if(n > 1)
+        if(int err = sm_read(sm, buf + 1, n - 1))
+            return err;
+    *x = vu128dec(buf).val;
+    return 0;
+}
+
+int sm_readvun(BufStream *sm, unsigned *dst, size_t n)
+{
+    while(n)
+    {
+        size_t used;
+        const size_t done = vu128decn(dst, n, (const unsigned char*)sm->cursor, sm->end - sm->cursor, &used);
+        sm->cursor += used;
+        dst += done;
+        n -= done;
+        if(n) // The next number is cut off by the end of the buffer (or malformed); this refills and handles that
+        {
+            if(int err = sm_readvu(sm, dst))
+                return err;
+            ++dst;
+            --n;
+        }
+    }
+    return 0;
+}
+
+static int memrefill(BufStream *sm)
+{
+    // Everything was handed out at once; anything that comes after is the end
+    sm->begin = sm->cursor = sm->end;
+    sm->err = SM_EOF;
+    return SM_EOF;
+}
+
+static void memclose(BufStream *sm)
+{
+    sm->cursor = sm->begin = sm->end = NULL;
+    sm->Refill = NULL;
+    sm->Close = NULL;
+}
+
+void sm_initMem(BufStream *sm, const void *mem, size_t size)
+{
+    sm->begin = sm->cursor = (const char*)mem;
+    sm->end = sm->begin + size;
+    sm->err = 0;
+    sm->Refill = memrefill;
+    sm->Close = memclose;
+}
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stddef.h>
+#include <stdint.h>
 
 struct BufStream
 {
@@ -46,6 +48,22 @@ struct BufSink
     } priv;
 };
 
+enum
+{
+    SM_EOF = -1,     /* Set as err by Refill() once there's no more data */
+    SM_BAD_DATA = -2 /* Returned by the readers below if the data make no sense. Not set as err. */
+};
+
+/* Helpers for reading. All of these return 0 on success, otherwise an error code;
+   check sm->err to see whether the stream is dead or it was a spurious error. */
+int sm_refill(BufStream *sm); /* Refills until there is at least 1 byte to read */
+int sm_read(BufStream *sm, void *dst, size_t n); /* Reads exactly n bytes */
+int sm_readvu(BufStream *sm, unsigned *x); /* Reads one vu128-encoded number */
+int sm_readvun(BufStream *sm, unsigned *dst, size_t n); /* Reads n vu128-encoded numbers. Much faster than one by one. */
+
+/* Stream over a block of memory. The memory must stay valid until the stream is closed. */
+void sm_initMem(BufStream *sm, const void *mem, size_t size);
+
 struct vudec
 {
     unsigned val;
@@ -63,5 +81,20 @@ inline static unsigned int zigzagenc(int x)
     return (2*x) ^ (x >>(sizeof(int) * 8 - 1));
 }
 
+inline static int64_t zigzagdec64(uint64_t x)
+{
+    return (x >> 1) ^ (-(int64_t)(x&1));
+}
+
+inline static uint64_t zigzagenc64(int64_t x)
+{
+    return (2*(uint64_t)x) ^ (x >> 63);
+}
+
 unsigned vu128enc(unsigned char dst[5], unsigned x);
 vudec vu128dec(const unsigned char *src);
+unsigned vu128len(unsigned char first); /* Total encoded size, as determined by the first byte */
+
+/* Decodes up to n numbers from src[0 ..< size] into dst. Stops early at a number that is cut off or malformed.
+   Returns how many numbers were decoded; *used is set to the number of bytes they took. */
+size_t vu128decn(unsigned *dst, size_t n, const unsigned char *src, size_t size, size_t *used);
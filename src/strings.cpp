@@ -1,4 +1,6 @@
 #include "strings.h"
+#include "hashfunc.h"
+#include "serialio.h"
 #include <string.h>
 
 
@@ -6,10 +8,25 @@ static const Str None = {0, 0};
 
 
 StringPool::StringPool(GC& gc)
-    : Dedup(gc, true, 0)
+    : Dedup(gc, true, 0), _shared(NULL), _base(NULL), _addshared(false), _pendingfree(0)
 {
 }
 
+StringPool::~StringPool()
+{
+    dealloc();
+}
+
+void StringPool::dealloc()
+{
+    for(tsize i = 0; i < _pending.size(); ++i)
+        if(_pending[i].buf)
+            gc_alloc_unmanaged(gc, _pending[i].buf, _pending[i].cap, 0);
+    _pending.dealloc(gc);
+    _pendingfree = 0;
+    Dedup::dealloc();
+}
+
 FORCEINLINE static Str mkstr(sref ref, size_t len)
 {
     Str s;
@@ -21,15 +38,64 @@ FORCEINLINE static Str mkstr(sref ref, size_t len)
 
 Str StringPool::put(const char* s)
 {
-    if(!s)
+    return s ? put(s, strlen(s)) : None;
+}
+
+// A string that was here before someone else put it into the shared pool keeps its local ref, so refs stay unique
+Str StringPool::_findlayered(const char* s, size_t n) const
+{
+    if(_base)
+    {
+        Str b = _base->get(s, n);
+        if(b.id)
+            return b;
+    }
+    if(!_shared)
         return None;
-    size_t len = strlen(s);
-    return mkstr(Dedup::putCopy(s, len), len);
+    if(!_addshared)
+        if(const sref ref = Dedup::find(s, n))
+            return mkstr(ref, n);
+    return _shared->get(s, n);
+}
+
+// Fails like Dedup::putCopy()
+Str StringPool::_putshared(const char* s, size_t n)
+{
+    const Str sh = _shared->put(s, n);
+    return sh.id ? sh : mkstr(sref(-1), n);
 }
 
 Str StringPool::put(const char* s, size_t n)
 {
-    return mkstr(Dedup::putCopy(s, n), n);
+    if(_shared || _base)
+    {
+        Str sh = _findlayered(s, n);
+        if(sh.id)
+            return sh;
+        if(_addshared)
+            return _putshared(s, n);
+    }
+    const sref ref = Dedup::putCopy(s, n);
+    assert(ref == sref(-1) || ref < StringSnapshot::BASE_REF_BIT);
+    return mkstr(ref, n);
+}
+
+Str StringPool::put(const char* s, size_t n, uhash h)
+{
+    assert(h == hash(s, n));
+    if(!n)
+        return put(s, n);
+    if(_shared || _base)
+    {
+        Str sh = _findlayered(s, n);
+        if(sh.id)
+            return sh;
+        if(_addshared)
+            return _putshared(s, n);
+    }
+    const sref ref = Dedup::putCopy(s, n, h);
+    assert(ref == sref(-1) || ref < StringSnapshot::BASE_REF_BIT);
+    return mkstr(ref, n);
 }
 
 Str StringPool::put(const std::string& s)
@@ -37,6 +103,29 @@ Str StringPool::put(const std::string& s)
     return put(s.c_str(), s.size());
 }
 
+Str StringPool::putTakeOver(char* mem, size_t n, size_t actualsize)
+{
+    if(_shared || _base)
+    {
+        Str sh = _findlayered(mem, n);
+        if(!sh.id && _addshared)
+            sh = _shared->put(mem, n);
+        if(sh.id || _addshared)
+        {
+            gc_alloc_unmanaged(gc, mem, actualsize, 0);
+            return sh;
+        }
+    }
+    const sref ref = Dedup::putTakeOver(mem, n, actualsize);
+    assert(ref < StringSnapshot::BASE_REF_BIT || ref == sref(-1));
+    if(ref == sref(-1))
+    {
+        gc_alloc_unmanaged(gc, mem, actualsize, 0);
+        return None;
+    }
+    return mkstr(ref, n);
+}
+
 Str StringPool::get(const char* s) const
 {
     return s ? get(s, strlen(s)) : None;
@@ -44,6 +133,12 @@ Str StringPool::get(const char* s) const
 
 Str StringPool::get(const char* s, size_t n) const
 {
+    if(_shared || _base)
+    {
+        Str sh = _findlayered(s, n);
+        if(sh.id || _shared) // With a shared pool, _findlayered() covered this pool too
+            return sh;
+    }
     sref ref = Dedup::find(s, n);
     return ref ? mkstr(ref, n) : None;
 }
@@ -55,14 +150,819 @@ Str StringPool::get(const std::string& s) const
 
 Strp StringPool::lookup(size_t id) const
 {
+    if(SharedStringPool::IsShared(sref(id)))
+        return _shared->lookup(sref(id));
+    if(StringSnapshot::IsBase(sref(id)))
+        return _base->lookup(sref(id));
+
     const MemBlock mb = Dedup::get(id);
     const Strp sp = { mb.p, mb.n };
     return sp;
 }
 
+Val StringPool::putval(const char* s, size_t n)
+{
+    if(n <= MAX_INLINE_STR)
+        return Val(MakeInlineStr(s, n), PRIMTYPE_STRING);
+    const Str q = put(s, n);
+    return q.id && q.id != sref(-1) ? Val(q) : Val(_Nil());
+}
+
+Val StringPool::refval(sref ref) const
+{
+    const Strp s = lookup(ref);
+    return s.len <= MAX_INLINE_STR ? Val(MakeInlineStr(s.s, s.len), PRIMTYPE_STRING) : Val(_Str(ref));
+}
+
+Strp StringPool::lookupval(const _AnyValU& u, StrTmp& tmp) const
+{
+    if(IsPendingStr(u))
+    {
+        const Pending& p = _pending[u.str];
+        const size_t n = PendingStrLen(u);
+        if(p.ref && p.reflen == n)
+            return lookup(p.ref);
+        const Strp sp = { p.buf, n };
+        return sp;
+    }
+    if(!IsInlineStr(u))
+        return lookup(u.str);
+
+    const size_t n = InlineStrLen(u);
+    memcpy(tmp.s, &u, MAX_INLINE_STR);
+    tmp.s[n] = 0;
+    const Strp sp = { tmp.s, n };
+    return sp;
+}
+
+sref StringPool::internval(const _AnyValU& u)
+{
+    if(IsPendingStr(u))
+        return flatten(Val(u, PRIMTYPE_STRING)).u.str; // 0 if nil
+    if(!IsInlineStr(u))
+        return u.str;
+    const sref ref = put((const char*)&u, InlineStrLen(u)).id;
+    return ref != sref(-1) ? ref : 0;
+}
+
+u32 StringPool::_newpending(size_t cap)
+{
+    char *buf = (char*)gc_alloc_unmanaged(gc, NULL, 0, cap);
+    if(!buf)
+        return u32(-1);
+
+    u32 idx = _pendingfree - 1;
+    if(_pendingfree)
+        _pendingfree = _pending[idx].len;
+    else
+    {
+        idx = _pending.size();
+        if(!_pending.push_back(gc, Pending()))
+        {
+            gc_alloc_unmanaged(gc, buf, cap, 0);
+            return u32(-1);
+        }
+    }
+
+    Pending& p = _pending[idx];
+    p.buf = buf;
+    p.len = 0;
+    p.cap = u32(cap);
+    p.ref = 0;
+    p.reflen = 0;
+    p.marked = 1; // Like new strings, survives a GC cycle that is already running
+    return idx;
+}
+
+bool StringPool::_growpending(Pending& p, size_t n)
+{
+    if(n < p.cap)
+        return true;
+    size_t cap = size_t(p.cap) * 2;
+    if(cap <= n)
+        cap = n + 1;
+    char *buf = (char*)gc_alloc_unmanaged(gc, p.buf, p.cap, cap);
+    if(!buf)
+        return false;
+    p.buf = buf;
+    p.cap = u32(cap);
+    return true;
+}
+
+void StringPool::_markpending(u32 idx)
+{
+    Pending& p = _pending[idx];
+    p.marked = 1;
+    if(p.ref)
+        mark(p.ref);
+}
+
+Val StringPool::concatval(const _AnyValU& a, const _AnyValU& b)
+{
+    StrTmp ta, tb;
+    const Strp sa = lookupval(a, ta);
+    const Strp sb = lookupval(b, tb);
+    if(!sb.len)
+        return Val(a, PRIMTYPE_STRING);
+    if(!sa.len)
+        return Val(b, PRIMTYPE_STRING);
+
+    const size_t n = sa.len + sb.len;
+    if(n <= MAX_INLINE_STR)
+    {
+        char buf[MAX_INLINE_STR];
+        memcpy(buf, sa.s, sa.len);
+        memcpy(buf + sa.len, sb.s, sb.len);
+        return Val(MakeInlineStr(buf, n), PRIMTYPE_STRING);
+    }
+    if(n > MAX_PENDING_STR) // Too long to encode, intern right away
+    {
+        StrBuilder bld(gc);
+        const Str r = bld.reserve(n) && bld.append(sa.s, sa.len) && bld.append(sb.s, sb.len) ? bld.finish(*this) : None;
+        return r.id ? Val(r) : Val(_Nil());
+    }
+
+    // Values that refer to a shorter prefix of the buffer don't see what is appended
+    if(IsPendingStr(a) && _pending[a.str].len == sa.len)
+    {
+        Pending& p = _pending[a.str];
+        const bool self = IsPendingStr(b) && b.str == a.str; // s ++ s; sb.s is invalid after growing
+        if(!_growpending(p, n))
+            return _Nil();
+        memcpy(p.buf + sa.len, self ? p.buf : sb.s, sb.len);
+        p.buf[n] = 0;
+        p.len = u32(n);
+        return Val(MakePendingStr(a.str, n), PRIMTYPE_STRING);
+    }
+
+    const u32 idx = _newpending(n < 32 ? 64 : n * 2);
+    if(idx == u32(-1))
+        return _Nil();
+    Pending& p = _pending[idx];
+    memcpy(p.buf, sa.s, sa.len);
+    memcpy(p.buf + sa.len, sb.s, sb.len);
+    p.buf[n] = 0;
+    p.len = u32(n);
+    return Val(MakePendingStr(idx, n), PRIMTYPE_STRING);
+}
+
+Val StringPool::flatten(const ValU& v)
+{
+    if(v.type != PRIMTYPE_STRING || !IsPendingStr(v.u))
+        return v;
+
+    Pending& p = _pending[v.u.str];
+    const size_t n = PendingStrLen(v.u);
+    if(p.ref && p.reflen == n)
+        return Val(_Str(p.ref));
+
+    const Str s = put(p.buf, n);
+    if(!s.id || s.id == sref(-1))
+        return _Nil();
+    p.ref = s.id;
+    p.reflen = u32(n);
+    return Val(s);
+}
+
+Val StringPool::findval(const ValU& v) const
+{
+    if(v.type != PRIMTYPE_STRING || !IsPendingStr(v.u))
+        return v;
+
+    const Pending& p = _pending[v.u.str];
+    const size_t n = PendingStrLen(v.u);
+    if(p.ref && p.reflen == n)
+        return Val(_Str(p.ref));
+
+    const Str s = get(p.buf, n);
+    return s.id ? Val(s) : Val(_Nil());
+}
+
+bool StringPool::sameval(const _AnyValU& a, const _AnyValU& b) const
+{
+    if(!IsPendingStr(a) && !IsPendingStr(b))
+        return a.opaque == b.opaque;
+    StrTmp ta, tb;
+    const Strp sa = lookupval(a, ta);
+    const Strp sb = lookupval(b, tb);
+    return sa.len == sb.len && !memcmp(sa.s, sb.s, sa.len);
+}
+
+void StringPool::sweeppending()
+{
+    for(tsize i = 0; i < _pending.size(); ++i)
+    {
+        Pending& p = _pending[i];
+        if(!p.buf)
+            continue;
+        if(p.marked)
+            p.marked = 0;
+        else
+        {
+            gc_alloc_unmanaged(gc, p.buf, p.cap, 0);
+            p.buf = NULL;
+            p.len = _pendingfree;
+            _pendingfree = i + 1;
+        }
+    }
+}
+
 Str StringPool::importFrom(const StringPool& other, size_t idInOther)
 {
-    // FIXME: make a function in Dedup to do this quickly
+    // Shared refs are valid everywhere, but this pool may have had the string first.
+    // Assumes both pools use the same shared pool, if any.
+    if(SharedStringPool::IsShared(sref(idInOther)))
+    {
+        assert(_shared && _shared == other._shared);
+        const Strp s = other.lookup(idInOther);
+        const sref ref = _addshared ? 0 : Dedup::find(s.s, s.len);
+        return mkstr(ref ? ref : sref(idInOther), s.len);
+    }
+    if(StringSnapshot::IsBase(sref(idInOther)) && _base == other._base)
+        return mkstr(sref(idInOther), other.lookup(idInOther).len);
+
     const Strp s = other.lookup(idInOther);
-    return put(s.s, s.len);
+    if(_shared || _base) // Must check the other layers first
+        return put(s.s, s.len);
+
+    const sref ref = Dedup::importFrom(other, sref(idInOther));
+    return ref != sref(-1) ? mkstr(ref, s.len) : None;
+}
+
+bool StringPool::importMany(const StringPool& other, const sref* ids, sref* dst, size_t n)
+{
+    if(!_shared && !other._shared && !_base && !other._base)
+        return Dedup::importMany(other, ids, dst, n);
+
+    bool ok = true;
+    for(size_t i = 0; i < n; ++i)
+        if(!(dst[i] = importFrom(other, ids[i]).id) && ids[i])
+            ok = false;
+    return ok;
+}
+
+void StringPool::mark(sref ref)
+{
+    // Shared and base layer strings are never collected
+    if(!(ref & (SharedStringPool::SHARED_REF_BIT | StringSnapshot::BASE_REF_BIT)))
+        Dedup::mark(ref);
+}
+
+// ------------------------
+
+StrBuilder::StrBuilder(GC& gc)
+    : gc(gc), _buf(NULL), _len(0), _cap(0)
+{
+}
+
+StrBuilder::~StrBuilder()
+{
+    clear();
+}
+
+void StrBuilder::clear()
+{
+    if(_cap)
+        gc_alloc_unmanaged(gc, _buf, _cap, 0);
+    _buf = NULL;
+    _len = 0;
+    _cap = 0;
+}
+
+bool StrBuilder::reserve(size_t n)
+{
+    return n < _cap || _grow(n + 1);
+}
+
+NOINLINE bool StrBuilder::_grow(size_t minsize)
+{
+    size_t n = _cap + (_cap >> 1u);
+    if(n < minsize)
+        n = minsize;
+    if(n < 32)
+        n = 32;
+    char *p = (char*)gc_alloc_unmanaged(gc, _buf, _cap, n);
+    if(!p)
+        return false;
+    _buf = p;
+    _cap = n;
+    return true;
+}
+
+bool StrBuilder::append(const char* s, size_t n)
+{
+    const size_t need = _len + n + 1;
+    if(need > _cap && !_grow(need))
+        return false;
+    memcpy(_buf + _len, s, n);
+    _len += n;
+    return true;
+}
+
+bool StrBuilder::append(const StringPool& sp, sref s)
+{
+    const Strp p = sp.lookup(s);
+    return append(p.s, p.len);
+}
+
+Str StrBuilder::finish(StringPool& sp)
+{
+    assert(&sp.gc == &gc);
+    if(!_len)
+    {
+        clear();
+        return mkstr(REF_EMPTY, 0);
+    }
+
+    // The pool can only remember a small amount of slack, get rid of the rest
+    if(_cap - _len > 0xff)
+    {
+        if(char *p = (char*)gc_alloc_unmanaged(gc, _buf, _cap, _len + 1))
+        {
+            _buf = p;
+            _cap = _len + 1;
+        }
+        else // Can't shrink? Just copy it then.
+        {
+            Str s = sp.put(_buf, _len);
+            clear();
+            return s;
+        }
+    }
+
+    _buf[_len] = 0;
+    Str s = sp.putTakeOver(_buf, _len, _cap);
+    _buf = NULL;
+    _len = 0;
+    _cap = 0;
+    return s;
+}
+
+// ------------------------
+
+// Index of the highest set bit. x must not be 0.
+static FORCEINLINE unsigned highbit(u32 x)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 31u - __builtin_clz(x);
+#else
+    unsigned r = 0;
+    while(x >>= 1u)
+        ++r;
+    return r;
+#endif
+}
+
+// Directory index -> (segment, offset in segment)
+static FORCEINLINE void dirpos(sref local, unsigned& seg, size_t& off)
+{
+    const u32 j = u32(local) + (1u << SharedStringPool::DIR_FIRST_BITS);
+    seg = highbit(j) - SharedStringPool::DIR_FIRST_BITS;
+    off = j - (1u << (seg + SharedStringPool::DIR_FIRST_BITS));
+}
+
+// Open addressing hash table, linear probing. Only ever grows; to grow, a bigger copy replaces it.
+// The old one is kept until dealloc(), since other threads may still be reading it.
+struct SharedStringPool::Index
+{
+    Index *prev;
+    u32 mask;
+    u32 kv[2]; // (hash, local ref) pairs, 2 * (mask + 1) u32 in total. Ref 0 is a free slot.
+
+    static FORCEINLINE size_t Bytes(u32 mask) { return sizeof(Index) + sizeof(u32) * 2 * mask; }
+};
+
+SharedStringPool::Shard::Shard()
+    : dd(gc, true, 0, false) // Don't inline short strings; the directory needs pointers that stay valid
+{
+    memset(&gc, 0, sizeof(gc));
+    memset(dir, 0, sizeof(dir));
+    lock.v = 0;
+    index = NULL;
+    nindexed = 0;
+}
+
+SharedStringPool::SharedStringPool(Galloc alloc, void *allocud, uhash seed)
+{
+    for(size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+        GC& gc = _shards[i].gc;
+        gc.alloc = alloc;
+        gc.gcud = allocud;
+        gc.hashseed = seed;
+    }
+}
+
+SharedStringPool::~SharedStringPool()
+{
+    dealloc();
+}
+
+bool SharedStringPool::init()
+{
+    for(size_t i = 0; i < NUM_SHARDS; ++i)
+        if(!_shards[i].dd.init())
+            return false;
+    return true;
+}
+
+void SharedStringPool::dealloc()
+{
+    for(size_t i = 0; i < NUM_SHARDS; ++i)
+    {
+        Shard& sh = _shards[i];
+        for(unsigned s = 0; s < DIR_SEGMENTS; ++s)
+            if(sh.dir[s])
+            {
+                gc_alloc_unmanaged_T(sh.gc, sh.dir[s], size_t(1) << (s + DIR_FIRST_BITS), 0);
+                sh.dir[s] = NULL;
+            }
+        while(Index *ix = sh.index)
+        {
+            sh.index = ix->prev;
+            gc_alloc_unmanaged(sh.gc, ix, Index::Bytes(ix->mask), 0);
+        }
+        sh.nindexed = 0;
+        if(sh.dd.endref()) // New strings start out marked; the 1st sweep unmarks, the 2nd frees
+            for(unsigned k = 0; k < 2; ++k)
+            {
+                sh.dd.sweepstep(0);
+                sh.dd.sweepfinish(false);
+            }
+        sh.dd.dealloc();
+    }
+}
+
+// Shard is picked by the top bits of the hash, the Dedup inside uses the lower bits
+static FORCEINLINE size_t shardOf(uhash h)
+{
+    return h >> (sizeof(uhash) * 8 - SharedStringPool::SHARD_BITS);
+}
+
+FORCEINLINE static Str mkshared(sref local, size_t shard, size_t len)
+{
+    // Refs 0 and 1 mean the same in every pool
+    return mkstr(local < 2 ? local : (SharedStringPool::SHARED_REF_BIT | (local << SharedStringPool::SHARD_BITS) | sref(shard)), len);
+}
+
+Str SharedStringPool::put(const char *s)
+{
+    return s ? put(s, strlen(s)) : None;
+}
+
+Str SharedStringPool::put(const char *s, size_t n)
+{
+    if(!n)
+        return mkstr(!!s, 0);
+
+    const uhash h = _shards[0].dd.hash(s, n); // all shards use the same seed
+    const size_t idx = shardOf(h);
+    Shard& sh = _shards[idx];
+
+    sref local = _find(sh, s, n, h);
+    if(!local)
+    {
+        sh.lock.lock();
+        local = _find(sh, s, n, h); // Another thread may have added it in the meantime
+        if(!local)
+        {
+            local = sh.dd.putCopy(s, n, h);
+            // If publishing fails, the string stays in the Dedup, and the next put() of it tries again.
+            // Only a full shard keeps it there for nothing.
+            if(local == sref(-1) || local > MAX_LOCAL_REF || !_publish(sh, local) || !_index(sh, local, h))
+                local = 0;
+        }
+        sh.lock.unlock();
+    }
+
+    return local ? mkshared(local, idx, n) : None;
+}
+
+Str SharedStringPool::get(const char *s, size_t n) const
+{
+    if(!n)
+        return mkstr(!!s, 0);
+
+    const uhash h = _shards[0].dd.hash(s, n);
+    const size_t idx = shardOf(h);
+    const sref local = _find(_shards[idx], s, n, h);
+    return local ? mkshared(local, idx, n) : None;
+}
+
+// Lock-free. Whatever a ref in the index refers to was written before the ref was stored.
+sref SharedStringPool::_find(const Shard& sh, const char *s, size_t n, uhash h) const
+{
+    const Index *ix = (const Index*)AtomicLoadAcquirePtr((void * const volatile*)&sh.index);
+    if(!ix)
+        return 0;
+    const u32 mask = ix->mask;
+    for(u32 i = h & mask, k = 0; k <= mask; i = (i + 1) & mask, ++k)
+    {
+        const sref local = AtomicLoadAcquire(&ix->kv[2*i+1]);
+        if(!local)
+            break;
+        if(ix->kv[2*i] == h)
+        {
+            unsigned seg;
+            size_t off;
+            dirpos(local, seg, off);
+            const MemBlock& mb = sh.dir[seg][off];
+            if(mb.n == n && !memcmp(mb.p, s, n))
+                return local;
+        }
+    }
+    return 0;
+}
+
+Strp SharedStringPool::lookup(sref ref) const
+{
+    assert(IsShared(ref));
+    const Shard& sh = _shards[ref & (NUM_SHARDS - 1)];
+    unsigned seg;
+    size_t off;
+    dirpos((ref & ~sref(SHARED_REF_BIT)) >> SHARD_BITS, seg, off);
+    const MemBlock& mb = sh.dir[seg][off];
+    const Strp sp = { mb.p, mb.n };
+    return sp;
+}
+
+// Called with the shard lock held. Makes the string visible to lookup().
+// No barrier needed here: other threads get the ref either through the index,
+// which is updated afterwards, or through some other synchronization of their own.
+bool SharedStringPool::_publish(Shard& sh, sref local)
+{
+    unsigned seg;
+    size_t off;
+    dirpos(local, seg, off);
+    MemBlock *d = sh.dir[seg];
+    if(!d)
+    {
+        d = gc_alloc_unmanaged_zero_T<MemBlock>(sh.gc, size_t(1) << (seg + DIR_FIRST_BITS));
+        if(!d)
+            return false;
+        sh.dir[seg] = d;
+    }
+    if(!d[off].p) // Don't touch entries that may be read concurrently
+        d[off] = sh.dd.get(local);
+    return true;
+}
+
+// Called with the shard lock held, after _publish(). Makes the string visible to get().
+bool SharedStringPool::_index(Shard& sh, sref local, uhash h)
+{
+    Index *ix = sh.index;
+    if(!ix || (sh.nindexed + 1) * 4 > (ix->mask + 1) * 3)
+    {
+        const u32 mask = ix ? ix->mask * 2 + 1 : (1u << DIR_FIRST_BITS) - 1;
+        Index *nx = (Index*)gc_alloc_unmanaged_zero(sh.gc, Index::Bytes(mask));
+        if(!nx)
+            return false;
+        nx->prev = ix;
+        nx->mask = mask;
+        if(ix) // Nobody sees the new table yet, no need to be careful
+            for(u32 i = 0; i <= ix->mask; ++i)
+                if(const u32 r = ix->kv[2*i+1])
+                {
+                    u32 j = ix->kv[2*i] & mask;
+                    while(nx->kv[2*j+1])
+                        j = (j + 1) & mask;
+                    nx->kv[2*j] = ix->kv[2*i];
+                    nx->kv[2*j+1] = r;
+                }
+        AtomicStoreReleasePtr((void * volatile*)&sh.index, nx);
+        ix = nx;
+    }
+
+    u32 j = h & ix->mask;
+    while(ix->kv[2*j+1])
+        j = (j + 1) & ix->mask;
+    ix->kv[2*j] = h;
+    AtomicStoreRelease(&ix->kv[2*j+1], u32(local)); // Last, readers take a non-zero ref as complete
+    ++sh.nindexed;
+    return true;
+}
+
+// ------------------------
+
+/* Blob layout. All offsets are relative to the start of the blob, so it can be mapped anywhere.
+   Header
+   u32 keys[2 * (mask + 1)] -- (hash, index + 1) pairs. Open addressing, linear probing.
+   u32 offs[n + 1]          -- string i is data[offs[i] ..< offs[i+1] - 1], followed by a 0 byte
+   char data[]
+*/
+struct StringSnapshot::Header
+{
+    u32 magic;
+    u32 version;
+    u32 hdrsize; // sizeof(Header)
+    u32 n;
+    u32 mask;
+    u32 seed;
+    u32 datasize;
+    u32 pad_;
+};
+
+static FORCEINLINE uhash snaphash(uhash seed, const void *s, size_t n)
+{
+    return memhash(seed, s, n) ^ rotr(uhash(n), 12);
+}
+
+static FORCEINLINE size_t snapKeyBytes(u32 mask)
+{
+    return 2 * sizeof(u32) * (size_t(mask) + 1);
+}
+
+static FORCEINLINE size_t snapOffsBytes(size_t n)
+{
+    // Padded so that the blob size stays a multiple of ALIGN
+    return (sizeof(u32) * (n + 1) + StringSnapshot::ALIGN - 1) & ~size_t(StringSnapshot::ALIGN - 1);
+}
+
+StringSnapshot::StringSnapshot()
+    : _keys(NULL), _offs(NULL), _data(NULL), _n(0), _mask(0), _seed(0)
+{
+}
+
+bool StringSnapshot::init(const void* mem, size_t size)
+{
+    STATIC_ASSERT(sizeof(Header) % ALIGN == 0);
+    STATIC_ASSERT(sizeof(uhash) == sizeof(u32));
+    _n = 0;
+    if(size < sizeof(Header) || (uintptr_t(mem) & (ALIGN - 1)))
+        return false;
+
+    const Header *h = (const Header*)mem;
+    if(h->magic != MAGIC || h->version != VERSION || h->hdrsize != sizeof(Header)
+        || (h->mask & (h->mask + 1)) || h->n > h->mask || h->n >= BASE_REF_BIT)
+        return false;
+
+    const size_t kb = snapKeyBytes(h->mask);
+    const size_t ob = snapOffsBytes(h->n);
+    if(size - sizeof(Header) < kb || size - sizeof(Header) - kb < ob
+        || size - sizeof(Header) - kb - ob < h->datasize)
+        return false;
+
+    const char *p = (const char*)mem + sizeof(Header);
+    const u32 *keys = (const u32*)p;
+    const u32 *offs = (const u32*)(p + kb);
+    const char *data = p + kb + ob;
+
+    // Only look at the offsets, not the strings; those pages are then only touched when used
+    if(offs[0] || offs[h->n] != h->datasize)
+        return false;
+    for(size_t i = 0; i < h->n; ++i)
+        if(offs[i] >= offs[i+1] || data[offs[i+1] - 1])
+            return false;
+
+    _keys = keys;
+    _offs = offs;
+    _data = data;
+    _mask = h->mask;
+    _seed = h->seed;
+    _n = h->n;
+    return true;
+}
+
+Str StringSnapshot::get(const char* s, size_t n) const
+{
+    if(!_n || !n)
+        return None;
+
+    // A valid table is never full, but the keys aren't checked by init(), so don't go around more than once
+    const uhash h = snaphash(_seed, s, n);
+    u32 i = h & _mask;
+    for(u32 probes = 0; probes <= _mask; ++probes, i = (i + 1) & _mask)
+    {
+        const u32 *k = &_keys[2 * i];
+        const u32 idx = k[1];
+        if(!idx || idx > _n) // Free slot. Bad indices are treated as free.
+            return None;
+        if(k[0] == h)
+        {
+            const u32 beg = _offs[idx - 1];
+            if(_offs[idx] - beg - 1 == n && !memcmp(_data + beg, s, n))
+                return mkstr(sref(idx - 1) | BASE_REF_BIT, n);
+        }
+    }
+    return None;
+}
+
+Strp StringSnapshot::lookup(sref ref) const
+{
+    assert(IsBase(ref));
+    const size_t i = ref & ~sref(BASE_REF_BIT);
+    assert(i < _n);
+    const Strp sp = { _data + _offs[i], _offs[i+1] - _offs[i] - 1 };
+    return sp;
+}
+
+static int snapwrite(BufSink *sk, const void *mem, size_t n)
+{
+    if(!n)
+        return 0;
+    int err = sk->Write(sk, mem, n);
+    return err ? err : sk->err;
+}
+
+// Walks the strings that go into a snapshot: first the base layer, then the pool's own strings
+struct StringSnapshot::Iter
+{
+    const StringSnapshot *base;
+    const Dedup& dd;
+    size_t i;
+    sref r;
+
+    Iter(const StringSnapshot *base, const Dedup& dd) : base(base), dd(dd), i(0), r(2) {}
+
+    Strp next()
+    {
+        if(base && i < base->size())
+            return base->lookup(sref(i++) | BASE_REF_BIT);
+        while(!dd.used(r))
+            ++r;
+        const MemBlock mb = dd.get(r++);
+        const Strp s = { mb.p, mb.n };
+        return s;
+    }
+};
+
+int StringSnapshot::Write(BufSink* sk, const StringPool& sp, uhash seed)
+{
+    GC& gc = sp.gc;
+    const Dedup& dd = sp;
+
+    // Count first; the header needs all sizes upfront
+    size_t n = sp._base ? sp._base->size() : 0;
+    size_t datasize = sp._base ? sp._base->_offs[n] : 0;
+    for(sref r = 2; r < dd.endref(); ++r)
+        if(dd.used(r))
+        {
+            datasize += dd.get(r).n + 1;
+            ++n;
+        }
+    if(n >= BASE_REF_BIT || datasize > u32(-1))
+        return -1;
+
+    u32 mask = 15;
+    while(mask < n + (n >> 1u)) // Load factor <= 2/3
+        mask = (mask << 1u) | 1u;
+
+    const size_t kb = snapKeyBytes(mask);
+    const size_t ob = snapOffsBytes(n);
+    u32 * const keys = (u32*)gc_alloc_unmanaged_zero(gc, kb);
+    u32 * const offs = (u32*)gc_alloc_unmanaged_zero(gc, ob);
+    int err = -1;
+    if(keys && offs)
+    {
+        Iter it(sp._base, dd);
+        u32 pos = 0;
+        for(size_t i = 0; i < n; ++i)
+        {
+            const Strp s = it.next();
+            offs[i] = pos;
+            pos += u32(s.len + 1);
+            const uhash h = snaphash(seed, s.s, s.len);
+            u32 k = h & mask;
+            while(keys[2 * k + 1])
+                k = (k + 1) & mask;
+            keys[2 * k] = h;
+            keys[2 * k + 1] = u32(i + 1);
+        }
+        offs[n] = pos;
+        assert(pos == datasize);
+
+        Header hdr;
+        hdr.magic = MAGIC;
+        hdr.version = VERSION;
+        hdr.hdrsize = sizeof(Header);
+        hdr.n = u32(n);
+        hdr.mask = mask;
+        hdr.seed = seed;
+        hdr.datasize = u32(datasize);
+        hdr.pad_ = 0;
+
+        err = snapwrite(sk, &hdr, sizeof(hdr));
+        if(!err)
+            err = snapwrite(sk, keys, kb);
+        if(!err)
+            err = snapwrite(sk, offs, ob);
+
+        Iter it2(sp._base, dd); // Same order as above
+        for(size_t i = 0; !err && i < n; ++i)
+        {
+            const Strp s = it2.next();
+            err = snapwrite(sk, s.s, s.len + 1); // Includes the terminating 0
+        }
+        if(!err)
+        {
+            static const char zeros[ALIGN] = {0};
+            err = snapwrite(sk, zeros, (ALIGN - (datasize & (ALIGN - 1))) & (ALIGN - 1));
+        }
+    }
+
+    if(keys)
+        gc_alloc_unmanaged(gc, keys, kb, 0);
+    if(offs)
+        gc_alloc_unmanaged(gc, offs, ob, 0);
+    return err;
 }
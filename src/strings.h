@@ -2,27 +2,276 @@
 
 #include "defs.h"
 #include "dedupset.h"
+#include "gc.h"
 
 #include <string>
+#include <string.h>
 
+class SharedStringPool;
+class StringSnapshot;
+struct BufSink;
 
+// A string value (PRIMTYPE_STRING) holds either a ref into a StringPool, or, if the string is no longer
+// than MAX_INLINE_STR bytes, the string itself. Which one is used depends only on the length,
+// so equal strings always have equal values, and comparing or hashing them never needs the pool.
+// Layout of ValU::u for inline strings: Bytes 0..6 are the contents (zero-padded), byte 7 is INLINE_STR_TAG | length.
+// Refs only use the lower 4 bytes (u.str), so byte 7 is 0 for them.
+// The result of a concatenation is pending instead: not interned yet, so that building a string piece by piece
+// doesn't intern every intermediate result. It refers to a growable buffer in the StringPool.
+// Pending values break the rule that equal strings have equal values, so pass them through StringPool::flatten()
+// before hashing them or comparing them with ==, or compare with StringPool::sameval(). Tables handle pending keys
+// on their own. Reading them via lookupval() is fine.
+// Layout for pending strings: Bytes 0..3 (u.str) index the buffer, bytes 4..6 are the length, byte 7 is PENDING_STR_TAG.
+enum
+{
+    MAX_INLINE_STR = 7,
+    INLINE_STR_TAG = 0x80,
+    PENDING_STR_TAG = 0x40,
+    MAX_PENDING_STR = (1 << 24) - 1
+};
+
+FORCEINLINE static bool IsInlineStr(const _AnyValU& u)
+{
+    return !!(reinterpret_cast<const unsigned char*>(&u)[MAX_INLINE_STR] & INLINE_STR_TAG);
+}
+
+FORCEINLINE static bool IsPendingStr(const _AnyValU& u)
+{
+    return reinterpret_cast<const unsigned char*>(&u)[MAX_INLINE_STR] == PENDING_STR_TAG;
+}
+
+FORCEINLINE static size_t PendingStrLen(const _AnyValU& u)
+{
+    return size_t(u.ui >> 32u) & MAX_PENDING_STR;
+}
+
+FORCEINLINE static _AnyValU MakePendingStr(u32 idx, size_t n)
+{
+    assert(n <= MAX_PENDING_STR);
+    _AnyValU u;
+    u.ui = uint(idx) | (uint(n) << 32u) | (uint(PENDING_STR_TAG) << 56u);
+    return u;
+}
+
+FORCEINLINE static size_t InlineStrLen(const _AnyValU& u)
+{
+    return reinterpret_cast<const unsigned char*>(&u)[MAX_INLINE_STR] & ~INLINE_STR_TAG;
+}
+
+FORCEINLINE static _AnyValU MakeInlineStr(const char *s, size_t n)
+{
+    static_assert(sizeof(_AnyValU) == MAX_INLINE_STR + 1, "inline strings need 8 bytes");
+    assert(n <= MAX_INLINE_STR);
+    _AnyValU u;
+    u.opaque = 0;
+    memcpy(&u, s, n);
+    reinterpret_cast<unsigned char*>(&u)[MAX_INLINE_STR] = (unsigned char)(INLINE_STR_TAG | n);
+    return u;
+}
+
+// Scratch space to look up inline strings, since a 7 byte string can't be 0-terminated in place
+struct StrTmp
+{
+    char s[MAX_INLINE_STR + 1];
+};
 
 class StringPool : public Dedup
 {
 public:
     StringPool(GC& gc);
+    ~StringPool();
     bool init() { return Dedup::init(); }
-    void dealloc() { Dedup::dealloc(); }
+    void dealloc();
     Str put(const char *s);
     Str put(const char *s, size_t n);
     Str put(const std::string& s);
+    Str put(const char *s, size_t n, uhash h); // h must be hash(s, n)
+    // mem must be allocated via this pool's GC, with actualsize bytes. Always takes ownership, even on failure.
+    // mem[n] must be 0.
+    Str putTakeOver(char *mem, size_t n, size_t actualsize);
     Str get(const char *s) const;
     Str get(const char *s, size_t n) const;
     Str get(const std::string& s) const;
     Strp lookup(size_t id) const;
+
+    // String values. Short strings don't touch the pool.
+    Val putval(const char *s, size_t n); // Returns nil on alloc fail
+    Val refval(sref ref) const; // Value of a string that's already in the pool
+    // The result may point into tmp. For a pending string, it may not be 0-terminated at len.
+    Strp lookupval(const _AnyValU& u, StrTmp& tmp) const;
+    sref internval(const _AnyValU& u); // For storing a string value where only refs fit. Returns 0 on alloc fail
+    FORCEINLINE void markval(const _AnyValU& u) { if(IsPendingStr(u)) _markpending(u.str); else if(!IsInlineStr(u)) mark(u.str); }
+
+    // a ++ b. Longer results are pending. Appending to a pending string that nothing was appended to yet
+    // reuses its buffer, so building a string piece by piece is linear in its length. Returns nil on alloc fail.
+    Val concatval(const _AnyValU& a, const _AnyValU& b);
+    // Interns a pending string and returns the regular value. Anything else is returned as is. Returns nil on alloc fail.
+    Val flatten(const ValU& v);
+    // Same without interning. If the pool doesn't have the string yet, returns nil: it's not equal to any interned string.
+    Val findval(const ValU& v) const;
+    // Equality of two string values by contents; pending strings are fine
+    bool sameval(const _AnyValU& a, const _AnyValU& b) const;
     Str importFrom(const StringPool& other, size_t idInOther);
+    // Import many strings at once. dst[i] is the imported ids[i]. Returns false if any import failed (dst[i] is 0 then).
+    bool importMany(const StringPool& other, const sref *ids, sref *dst, size_t n);
 
-    FORCEINLINE void mark(sref ref) { Dedup::mark(ref); }
+    // Strings already in the shared pool are then returned as shared refs, unless they were here first,
+    // and shared refs can be looked up like local ones. With addNew, new strings go into the shared pool
+    // instead of this one; that's for pools of workers whose results are imported elsewhere (see CompileDriver).
+    // Attach before putting anything if addNew is set.
+    void attachShared(SharedStringPool *shared, bool addNew = false) { _shared = shared; _addshared = addNew; }
+    FORCEINLINE SharedStringPool *shared() const { return _shared; }
 
+    // Same for a read-only base layer. Strings in it are never copied into the pool.
+    // The base layer is checked first, then the shared pool.
+    void attachBase(const StringSnapshot *base) { _base = base; }
+    FORCEINLINE const StringSnapshot *base() const { return _base; }
+
+    void mark(sref ref);
+    void sweeppending(); // Frees pending strings that weren't marked. Call after Dedup::sweepfinish(), once per GC cycle.
+
+private:
+    friend class StringSnapshot;
+    struct Pending
+    {
+        char *buf; // NULL if unused
+        u32 len; // buf[len] is 0. If unused, this is the next free index + 1, or 0.
+        u32 cap;
+        sref ref; // Interned prefix of length reflen, 0 if none
+        u32 reflen;
+        u32 marked;
+    };
+    Str _findlayered(const char *s, size_t n) const; // in the base layer, here, or the shared pool
+    Str _putshared(const char *s, size_t n);
+    u32 _newpending(size_t cap); // Returns u32(-1) on alloc fail
+    bool _growpending(Pending& p, size_t n);
+    void _markpending(u32 idx);
+    SharedStringPool *_shared;
+    const StringSnapshot *_base;
+    bool _addshared;
+    PodArray<Pending> _pending;
+    u32 _pendingfree; // Index + 1 of a free pending slot, 0 if none
 };
 
+// Accumulates pieces of a string and interns the result only once, in finish().
+// Use this to build strings out of many parts instead of putting every intermediate result into the pool;
+// this is linear in the total length instead of quadratic.
+class StrBuilder
+{
+public:
+    StrBuilder(GC& gc);
+    ~StrBuilder();
+    bool reserve(size_t n); // Total length, not additional bytes
+    bool append(const char *s, size_t n);
+    bool append(const StringPool& sp, sref s);
+    FORCEINLINE size_t size() const { return _len; }
+    FORCEINLINE const char *data() const { return _buf; }
+    Str finish(StringPool& sp); // Hands over the buffer to the pool. The builder is empty afterwards.
+    void clear();
+
+private:
+    bool _grow(size_t minsize);
+    GC& gc;
+    char *_buf;
+    size_t _len;
+    size_t _cap; // Always has space for a terminating 0 when allocated
+};
+
+// Thread-safe, append-only string pool that can be shared between runtimes on different threads.
+// Strings are spread over independent Dedup shards by hash, each with its own lock.
+// - get() and lookup() never lock, and neither does put() if the string is already there.
+//   Only adding a new string locks the one shard it belongs to.
+// - Refs are handed out only after everything get() and lookup() touch is in place,
+//   and that stuff never moves or changes afterwards.
+// - Strings are never collected, they live as long as the pool.
+// Refs have SHARED_REF_BIT set and encode the shard in the low bits.
+// The empty string has the regular ref REF_EMPTY; a failed put() returns ref 0.
+class SharedStringPool
+{
+public:
+    enum
+    {
+        SHARD_BITS = 4,
+        NUM_SHARDS = 1 << SHARD_BITS,
+        SHARED_REF_BIT = 1u << 31u,
+        MAX_LOCAL_REF = (SHARED_REF_BIT >> SHARD_BITS) - 1,
+        DIR_FIRST_BITS = 6, // 1st directory segment has this many elements
+        DIR_SEGMENTS = 32 - SHARD_BITS - DIR_FIRST_BITS
+    };
+
+    SharedStringPool(Galloc alloc, void *allocud, uhash seed);
+    ~SharedStringPool();
+    bool init();
+    void dealloc();
+
+    Str put(const char *s);
+    Str put(const char *s, size_t n);
+    Str get(const char *s, size_t n) const;
+    Strp lookup(sref ref) const;
+
+    static FORCEINLINE bool IsShared(sref ref) { return !!(ref & SHARED_REF_BIT); }
+
+private:
+    struct Index;
+    struct Shard
+    {
+        Shard();
+        GC gc; // only used for allocation; this is per shard to avoid sharing the stats
+        Dedup dd; // Owns the strings. Only touched with the lock held.
+        mutable SpinLock lock;
+        MemBlock *dir[DIR_SEGMENTS]; // ref -> string. Segment i has (1 << (DIR_FIRST_BITS + i)) entries
+        Index *index; // string -> ref, readable without the lock
+        u32 nindexed;
+    };
+
+    sref _find(const Shard& sh, const char *s, size_t n, uhash h) const;
+    bool _publish(Shard& sh, sref local);
+    bool _index(Shard& sh, sref local, uhash h);
+
+    Shard _shards[NUM_SHARDS];
+};
+
+
+// Read-only string table in a single, position-independent blob of memory, eg. a file that was mmap'd.
+// Made with Write(), then used in place without parsing or copying anything.
+// Use it as a base layer under a StringPool (see StringPool::attachBase()) to skip interning
+// the same strings (builtin names, module identifiers, ...) again on every startup.
+// Refs have BASE_REF_BIT set and SHARED_REF_BIT clear, and are the same in every process using the same blob.
+// Since it's never modified, the hash seed is fixed and stored in the blob.
+class StringSnapshot
+{
+public:
+    enum
+    {
+        BASE_REF_BIT = 1u << 30u,
+        MAGIC = 0x52545347, // "GSTR"
+        VERSION = 1,
+        ALIGN = 8 // Required alignment of the blob in memory
+    };
+
+    StringSnapshot();
+    // Checks the blob and then uses it in place. It must stay valid and unchanged while this is in use.
+    // Returns false if the blob is broken or was made by an incompatible version.
+    bool init(const void *mem, size_t size);
+
+    Str get(const char *s, size_t n) const;
+    Strp lookup(sref ref) const;
+    FORCEINLINE size_t size() const { return _n; }
+
+    static FORCEINLINE bool IsBase(sref ref) { return (ref & (SharedStringPool::SHARED_REF_BIT | BASE_REF_BIT)) == BASE_REF_BIT; }
+
+    // Writes all strings in sp, including those in its base layer (but not the shared pool), as a new blob.
+    // Refs in the new blob are not related to the refs in sp.
+    // Returns 0 on success, otherwise the error from the sink, or -1 if out of memory.
+    static int Write(BufSink *sk, const StringPool& sp, uhash seed);
+
+private:
+    struct Header;
+    struct Iter;
+    const u32 *_keys; // (hash, index + 1) pairs; index 0 is a free slot
+    const u32 *_offs; // _n + 1 offsets into _data; each string ends with a 0 byte
+    const char *_data;
+    size_t _n;
+    u32 _mask;
+    uhash _seed;
+};
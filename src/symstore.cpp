@@ -1,4 +1,5 @@
 #include "symstore.h"
+#include "runtime.h"
 
 Symstore::Symstore()
 {
@@ -41,6 +42,17 @@ void Symstore::dealloc(GC& gc)
     allsyms.clear();
 }
 
+void Symstore::mark(Runtime& rt) const
+{
+    for(size_t i = 0; i < allsyms.size(); ++i)
+    {
+        const Sym& s = allsyms[i];
+        rt.sp.mark(s.nameStrId);
+        if(const Val *v = s.value())
+            gc_markval(rt, *v);
+    }
+}
+
 Symstore::Frame& Symstore::funcframe()
 {
     for(size_t i = frames.size(); i --> 0; )
@@ -5,6 +5,7 @@
 #include "lex.h"
 
 struct GC;
+struct Runtime;
 
 enum ScopeType
 {
@@ -110,11 +111,13 @@ public:
     ~Symstore();
 
     void dealloc(GC& gc);
+    void mark(Runtime& rt) const; // For the GC: names and known values of all symbols
 
     void push(ScopeType boundary);
     void pop(Frame& f);
 
     const Frame& peek() const;
+    inline size_t depth() const { return frames.size(); }
 
 
     Lookup lookup(unsigned strid, const Lexer::Token& tok, SymbolRefContext referencedHow, bool createExternal);
@@ -125,6 +128,7 @@ public:
     Sym *getsym(unsigned uid);
     const Sym *getsym(unsigned uid) const;
     unsigned getuid(const Sym *sym);
+    inline size_t numsyms() const { return allsyms.size(); } // uids are 0 ..< numsyms()
 
     std::vector<unsigned> missing;
 
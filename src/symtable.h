@@ -25,6 +25,8 @@ public:
     void addToNamespace(GC& gc, Type ns, sref key, const Val& val);
     const Val *lookupInNamespace(Type ns, sref key) const;
 
+    const Table& table() const { return tab; } // For the GC
+
 private:
     SymTable();
     Table tab;
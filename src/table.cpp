@@ -2,6 +2,7 @@
 #include "hashfunc.h"
 #include "util.h"
 #include "gc.h"
+#include "strings.h"
 #include <string.h>
 
 /*
@@ -54,17 +55,22 @@ static bool isValidCap(tsize x)
 }
 
 Table::Table(Type keytype, Type valtype)
-    : vals(valtype), keys(NULL), keytype(keytype), idxmask(-1), backrefs(NULL)
+    : vals(valtype), keys(NULL), keytype(keytype), idxmask(-1), backrefs(NULL), hashseed(0), strings(NULL)
 {
 }
 
+static FORCEINLINE bool ispending(ValU k)
+{
+    return k.type == PRIMTYPE_STRING && IsPendingStr(k.u);
+}
+
 // never returns NULL
 TKey *Table::_getkey(ValU findkey, tsize mask) const
 {
     assert(keys);
 
     TKey *tombstone = NULL;
-    tsize hk = (tsize)hashvalue(HASH_SEED, findkey);
+    tsize hk = (tsize)hashvalue(hashseed, findkey);
     // This can't be an infinite loop since keys[] is resized when it gets too full,
     // ensuring there are always some empty slots.
     for(;;)
@@ -163,58 +169,79 @@ tsize Table::_resize(GC& gc, tsize newsize)
 {
     assert(isValidCap(newsize));
     const tsize oldcap = idxmask + 1;
-    TKey *newk = gc_alloc_unmanaged_T<TKey>(gc, keys, oldcap, newsize);
-    tsize *newbk = gc_alloc_unmanaged_T<tsize>(gc, backrefs, oldcap, newsize);
 
-    if(newsize && !(newk && newbk))
+    // Keys go into a fresh array; re-inserting in place can break probe sequences
+    // when a key is moved into a slot that another key's probe sequence had to skip over.
+    TKey *newk = NULL;
+    if(newsize)
     {
-        if(newk)
-            gc_alloc_unmanaged_T<TKey>(gc, newk, oldcap, 0);
-        if(newbk)
-            gc_alloc_unmanaged_T<tsize>(gc, newbk, oldcap, 0);
-        return 0;
+        newk = gc_alloc_unmanaged_zero_T<TKey>(gc, newsize); // all zeros is empty
+        if(!newk)
+            return 0;
     }
-
-    if(newsize > oldcap)
+    tsize *newbk = gc_alloc_unmanaged_T<tsize>(gc, backrefs, oldcap, newsize);
+    if(newsize && !newbk)
     {
-        // Clear new keys to empty
-        memset(newk + oldcap, 0, sizeof(*newk) * (newsize - oldcap));
+        gc_alloc_unmanaged_T<TKey>(gc, newk, newsize, 0);
+        return 0;
     }
 
+    TKey * const oldk = keys;
     keys = newk;
     backrefs = newbk;
     idxmask = newsize - 1; // ok if this underflows
+    if(!oldcap)
+    {
+        hashseed = gc.hashseed; // Fresh keys; nothing was hashed with the old seed
+        strings = gc.strings;
+    }
 
     if(oldcap && newsize)
-        _rehash(oldcap, newsize - 1);
+        _rehash(oldk, oldcap);
+
+    if(oldk)
+        gc_alloc_unmanaged_T<TKey>(gc, oldk, oldcap, 0);
 
     return newsize;
 }
 
 
-void Table::_rehash(tsize oldsize, tsize newmask)
+void Table::_rehash(const TKey *oldkeys, tsize oldsize)
 {
+    const tsize newmask = idxmask;
     for(tsize i = 0; i < oldsize; ++i)
     {
-        const TKey kcopy = keys[i];
-        makempty(keys[i]); // always clear; including tombstones
-        if(kcopy.type == PRIMTYPE_NIL)
+        const TKey& k = oldkeys[i];
+        if(k.type == PRIMTYPE_NIL) // skip empty and tombstones
             continue;
 
-        TKey *tk = _getkey(*(const ValU*)&kcopy, newmask); // HACK: dirty cast: is fine because the memory layout is the same
-        const tsize keyoffs = tk - keys;
-        *tk = kcopy;
+        TKey *tk = _getkey(*(const ValU*)&k, newmask); // HACK: dirty cast: is fine because the memory layout is the same
+        *tk = k;
 
-        backrefs[kcopy.validx] = keyoffs;
+        backrefs[k.validx] = tk - keys;
     }
 }
 
-Val Table::get(Val k) const
+const TKey *Table::_findkey(ValU k) const
 {
     if(!keys)
-        return _Nil();
+        return NULL;
+    if(ispending(k))
+    {
+        // Keys are always interned. If the pool doesn't have the string, it's not a key.
+        assert(strings);
+        k = strings->findval(k);
+        if(k.type == PRIMTYPE_NIL)
+            return NULL;
+    }
     const TKey *tk = _getkey(k, idxmask);
-    if(tk->type == PRIMTYPE_NIL)
+    return tk->type != PRIMTYPE_NIL ? tk : NULL;
+}
+
+Val Table::get(Val k) const
+{
+    const TKey *tk = _findkey(k);
+    if(!tk)
         return _Nil();
     const size_t idx = tk->validx;
     return vals.dynamicLookup(idx);
@@ -222,10 +249,8 @@ Val Table::get(Val k) const
 
 Val* Table::getp(Val k)
 {
-    if(!keys)
-        return NULL;
-    const TKey *tk = _getkey(k, idxmask);
-    if(tk->type == PRIMTYPE_NIL)
+    const TKey *tk = _findkey(k);
+    if(!tk)
         return NULL;
     const size_t idx = tk->validx;
     return (Val*)&vals.storage.vals[idx];
@@ -234,10 +259,8 @@ Val* Table::getp(Val k)
 
 const Val* Table::getp(Val k) const
 {
-    if(!keys)
-        return NULL;
-    const TKey *tk = _getkey(k, idxmask);
-    if(tk->type == PRIMTYPE_NIL)
+    const TKey *tk = _findkey(k);
+    if(!tk)
         return NULL;
     const size_t idx = tk->validx;
     return (const Val*)&vals.storage.vals[idx];
@@ -249,6 +272,14 @@ Val Table::set(GC& gc, Val k, Val v)
     assert(keytype == PRIMTYPE_ANY || k.type == keytype);
     assert(vals.t == PRIMTYPE_ANY || v.type == vals.t);
 
+    if(ispending(k)) // Stored keys must have one value per string
+    {
+        assert(gc.strings);
+        k = gc.strings->flatten(k);
+        if(k.type == PRIMTYPE_NIL)
+            return _Nil(); // TODO: handle OOM
+    }
+
     tsize newsize;
     TKey *tk;
     if(!keys) // When the table is fresh, keys are not allocated yet
@@ -305,35 +336,67 @@ Val Table::pop(Val k)
     if(!vals.sz)
         return _Nil(); // table is empty
 
-    TKey *tk = _getkey(k, idxmask);
-    if(tk->type == PRIMTYPE_NIL) // tombstone or empty
+    const TKey *tk = _findkey(k);
+    if(!tk)
         return _Nil(); // key is not in table
 
+    return removeAt(tk->validx);
+}
+
+Val Table::removeAt(tsize vidx)
+{
+    assert(vidx < vals.sz);
+
     // key exists, clear it
-    maketombstone(*tk);
-    const tsize keyoffs = tk - keys;
+    const tsize keyoffs = backrefs[vidx];
+    KCHECK(keyoffs);
+    maketombstone(keys[keyoffs]);
     _cleanupforward(keyoffs);
 
     // get wanted value out & move the last value in its place
-    const tsize vidx = tk->validx;
+    const tsize lastidx = vals.sz - 1;
     const ValU v = vals.removeAtAndMoveLast_Unsafe(vidx);
 
-    // patch its key to point to the new location
-    const tsize kidx = backrefs[vidx];
-    keys[kidx].validx = vidx;
-    backrefs[vidx] = keyoffs;
-
-    KCHECK(kidx);
+    if(vidx != lastidx)
+    {
+        // patch the moved value's key to point to the new location
+        const tsize kidx = backrefs[lastidx];
+        keys[kidx].validx = vidx;
+        backrefs[vidx] = kidx;
+        KCHECK(kidx);
+    }
 
     // TODO: shrink if < 25% full
 
     return v;
 }
 
+bool Table::iterate(TableCursor& c, KV& e) const
+{
+    const tsize i = c.next;
+    if(i >= vals.sz)
+        return false;
+
+    const TKey& tk = keys[backrefs[i]];
+    e.k = Val(tk.u, tk.type);
+    e.v = vals.dynamicLookup(i);
+    c.next = i + 1;
+    return true;
+}
+
+// The last entry is moved into the slot of the removed one. It wasn't visited yet
+// (or it is the removed entry itself), so stepping the cursor back by one visits it next.
+Val Table::removeCurrent(TableCursor& c)
+{
+    assert(c.next && "iterate() wasn't called");
+    return removeAt(--c.next);
+}
+
 Val Table::keyat(tsize idx) const
 {
-    KCHECK(idx);
-    const TKey& tk = keys[backrefs[idx]];
+    const tsize ki = backrefs[idx];
+    KCHECK(ki);
+    const TKey& tk = keys[ki];
     return Val(tk.u, tk.type);
 }
 
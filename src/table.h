@@ -2,6 +2,8 @@
 
 #include "array.h"
 
+class StringPool;
+
 
 /*
 Table aka hashmap, dict, key-value-store.
@@ -19,6 +21,9 @@ with the following guarantees:
 --
 Notes:
 - If you don't need the key, index the array directly since it's a bit faster.
+- To iterate, use a TableCursor. It walks the values array and the key backrefs by index,
+  no hashing involved. Removing the current entry via removeCurrent() is safe and does not skip anything.
+- Pending strings (see strings.h) are fine as keys. They're interned when stored, and looked up by contents.
 */
 
 struct KV
@@ -35,6 +40,15 @@ struct TKey
     tsize validx; // index of value
 };
 
+// Index cursor for iterating over a table. Init to {0}.
+// Every entry is visited exactly once, also when the current entry is removed via Table::removeCurrent().
+// Replacing the value of an existing key while iterating is fine too; inserting new keys is not supported
+// (the new entry may or may not be visited).
+struct TableCursor
+{
+    tsize next; // value index of the entry that is visited next
+};
+
 class Table : public GCobj
 {
 public:
@@ -48,6 +62,10 @@ public:
     Val pop(Val k);
     KV index(tsize idx) const;
     Val keyat(tsize idx) const;
+    Val removeAt(tsize idx); // Remove by value index. The last entry is moved into the freed slot.
+
+    bool iterate(TableCursor& c, KV& e) const; // Get next entry. Returns false when done.
+    Val removeCurrent(TableCursor& c); // Remove the entry last returned by iterate(). Returns its value.
 
     const DArray& values() const { return vals; }
     DArray& values() { return vals; }
@@ -63,9 +81,10 @@ public:
 private:
 
     TKey *_getkey(ValU findkey, tsize mask) const;
+    const TKey *_findkey(ValU k) const; // NULL if not found
     void _cleanupforward(tsize idx);
     tsize _resize(GC& gc, tsize newsize);
-    void _rehash(tsize oldsize, tsize newmask);
+    void _rehash(const TKey *oldkeys, tsize oldsize);
 
     DArray vals;
 
@@ -74,6 +93,8 @@ public:
 private:
     tsize idxmask; // capacity = idxmask + 1
     tsize *backrefs;
+    uhash hashseed; // picked up from the GC when keys are first allocated
+    const StringPool *strings; // same; to look up pending strings
 
     Table(const Table&); // forbidden
 };
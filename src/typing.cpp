@@ -3,6 +3,7 @@
 #include "array.h"
 #include "gc.h"
 #include "gaobj.h"
+#include "strings.h"
 
 #include <string.h>
 
@@ -54,6 +55,7 @@ enum
 TypeRegistry::TypeRegistry(GC& gc)
     : _tl(gc, false, 0)
     , _tt(gc, false, PrefixBytes)
+    , _sweepingLists(false)
 {
 }
 
@@ -106,7 +108,7 @@ Type TypeRegistry::mkstruct(const StructMember* m, size_t n, size_t numdefaults)
     return _store(td);
 }
 
-Type TypeRegistry::mkstruct(const Table& t)
+Type TypeRegistry::mkstruct(const Table& t, StringPool& sp)
 {
     const tsize N = t.size();
     PodArray<StructMember> tn;
@@ -129,7 +131,9 @@ Type TypeRegistry::mkstruct(const Table& t)
             tn[i].defaultval = e.v;
             tn[i].t = e.v.type;
         }
-        tn[i].name = e.k.u.str;
+        tn[i].name = sp.internval(e.k.u); // Member names are stored as refs
+        if(!tn[i].name)
+            return PRIMTYPE_NIL;
     }
 
     Type ret = mkstruct(tn.data(), N, numdefaults);
@@ -318,3 +322,67 @@ Type TypeRegistry::_store(TDesc *td)
     ret += PRIMTYPE_MAX;
     return ret;
 }
+
+void TypeRegistry::_mark(Type t, StringPool& sp)
+{
+    t &= TYPEBASE_MASK;
+    if(t & TYPEBIT_TYPELIST)
+    {
+        const sref id = t & ~TYPEBIT_TYPELIST;
+        if(!_tl.mark(id))
+            return; // Already done, and so is everything in it
+        const TypeIdList tl = getlist(t);
+        for(tsize i = 0; i < tl.n; ++i)
+            mark(tl.ptr[i], sp);
+        return;
+    }
+
+    assert(t > PRIMTYPE_MAX);
+    if(!_tt.mark(t - PRIMTYPE_MAX))
+        return;
+
+    const TDesc *td = lookupDesc(t);
+    const tsize n = td->size();
+    const Type *ts = td->types();
+    for(tsize i = 0; i < n; ++i)
+        mark(ts[i], sp);
+
+    if(!(td->bits & TYPEFLAG_UNION))
+    {
+        const sref *names = td->names();
+        for(tsize i = 0; i < n; ++i)
+            sp.mark(names[i]);
+    }
+
+    const _FieldDefault *fd = td->defaults();
+    for(tsize i = 0; i < td->numdefaults; ++i)
+        if(fd[i].t == PRIMTYPE_STRING)
+            sp.markval(fd[i].u);
+    // TODO: GC objects as defaults
+
+    // The type is alive, and so is its DType
+    if(td->h.dtype)
+        gc_mark(_tt.gc, td->h.dtype);
+}
+
+tsize TypeRegistry::sweepstep(tsize step)
+{
+    if(!_sweepingLists)
+    {
+        step = _tt.sweepstep(step);
+        if(!step)
+            return 0;
+        _sweepingLists = true;
+    }
+    step = _tl.sweepstep(step);
+    if(step)
+        _sweepingLists = false;
+    return step;
+}
+
+void TypeRegistry::sweepfinish(bool compact)
+{
+    assert(!_sweepingLists);
+    _tt.sweepfinish(compact);
+    _tl.sweepfinish(compact);
+}
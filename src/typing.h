@@ -5,6 +5,7 @@
 
 struct GC;
 class Table;
+class StringPool;
 
 class DType;
 
@@ -170,7 +171,7 @@ public:
     TypeInfo getinfo(Type t) const;
 
     Type mkstruct(const StructMember *m, size_t n, size_t numdefaults);
-    Type mkstruct(const Table& t); // makes a struct from t (named)
+    Type mkstruct(const Table& t, StringPool& sp); // makes a struct from t (named). sp is needed to intern short key strings.
 
     TDesc *mkprimDesc(PrimType t);
     DType *mkprim(PrimType t);
@@ -197,13 +198,18 @@ public:
     // (A, nil) is compatible with (A, B?)
     bool isListCompatible(Type sub, Type bigger) const;
 
-    FORCEINLINE void mark(Type t) { if(t > PRIMTYPE_MAX) _tt.mark(t - PRIMTYPE_MAX); }
+    // For the GC. Also marks everything a type refers to (list elements, struct members and their names).
+    FORCEINLINE void mark(Type t, StringPool& sp) { if((t & TYPEBASE_MASK) > PRIMTYPE_MAX) _mark(t, sp); }
+    tsize sweepstep(tsize step); // Same protocol as Dedup::sweepstep()
+    void sweepfinish(bool compact);
 
 private:
     Type _mklist(const Type *ts, size_t n);
+    void _mark(Type t, StringPool& sp);
 
     Type _store(TDesc *);
     Dedup _tl; // for simple type lists (Type[] arrays only)
     Dedup _tt; // for structs and such (TDesc based)
     TDesc *_builtins[PRIMTYPE_MAX];
+    bool _sweepingLists; // _tt is swept first, then _tl
 };
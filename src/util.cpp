@@ -28,3 +28,73 @@ MaybeNum strtouint_dec(const char* s, size_t maxlen)
 
     return res;
 }
+
+#ifdef _MSC_VER
+#include <intrin.h>
+void SpinLock::lock()
+{
+    while(_InterlockedExchange(&v, 1))
+        while(v)
+            _mm_pause();
+}
+void SpinLock::unlock()
+{
+    _InterlockedExchange(&v, 0);
+}
+// x86 doesn't reorder loads with loads or stores with stores, so only the compiler needs to be kept in check
+u32 AtomicLoadAcquire(const volatile u32 *p)
+{
+    const u32 x = *p;
+    _ReadWriteBarrier();
+    return x;
+}
+void AtomicStoreRelease(volatile u32 *p, u32 x)
+{
+    _ReadWriteBarrier();
+    *p = x;
+}
+void *AtomicLoadAcquirePtr(void * const volatile *p)
+{
+    void *x = *p;
+    _ReadWriteBarrier();
+    return x;
+}
+void AtomicStoreReleasePtr(void * volatile *p, void *x)
+{
+    _ReadWriteBarrier();
+    *p = x;
+}
+#elif defined(__GNUC__)
+void SpinLock::lock()
+{
+    while(__atomic_exchange_n(&v, 1, __ATOMIC_ACQUIRE))
+        while(__atomic_load_n(&v, __ATOMIC_RELAXED))
+        {
+#if defined(__i386__) || defined(__x86_64__)
+            __builtin_ia32_pause();
+#endif
+        }
+}
+void SpinLock::unlock()
+{
+    __atomic_store_n(&v, 0, __ATOMIC_RELEASE);
+}
+u32 AtomicLoadAcquire(const volatile u32 *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+void AtomicStoreRelease(volatile u32 *p, u32 x)
+{
+    __atomic_store_n(p, x, __ATOMIC_RELEASE);
+}
+void *AtomicLoadAcquirePtr(void * const volatile *p)
+{
+    return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+void AtomicStoreReleasePtr(void * volatile *p, void *x)
+{
+    __atomic_store_n(p, x, __ATOMIC_RELEASE);
+}
+#else
+#error SpinLock: implement me
+#endif
@@ -84,6 +84,17 @@
 #  endif
 #endif
 
+#ifndef PREFETCH
+#  if __has_builtin(__builtin_prefetch)
+#    define PREFETCH(p) __builtin_prefetch(p)
+#  elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#    include <xmmintrin.h>
+#    define PREFETCH(p) _mm_prefetch((const char*)(p), _MM_HINT_T0)
+#  else
+#    define PREFETCH(p)
+#  endif
+#endif
+
 #define STATIC_ASSERT(cond) do { switch((int)!!(cond)){case 0:;case(!!(cond)):;} } while(0)
 
 #if __has_builtin(__builtin_offsetof)
@@ -188,3 +199,21 @@ struct IntegralConstant
 typedef IntegralConstant<bool, true>  CompileTrue;
 typedef IntegralConstant<bool, false> CompileFalse;
 template<bool V> struct CompileCheck : IntegralConstant<bool, V>{};
+
+
+// Minimal lock for very short critical sections. Init to {0}.
+// Busy-waits, so don't hold it while doing anything that may block.
+struct SpinLock
+{
+    volatile long v;
+    void lock();
+    void unlock();
+};
+
+// Publish data to other threads without a lock: Write everything, then store the pointer or index
+// that makes it reachable with AtomicStoreRelease(). Readers that get it via AtomicLoadAcquire()
+// then see everything written before.
+u32 AtomicLoadAcquire(const volatile u32 *p);
+void AtomicStoreRelease(volatile u32 *p, u32 x);
+void *AtomicLoadAcquirePtr(void * const volatile *p);
+void AtomicStoreReleasePtr(void * volatile *p, void *x);
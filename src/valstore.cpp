@@ -1,41 +1,111 @@
 #include "valstore.h"
 #include "serialio.h"
 #include "strings.h"
+#include "gc.h"
+#include "hashfunc.h"
 #include <assert.h>
 
 enum
 {
-    INITIAL_VALS = 3
+    INITIAL_VALS = 3,
+    INITIAL_IDX = 16 // power of 2
 };
 
+static void markroot(Runtime& rt, const void *ud)
+{
+    const ValStore *vs = static_cast<const ValStore*>(ud);
+    for(tsize i = 0; i < vs->vals.size(); ++i)
+        gc_markval(rt, vs->vals[i]);
+}
+
 ValStore::ValStore(GC& gc)
-    : gc(gc)
+    : gc(gc), _idx(NULL), _mask(0), _hashseed(gc.hashseed), _root()
 {
+    gc_addroot(gc, _root, markroot, this);
     vals.push_back(gc, Val());
     vals.push_back(gc, Val(false));
     vals.push_back(gc, Val(true));
     assert(vals.size() == INITIAL_VALS);
+    _rehash(INITIAL_IDX);
 }
 
 ValStore::~ValStore()
 {
+    gc_removeroot(gc, _root);
+    if(_idx)
+        gc_alloc_unmanaged_T(gc, _idx, _mask + 1, 0);
     vals.dealloc(gc);
 }
 
+// Also used to build the index initially
+bool ValStore::_rehash(size_t newsize)
+{
+    u32 *idx = gc_alloc_unmanaged_zero_T<u32>(gc, newsize);
+    if(!idx)
+        return false;
+    const size_t mask = newsize - 1;
+    const size_t N = vals.size();
+    for(size_t i = 0; i < N; ++i)
+    {
+        size_t k = hashvalue(_hashseed, vals[i]) & mask;
+        while(idx[k])
+            k = (k + 1) & mask;
+        idx[k] = u32(i + 1);
+    }
+    if(_idx)
+        gc_alloc_unmanaged_T(gc, _idx, _mask + 1, 0);
+    _idx = idx;
+    _mask = mask;
+    return true;
+}
+
 u32 ValStore::put(ValU v)
 {
     const size_t N = vals.size();
-    for(size_t i = 0; i < N; ++i) // FIXME: Make this smarter than a dumb linear search
+    if(UNLIKELY(!_idx)) // Index alloc failed at some point. Still works, just slow.
+    {
+        for(size_t i = 0; i < N; ++i)
+            if(vals[i] == v)
+                return i;
+    }
+    else
     {
-        if(vals[i] == v)
-            return i;
+        size_t k = hashvalue(_hashseed, v) & _mask;
+        for(u32 i; (i = _idx[k]); k = (k + 1) & _mask)
+            if(vals[i - 1] == v)
+                return i - 1;
     }
 
     ValU *p = vals.push_back(gc, v);
     assert(p); // TODO: handle OOM
+
+    // Keep the load factor <= 1/2
+    if(_idx && (N + 1) * 2 > _mask + 1)
+    {
+        if(!_rehash((_mask + 1) * 2))
+        {
+            gc_alloc_unmanaged_T(gc, _idx, _mask + 1, 0);
+            _idx = NULL;
+        }
+    }
+    else if(_idx)
+    {
+        size_t k = hashvalue(_hashseed, v) & _mask;
+        while(_idx[k])
+            k = (k + 1) & _mask;
+        _idx[k] = u32(N + 1);
+    }
     return N;
 }
 
+/* Serialized format:
+   vu128 N -- total number of values, including the INITIAL_VALS that are always there and not stored
+   Then for each other value: vu128 tag, followed by
+     uint:  vu128 low 32 bits, vu128 high 32 bits
+     sint:  same, zigzag-encoded
+     float: vu128 bits
+     tag >= Countof(s_typeLUT): string of (tag - Countof(s_typeLUT)) bytes
+*/
 static const byte s_typeLUT[] =
 {
     PRIMTYPE_UINT,
@@ -44,16 +114,33 @@ static const byte s_typeLUT[] =
     // anthing with a higher id is a string
 };
 
+static FORCEINLINE unsigned enc64(byte *dst, uint64_t x)
+{
+    const unsigned n = vu128enc(dst, u32(x));
+    return n + vu128enc(dst + n, u32(x >> 32u));
+}
 
-void ValStore::serialize(BufSink* sk, const StringPool& sp) const
+static int dec64(BufStream *sm, uint64_t *x)
+{
+    unsigned lo, hi;
+    int err = sm_readvu(sm, &lo);
+    if(!err)
+        err = sm_readvu(sm, &hi);
+    *x = (uint64_t(hi) << 32u) | lo;
+    return err;
+}
+
+bool ValStore::serialize(BufSink* sk, const StringPool& sp) const
 {
     byte buf[16];
     const size_t N = vals.size();
-    u32 n = vu128enc(&buf[1], N);
-    sk->Write(sk, &buf, n);
+    u32 n = vu128enc(&buf[0], N);
+    if(sk->Write(sk, &buf, n))
+        return false;
 
     Strp s;
     s.len = 0;
+    StrTmp tmp;
     for(size_t i = INITIAL_VALS; i < N; ++i)
     {
         const ValU& v = vals[i];
@@ -61,29 +148,90 @@ void ValStore::serialize(BufSink* sk, const StringPool& sp) const
         switch(v.type)
         {
             case PRIMTYPE_UINT:
+                buf[0] = 0;
+                n = 1 + enc64(&buf[1], v.u.ui);
+                break;
             case PRIMTYPE_SINT:
-                buf[0] = v.type - PRIMTYPE_UINT;
-                n = 1 + vu128enc(&buf[1], zigzagenc(v.u.ui));
+                buf[0] = 1;
+                n = 1 + enc64(&buf[1], zigzagenc64(v.u.si));
                 break;
             case PRIMTYPE_FLOAT:
-                buf[0] = 4;
-                n = 1 + vu128enc(&buf[1], zigzagenc(v.u.f_as_u));
+                buf[0] = 2;
+                n = 1 + vu128enc(&buf[1], v.u.f_as_u);
                 break;
             case PRIMTYPE_STRING:
-                s = sp.lookup(v.u.str);
+                s = sp.lookupval(v.u, tmp);
                 n = vu128enc(&buf[0], Countof(s_typeLUT) + s.len);
                 break;
 
             default:
                 assert(false);
+                return false;
         }
 
-        sk->Write(sk, &buf, n);
+        if(sk->Write(sk, &buf, n))
+            return false;
         if(s.len)
         {
-            sk->Write(sk, s.s, s.len);
+            if(sk->Write(sk, s.s, s.len))
+                return false;
             s.len = 0;
         }
+    }
+    return !sk->err;
+}
 
+bool ValStore::deserialize(BufStream* sm, StringPool& sp)
+{
+    assert(vals.size() == INITIAL_VALS);
+    unsigned N;
+    if(sm_readvu(sm, &N) || N < INITIAL_VALS || !vals.reserve(gc, N))
+        return false;
+
+    PodArray<char> sbuf;
+    bool ok = true;
+    for(size_t i = INITIAL_VALS; ok && i < N; ++i)
+    {
+        unsigned tag;
+        if(sm_readvu(sm, &tag))
+            break;
+
+        Val v;
+        uint64_t x;
+        switch(tag)
+        {
+            case 0:
+                ok = !dec64(sm, &x);
+                v = Val(uint(x));
+                break;
+            case 1:
+                ok = !dec64(sm, &x);
+                v = Val(sint(zigzagdec64(x)));
+                break;
+            case 2:
+            {
+                unsigned f;
+                ok = !sm_readvu(sm, &f);
+                v.type = PRIMTYPE_FLOAT;
+                v.u.f_as_u = f;
+                break;
+            }
+            default:
+            {
+                const size_t len = tag - Countof(s_typeLUT);
+                ok = (sbuf.size() >= len || sbuf.resize(gc, len)) && !sm_read(sm, sbuf.data(), len);
+                if(ok)
+                {
+                    v = sp.putval(sbuf.data(), len);
+                    ok = v.type == PRIMTYPE_STRING;
+                }
+            }
+        }
+
+        // Anything that was written was unique, so it must land in the same place when put back
+        ok = ok && put(v) == i;
     }
+
+    sbuf.dealloc(gc);
+    return ok && vals.size() == N;
 }
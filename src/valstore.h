@@ -1,13 +1,16 @@
 #pragma once
 
 #include "array.h"
+#include "gc.h"
 
 class GC;
 struct BufSink;
+struct BufStream;
 class StringPool;
 
 // index->value store for constant values,
-// eg. literals in code
+// eg. literals in code. Each value is stored only once; put() finds existing values via a hashed index.
+// The values are a GC root as long as the ValStore exists.
 
 class ValStore
 {
@@ -16,9 +19,18 @@ public:
     ~ValStore();
     u32 put(ValU v);
 
-    void serialize(BufSink *sk, const StringPool& sp) const;
+    bool serialize(BufSink *sk, const StringPool& sp) const; // false if the sink failed or a value can't be serialized
+    // Reads back what serialize() wrote. Only call this on a fresh ValStore. Returns false on error.
+    bool deserialize(BufStream *sm, StringPool& sp);
 
     PodArray<ValU> vals;
 
     GC& gc;
+
+private:
+    bool _rehash(size_t newsize);
+    u32 *_idx; // open addressing, linear probing; index into vals + 1, 0 is a free slot
+    size_t _mask; // _idx has _mask + 1 slots
+    uhash _hashseed;
+    GCroot _root;
 };
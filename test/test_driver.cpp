@@ -0,0 +1,238 @@
+// Compiles the same files with the CompileDriver in several configurations
+// (1 and 8 threads, with and without a CompileCache or a SharedStringPool) and checks that every module comes out the same.
+// Then checks that cache entries of files whose externals are exported differently now are compiled again.
+// usage: test_driver <cache dir> <file>...
+
+#include "compiledriver.h"
+#include "compilecache.h"
+#include "runtime.h"
+#include "mlir.h"
+#include "serialio.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *testalloc(void *ud, void *ptr, size_t osz, size_t nsz)
+{
+    (void)ud;
+    (void)osz;
+    if(!nsz)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsz);
+}
+
+// BufSink that appends to a PodArray<char>
+struct MemSink
+{
+    BufSink sk;
+    GC *gc;
+    PodArray<char> *out;
+};
+
+static int memsinkWrite(BufSink *sk, const void *mem, size_t n)
+{
+    MemSink *ms = (MemSink*)sk;
+    char *dst = ms->out->alloc_n(*ms->gc, tsize(n));
+    if(!dst)
+        return (sk->err = -1);
+    memcpy(dst, mem, n);
+    return 0;
+}
+
+static bool dumpModule(const MLIR& ml, const StringPool& sp, GC& gc, PodArray<char>& out)
+{
+    MemSink ms;
+    memset(&ms, 0, sizeof(ms));
+    ms.sk.Write = memsinkWrite;
+    ms.gc = &gc;
+    ms.out = &out;
+    return ml.dump(&ms.sk, sp, MLIR::Options(0));
+}
+
+struct Result
+{
+    PodArray<char> *mods; // One dump per file; empty if the file failed
+    size_t fail;
+};
+
+// Each configuration gets a fresh runtime, so nothing carries over except the cache on disk
+static bool compileAll(Result& res, GC& gc, char **files, size_t n, unsigned nthreads, CompileCache *cache, bool shared)
+{
+    SharedStringPool sh(testalloc, NULL, 0); // Outlives the runtime
+    Runtime rt;
+    if(!rt.init(testalloc))
+        return false;
+    if(shared)
+    {
+        if(!sh.init())
+            return false;
+        rt.sp.attachShared(&sh);
+    }
+
+    CompileDriver cd(rt);
+    for(size_t i = 0; i < n; ++i)
+        cd.add(files[i]);
+    cd.setCache(cache);
+    res.fail = cd.run(nthreads);
+
+    bool ok = true;
+    for(size_t i = 0; i < n; ++i)
+        if(const MLIR *ml = cd.module(i))
+            ok = dumpModule(*ml, rt.sp, gc, res.mods[i]) && ok;
+    return ok;
+}
+
+static bool writeFile(const char *fn, const char *s)
+{
+    FILE *f = fopen(fn, "w");
+    if(!f)
+        return false;
+    const bool ok = fputs(s, f) >= 0;
+    return !fclose(f) && ok;
+}
+
+// Compiles the exporter and the user; returns whether the user was loaded from the cache
+static bool userCached(CompileCache& cache, const char *exporter, const char *user, const char *exsrc, int& fails)
+{
+    if(!writeFile(exporter, exsrc))
+    {
+        printf("FAIL: can't write %s\n", exporter);
+        ++fails;
+        return false;
+    }
+
+    Runtime rt;
+    if(!rt.init(testalloc))
+        return false;
+    CompileDriver cd(rt);
+    cd.add(exporter);
+    cd.add(user);
+    cd.setCache(&cache);
+    if(cd.run(2))
+    {
+        printf("FAIL: externals: couldn't compile\n");
+        ++fails;
+    }
+    return cd.cached(1);
+}
+
+static int checkExternals(CompileCache& cache, const char *dir)
+{
+    char exporter[1024], user[1024];
+    snprintf(exporter, sizeof(exporter), "%s/exporter.txt", dir);
+    snprintf(user, sizeof(user), "%s/user.txt", dir);
+    int fails = 0;
+    if(!writeFile(user, "var y = x + 1\n"))
+    {
+        printf("FAIL: can't write %s\n", user);
+        return 1;
+    }
+
+    // Entries from earlier runs may be around, so whatever happens the first time is fine
+    static const struct
+    {
+        const char *src;
+        bool usercached;
+    } steps[] =
+    {
+        { "export int x = 1\n",                   false },
+        { "export int x = 1\n",                   true },
+        { "-- comment\nexport int x = 1\n",        false }, // The parser doesn't know x's type, so any change counts
+        { "-- comment\nexport int x = 1\n",        true },
+        { "export float x = 1.5\n",               false },
+        { "export float x = 1.5\n",               true },
+        { "var x = 1\n",                          false }, // x isn't exported anymore
+        { "export int x = 1\n",                   false },
+    };
+    for(size_t i = 0; i < Countof(steps); ++i)
+    {
+        const bool cached = userCached(cache, exporter, user, steps[i].src, fails);
+        if(i && cached != steps[i].usercached)
+        {
+            printf("FAIL: externals step %u: user %s\n", unsigned(i), cached ? "was loaded from a stale entry" : "wasn't loaded from the cache");
+            ++fails;
+        }
+    }
+
+    remove(exporter);
+    remove(user);
+    return fails;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 3)
+    {
+        puts("usage: test_driver <cache dir> <file>...");
+        return 2;
+    }
+    const char *dir = argv[1];
+    char **files = argv + 2;
+    const size_t n = size_t(argc - 2);
+
+    GC gc = GC();
+    gc.alloc = testalloc;
+
+    CompileCache cache(dir);
+    const struct
+    {
+        const char *name;
+        unsigned nthreads;
+        CompileCache *cache;
+        bool shared;
+    } configs[] =
+    {
+        { "1 thread",                     1, NULL,   false }, // Reference
+        { "8 threads",                    8, NULL,   false },
+        { "8 threads, shared strings",    8, NULL,   true },
+        { "1 thread, cold cache",         1, &cache, false }, // Fills the cache
+        { "8 threads, warm cache",        8, &cache, false }, // Everything is loaded from there
+        { "1 thread, warm cache",         1, &cache, false },
+        { "8 threads, cache and shared",  8, &cache, true },
+    };
+    const size_t N = Countof(configs);
+
+    Result res[N];
+    int fails = 0;
+    for(size_t c = 0; c < N; ++c)
+    {
+        res[c].mods = gc_alloc_unmanaged_zero_T<PodArray<char> >(gc, n);
+        if(!compileAll(res[c], gc, files, n, configs[c].nthreads, configs[c].cache, configs[c].shared))
+        {
+            printf("FAIL: %s: couldn't compile or dump\n", configs[c].name);
+            ++fails;
+        }
+        if(res[c].fail)
+        {
+            printf("FAIL: %s: %u files failed to compile\n", configs[c].name, unsigned(res[c].fail));
+            ++fails;
+        }
+    }
+
+    for(size_t c = 1; c < N; ++c)
+        for(size_t i = 0; i < n; ++i)
+        {
+            const PodArray<char>& a = res[0].mods[i];
+            const PodArray<char>& b = res[c].mods[i];
+            if(a.size() != b.size() || memcmp(a.data(), b.data(), a.size()))
+            {
+                printf("FAIL: %s: %s differs\n", configs[c].name, files[i]);
+                ++fails;
+            }
+        }
+
+    for(size_t c = 0; c < N; ++c)
+    {
+        for(size_t i = 0; i < n; ++i)
+            res[c].mods[i].dealloc(gc);
+        gc_alloc_unmanaged_T(gc, res[c].mods, n, 0);
+    }
+
+    fails += checkExternals(cache, dir);
+
+    printf("%u files, %u configurations, %d failures\n", unsigned(n), unsigned(N), fails);
+    return !!fails;
+}
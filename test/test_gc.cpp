@@ -0,0 +1,151 @@
+// Runs full GC cycles and checks that strings and objects nothing refers to anymore are freed,
+// while everything that's reachable from a root (VM stack, ValStore, MLIR, parser symbols) stays.
+// usage: test_gc
+
+#include "runtime.h"
+#include "table.h"
+#include "valstore.h"
+#include "lex.h"
+#include "parser.h"
+#include "hlir.h"
+#include "mlir.h"
+#include "gavm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *testalloc(void *ud, void *ptr, size_t osz, size_t nsz)
+{
+    (void)ud;
+    (void)osz;
+    if(!nsz)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsz);
+}
+
+static int fails;
+
+#define CHECK(c) do { if(!(c)) { printf("FAIL: line %d: %s\n", __LINE__, #c); ++fails; } } while(0)
+
+static Val str(Runtime& rt, const char *s)
+{
+    return rt.sp.putval(s, strlen(s));
+}
+
+// Doesn't put anything into the pool, so it doesn't keep anything alive either
+static bool has(Runtime& rt, const char *s)
+{
+    return !!rt.sp.get(s, strlen(s)).id;
+}
+
+static bool samestr(Runtime& rt, const Val& v, const char *s)
+{
+    StrTmp tmp;
+    const Strp p = rt.sp.lookupval(v.u, tmp);
+    return p.len == strlen(s) && !memcmp(p.s, s, p.len);
+}
+
+static Val tableval(Table *t)
+{
+    Val v;
+    v.u.obj = t;
+    v.type = PRIMTYPE_TABLE;
+    return v;
+}
+
+static Table *newtable(Runtime& rt, const char *key)
+{
+    Table *t = Table::GCNew(rt.gc, Type{PRIMTYPE_ANY}, Type{PRIMTYPE_ANY});
+    if(t)
+        t->set(rt.gc, str(rt, key), Val(uint(1)));
+    return t;
+}
+
+int main()
+{
+    Runtime rt;
+    if(!rt.init(testalloc))
+        return 1;
+
+    VM vm;
+    vm.init(&rt, NULL);
+    GCroot vmroot = GCroot();
+    gc_addroot(rt.gc, vmroot, vm_markroot, &vm);
+    const VmStackAlloc sa = vm.stack_ensure(vm._stkbase, 3);
+    if(!sa.p)
+        return 1;
+
+    // Reachable
+    sa.p[0] = str(rt, "kept by the VM stack");
+    sa.p[1] = rt.sp.concatval(str(rt, "pending, and kept ").u, str(rt, "by the VM stack").u);
+    CHECK(IsPendingStr(sa.p[1].u));
+    Table *kept = newtable(rt, "key of a table on the VM stack");
+    CHECK(kept);
+    sa.p[2] = tableval(kept);
+
+    ValStore vs(rt.gc);
+    vs.put(str(rt, "kept by a ValStore"));
+
+    MLIR ml(rt.gc);
+    {
+        Lexer lex("var greeting = \"hello from a module\"");
+        Parser pp(&lex, "module", rt.gc, rt.sp);
+        HLIRBuilder hb(rt.gc);
+        pp.hlir = &hb;
+        const HLNode *root = pp.parse();
+        CHECK(root);
+        if(root)
+            ml.construct(root, rt.sp, MLIR::Options(0));
+        pp.syms.dealloc(rt.gc);
+    }
+
+    // The parser's symbols are roots while it exists
+    Lexer lex2("var only_the_parser_knows = 42");
+    Parser pp2(&lex2, "parser", rt.gc, rt.sp);
+    HLIRBuilder hb2(rt.gc);
+    pp2.hlir = &hb2;
+    CHECK(pp2.parse());
+
+    // Unreachable
+    str(rt, "nobody refers to this");
+    rt.sp.concatval(str(rt, "pending, and nobody ").u, str(rt, "refers to this").u);
+    CHECK(newtable(rt, "key of an unreachable table"));
+
+    const size_t objs = rt.gc.info.live_objs;
+    const size_t used = rt.gc.info.used;
+
+    // New strings start out marked, so it takes two cycles until unreachable ones are freed
+    gc_collect(rt);
+    gc_collect(rt);
+
+    CHECK(has(rt, "kept by the VM stack"));
+    CHECK(samestr(rt, sa.p[1], "pending, and kept by the VM stack"));
+    CHECK(has(rt, "key of a table on the VM stack"));
+    CHECK(kept->get(str(rt, "key of a table on the VM stack")).type == PRIMTYPE_UINT);
+    CHECK(has(rt, "kept by a ValStore"));
+    CHECK(has(rt, "hello from a module"));
+    CHECK(has(rt, "only_the_parser_knows"));
+
+    CHECK(!has(rt, "nobody refers to this"));
+    CHECK(!has(rt, "key of an unreachable table"));
+    CHECK(rt.gc.info.live_objs == objs - 1);
+    CHECK(rt.gc.info.used < used);
+
+    // Once the VM is gone, so is everything on its stack
+    gc_removeroot(rt.gc, vmroot);
+    gc_collect(rt);
+    gc_collect(rt);
+    CHECK(!has(rt, "kept by the VM stack"));
+    CHECK(!has(rt, "key of a table on the VM stack"));
+    CHECK(rt.gc.info.live_objs == objs - 2);
+    CHECK(has(rt, "kept by a ValStore"));
+
+    pp2.syms.dealloc(rt.gc);
+    gc_alloc_unmanaged_T(rt.gc, vm._stkbase, vm._stkend - vm._stkbase, 0);
+
+    printf("%d failures\n", fails);
+    return !!fails;
+}
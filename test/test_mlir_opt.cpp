@@ -0,0 +1,150 @@
+// Runs the MLIR optimization passes on a script, the same way main() does (inline, fold, dead code elimination),
+// and compares what the trackers counted with the script's expectations. Those are comment lines like
+//   -- expect: inlined 3 folded 4 removed 5
+// Counters that aren't mentioned aren't checked.
+// usage: test_mlir_opt <script>
+
+#include "runtime.h"
+#include "lex.h"
+#include "parser.h"
+#include "hlir.h"
+#include "mlir.h"
+#include "symtable.h"
+#include "rttypes.h"
+#include "rtops.h"
+#include "gainternal.h"
+#include "io_libc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void *testalloc(void *ud, void *ptr, size_t osz, size_t nsz)
+{
+    (void)ud;
+    (void)osz;
+    if(!nsz)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsz);
+}
+
+struct Counter
+{
+    const char *name;
+    unsigned got;
+};
+
+// Checks every "-- expect:" line in the file. Returns the number of mismatches, or -1 if there were no expectations.
+static int checkExpectations(const char *fn, const Counter *cs, size_t n)
+{
+    FILE *f = fopen(fn, "r");
+    if(!f)
+        return -1;
+
+    static const char tag[] = "-- expect:";
+    int bad = 0;
+    bool any = false;
+    char line[1024];
+    while(fgets(line, sizeof(line), f))
+    {
+        const char *p = strstr(line, tag);
+        if(!p)
+            continue;
+        any = true;
+        p += sizeof(tag) - 1;
+        char name[64];
+        unsigned want;
+        int adv;
+        while(sscanf(p, " %63s %u%n", name, &want, &adv) == 2)
+        {
+            p += adv;
+            size_t i = 0;
+            while(i < n && strcmp(cs[i].name, name))
+                ++i;
+            if(i == n)
+            {
+                printf("%s: unknown counter '%s'\n", fn, name);
+                ++bad;
+            }
+            else if(cs[i].got != want)
+            {
+                printf("%s: %s is %u, expected %u\n", fn, name, cs[i].got, want);
+                ++bad;
+            }
+        }
+    }
+    fclose(f);
+    return any ? bad : -1;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc != 2)
+    {
+        puts("usage: test_mlir_opt <script>");
+        return 2;
+    }
+    const char *fn = argv[1];
+
+    Runtime rt;
+    if(!rt.init(testalloc))
+        return 1;
+
+    BufStream sm;
+    if(sm_openFile(&sm, fn))
+    {
+        printf("%s: can't open\n", fn);
+        return 1;
+    }
+
+    Lexer lex(&sm, rt.gc);
+    Parser pp(&lex, fn, rt.gc, rt.sp);
+    HLIRBuilder hb(rt.gc);
+    pp.hlir = &hb;
+    const HLNode *root = pp.parse();
+    if(!root)
+    {
+        printf("%s: parse failed\n", fn);
+        sm.Close(&sm);
+        return 1;
+    }
+
+    SymTable *env = SymTable::GCNew(rt.gc);
+    VM vm;
+    vm.rt = &rt;
+    rtinit(*env, rt.gc, rt.sp, rt.tr);
+    reg_uint_ops(*env, rt);
+    reg_sint_ops(*env, rt);
+    reg_float_ops(*env, rt);
+    reg_bool_ops(*env, rt);
+
+    MLIR ml(rt.gc);
+    ml.construct(root, rt.sp, MLIR::Options(0));
+
+    MLInlineTracker it = { pp.syms, *env, 16, 0 };
+    ml.inlineCalls(it);
+    MLFoldTracker ft = { vm, *env, 0, 0, 0 };
+    ml.fold(ft);
+    MLDceTracker dt = { pp.syms, *env, rt, 0, 0 };
+    ml.eliminateDeadCode(dt);
+    sm.Close(&sm);
+
+    const Counter cs[] =
+    {
+        { "inlined",     it.ninlined },
+        { "folded",      ft.nfolded },
+        { "propagated",  ft.npropagated },
+        { "branches",    ft.nbranches },
+        { "removed",     dt.nremoved },
+        { "unreachable", dt.nunreachable },
+    };
+    for(size_t i = 0; i < Countof(cs); ++i)
+        printf("%s %u\n", cs[i].name, cs[i].got);
+
+    const int bad = checkExpectations(fn, cs, Countof(cs));
+    if(bad < 0)
+        printf("%s: no '-- expect:' line\n", fn);
+    return bad != 0;
+}
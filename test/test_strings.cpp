@@ -0,0 +1,324 @@
+// Pending strings (results of ++ that aren't interned yet, see strings.h) used where equal strings
+// must behave the same: as table keys and with ==.
+// SharedStringPool used from many threads at once, and as a layer under StringPools.
+// String snapshot files as the base layer of a runtime's pool. Those are written to the current directory.
+// usage: test_strings
+
+#include "runtime.h"
+#include "table.h"
+#include "rtstring.h"
+#include "gavm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+
+static void *testalloc(void *ud, void *ptr, size_t osz, size_t nsz)
+{
+    (void)ud;
+    (void)osz;
+    if(!nsz)
+    {
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, nsz);
+}
+
+static int fails;
+
+#define CHECK(c) do { if(!(c)) { printf("FAIL: line %d: %s\n", __LINE__, #c); ++fails; } } while(0)
+
+static Val str(Runtime& rt, const char *s)
+{
+    return rt.sp.putval(s, strlen(s));
+}
+
+// a ++ b, like the operator does it
+static Val concat(VM& vm, const Val& a, const Val& b)
+{
+    Val v[2] = { a, b };
+    return str_concat(&vm, v) == 1 ? v[0] : Val(_Nil());
+}
+
+static bool eq(VM& vm, const Val& a, const Val& b)
+{
+    Val v[2] = { a, b };
+    const int r = str_eq(&vm, v);
+    return r == 1 && v[0].type == PRIMTYPE_BOOL && v[0].u.ui;
+}
+
+static bool neq(VM& vm, const Val& a, const Val& b)
+{
+    Val v[2] = { a, b };
+    const int r = str_neq(&vm, v);
+    return r == 1 && v[0].type == PRIMTYPE_BOOL && v[0].u.ui;
+}
+
+static void testPending()
+{
+    Runtime rt;
+    if(!rt.init(testalloc))
+    {
+        ++fails;
+        return;
+    }
+    VM vm;
+    vm.rt = &rt;
+
+    // Long enough to not be inline, so these are pending
+    const Val k = concat(vm, str(rt, "hello, "), str(rt, "world!!"));
+    const Val k2 = concat(vm, str(rt, "hello, "), str(rt, "world!!"));
+    const Val other = concat(vm, str(rt, "hello, "), str(rt, "there!!"));
+    CHECK(k.type == PRIMTYPE_STRING && IsPendingStr(k.u));
+    CHECK(k2.type == PRIMTYPE_STRING && IsPendingStr(k2.u));
+    CHECK(other.type == PRIMTYPE_STRING && IsPendingStr(other.u));
+
+    // == before anything is interned
+    CHECK(eq(vm, k, k2));
+    CHECK(!eq(vm, k, other));
+    CHECK(neq(vm, k, other));
+
+    Table *t = Table::GCNew(rt.gc, Type{PRIMTYPE_ANY}, Type{PRIMTYPE_ANY});
+    CHECK(t);
+    if(!t)
+        return;
+
+    // Not a key yet, and not in the pool either
+    CHECK(t->get(other).type == PRIMTYPE_NIL);
+
+    t->set(rt.gc, k, Val(uint(42)));
+    CHECK(t->size() == 1);
+
+    const Val lit = str(rt, "hello, world!!");
+    CHECK(!IsPendingStr(lit.u));
+    CHECK(eq(vm, k, lit));
+    CHECK(eq(vm, lit, k2));
+    CHECK(!neq(vm, k, lit));
+    CHECK(!eq(vm, other, lit));
+
+    const Val a = t->get(lit);
+    CHECK(a.type == PRIMTYPE_UINT && a.u.ui == 42);
+    const Val b = t->get(k);
+    CHECK(b.type == PRIMTYPE_UINT && b.u.ui == 42);
+    const Val c = t->get(k2);
+    CHECK(c.type == PRIMTYPE_UINT && c.u.ui == 42);
+    CHECK(t->getp(k2) == t->getp(lit));
+    CHECK(t->get(other).type == PRIMTYPE_NIL);
+
+    // Same key, however it's spelled
+    t->set(rt.gc, k2, Val(uint(43)));
+    t->set(rt.gc, lit, Val(uint(44)));
+    CHECK(t->size() == 1);
+
+    const Val p = t->pop(k2);
+    CHECK(p.type == PRIMTYPE_UINT && p.u.ui == 44);
+    CHECK(t->size() == 0);
+    CHECK(t->get(lit).type == PRIMTYPE_NIL);
+}
+
+enum { NSHARED = 3000, NTHREADS = 8 };
+
+static void sharedname(char *buf, size_t n, unsigned i)
+{
+    snprintf(buf, n, "shared string #%u", i);
+}
+
+// Every thread puts all strings, starting somewhere else, and checks what it gets back right away
+struct SharedPut
+{
+    SharedStringPool *sh;
+    unsigned first;
+    unsigned bad;
+    sref refs[NSHARED];
+};
+
+static void sharedWorker(SharedPut *w)
+{
+    char buf[64];
+    for(unsigned k = 0; k < NSHARED; ++k)
+    {
+        const unsigned i = (w->first + k) % NSHARED;
+        sharedname(buf, sizeof(buf), i);
+        const size_t n = strlen(buf);
+        const Str s = w->sh->put(buf, n);
+        const Strp p = w->sh->lookup(s.id);
+        w->bad += !SharedStringPool::IsShared(s.id) || s.len != n || p.len != n || memcmp(p.s, buf, n)
+            || w->sh->get(buf, n).id != s.id;
+        w->refs[i] = s.id;
+    }
+}
+
+static void testShared()
+{
+    SharedStringPool sh(testalloc, NULL, 12345);
+    CHECK(sh.init());
+
+    SharedPut *w = (SharedPut*)calloc(NTHREADS, sizeof(SharedPut));
+    std::thread th[NTHREADS];
+    for(unsigned t = 0; t < NTHREADS; ++t)
+    {
+        w[t].sh = &sh;
+        w[t].first = t * (NSHARED / NTHREADS);
+        th[t] = std::thread(sharedWorker, &w[t]);
+    }
+    for(unsigned t = 0; t < NTHREADS; ++t)
+        th[t].join();
+
+    // Everyone got the same ref for the same string
+    char buf[64];
+    unsigned bad = 0, differ = 0;
+    for(unsigned t = 0; t < NTHREADS; ++t)
+    {
+        bad += w[t].bad;
+        for(unsigned i = 0; i < NSHARED; ++i)
+            differ += w[t].refs[i] != w[0].refs[i];
+    }
+    for(unsigned i = 0; i < NSHARED; ++i)
+    {
+        sharedname(buf, sizeof(buf), i);
+        differ += sh.get(buf, strlen(buf)).id != w[0].refs[i];
+        for(unsigned j = 0; j < i; ++j)
+            if(w[0].refs[j] == w[0].refs[i])
+                ++differ;
+    }
+    CHECK(!bad);
+    CHECK(!differ);
+    free(w);
+    CHECK(!sh.get("never put", 9).id);
+
+    // A runtime's pool keeps what it had first, and workers put new strings into the shared pool
+    Runtime rt;
+    CHECK(rt.init(testalloc));
+    const Str mine = rt.sp.put("here before it was shared");
+    rt.sp.attachShared(&sh);
+    CHECK(!SharedStringPool::IsShared(mine.id));
+
+    GC wgc = GC();
+    wgc.alloc = testalloc;
+    wgc.hashseed = rt.gc.hashseed;
+    StringPool wsp(wgc);
+    CHECK(wsp.init());
+    wsp.attachShared(&sh, true);
+
+    const Str a = wsp.put("here before it was shared");
+    const Str b = wsp.put("new in the worker");
+    CHECK(SharedStringPool::IsShared(a.id) && SharedStringPool::IsShared(b.id));
+    CHECK(wsp.put("shared string #7").id == sh.put("shared string #7").id);
+    CHECK(rt.sp.importFrom(wsp, a.id).id == mine.id);
+    CHECK(rt.sp.importFrom(wsp, b.id).id == b.id);
+    CHECK(rt.sp.put("new in the worker").id == b.id);
+    CHECK(rt.sp.get("here before it was shared").id == mine.id);
+
+    const Strp p = rt.sp.lookup(b.id);
+    CHECK(p.len == strlen("new in the worker") && !memcmp(p.s, "new in the worker", p.len));
+
+    // Shared strings are never collected. Once the runtime's own copy is gone, the shared one takes over.
+    gc_collect(rt);
+    gc_collect(rt);
+    CHECK(rt.sp.get("new in the worker").id == b.id);
+    CHECK(rt.sp.get("here before it was shared").id == a.id);
+
+    wsp.dealloc();
+}
+
+static bool isbase(Runtime& rt, const char *s, sref *ref)
+{
+    const Str q = rt.sp.get(s);
+    *ref = q.id;
+    const Strp p = q.id ? rt.sp.lookup(q.id) : Strp();
+    return StringSnapshot::IsBase(q.id) && rt.sp.put(s).id == q.id
+        && p.len == strlen(s) && !memcmp(p.s, s, p.len);
+}
+
+static void testSnapshot()
+{
+    static const char fn[] = "test_strings.snap", fn2[] = "test_strings2.snap";
+    char buf[64];
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc));
+        CHECK(!rt.sp.base());
+        rt.sp.put("in the snapshot");
+        for(unsigned i = 0; i < 500; ++i)
+        {
+            snprintf(buf, sizeof(buf), "snapshot name %u", i);
+            rt.sp.put(buf);
+        }
+        CHECK(!rt.saveStrings(fn));
+    }
+
+    sref ref, ref2;
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc, fn));
+        CHECK(rt.sp.base());
+        CHECK(isbase(rt, "in the snapshot", &ref));
+        bool all = true;
+        for(unsigned i = 0; i < 500; ++i)
+        {
+            snprintf(buf, sizeof(buf), "snapshot name %u", i);
+            all = isbase(rt, buf, &ref2) && all;
+        }
+        CHECK(all);
+
+        const Str own = rt.sp.put("not in the snapshot");
+        CHECK(own.id && !StringSnapshot::IsBase(own.id));
+
+        // The base layer is never collected
+        gc_collect(rt);
+        gc_collect(rt);
+        CHECK(isbase(rt, "in the snapshot", &ref2) && ref2 == ref);
+        CHECK(!rt.sp.get("not in the snapshot").id);
+
+        // A snapshot of a pool with a base layer has both
+        rt.sp.put("not in the snapshot");
+        CHECK(!rt.saveStrings(fn2));
+    }
+
+    // Refs stay the same with the same file
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc, fn));
+        CHECK(isbase(rt, "in the snapshot", &ref2) && ref2 == ref);
+    }
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc, fn2));
+        CHECK(isbase(rt, "in the snapshot", &ref2));
+        CHECK(isbase(rt, "not in the snapshot", &ref2));
+    }
+
+    // A broken file is ignored
+    FILE *f = fopen(fn2, "wb");
+    CHECK(f);
+    if(f)
+    {
+        fputs("not a snapshot, not a snapshot", f);
+        fclose(f);
+    }
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc, fn2));
+        CHECK(!rt.sp.base());
+        CHECK(rt.sp.put("in the snapshot").id);
+    }
+    {
+        Runtime rt;
+        CHECK(rt.init(testalloc, "test_strings.missing"));
+        CHECK(!rt.sp.base());
+    }
+
+    remove(fn);
+    remove(fn2);
+}
+
+int main()
+{
+    testPending();
+    testShared();
+    testSnapshot();
+
+    printf("%d failures\n", fails);
+    return !!fails;
+}